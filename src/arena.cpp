@@ -0,0 +1,45 @@
+#include "arena.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------
+Arena::Arena(size_t blockSize)
+{
+	m_blockSize = blockSize;
+	m_pos = m_end = nullptr;
+}
+
+// ----------------------------------------------------------------------------
+Arena::~Arena()
+{
+	clear();
+}
+
+// ----------------------------------------------------------------------------
+void* Arena::alloc(size_t size, size_t align)
+{
+	uintptr_t pos = ((uintptr_t)m_pos + align - 1) & ~(uintptr_t)(align - 1);
+	
+	if (!m_pos || pos + size > (uintptr_t)m_end)
+	{
+		// start a new block, big enough for this allocation if it's unusually large
+		const size_t blockSize = std::max(m_blockSize, size + align);
+		uint8_t *block = new uint8_t[blockSize];
+		m_blocks.push_back(block);
+		m_end = block + blockSize;
+		
+		pos = ((uintptr_t)block + align - 1) & ~(uintptr_t)(align - 1);
+	}
+	
+	m_pos = (uint8_t*)(pos + size);
+	return (void*)pos;
+}
+
+// ----------------------------------------------------------------------------
+void Arena::clear()
+{
+	for (auto block : m_blocks)
+		delete[] block;
+	m_blocks.clear();
+	m_pos = m_end = nullptr;
+}
@@ -0,0 +1,38 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// simple bump allocator for objects that all live as long as their owner.
+// memory is only released all at once; objects' destructors must be called manually
+class Arena
+{
+public:
+	Arena(size_t blockSize = 4096);
+	~Arena();
+	
+	void* alloc(size_t size, size_t align = alignof(std::max_align_t));
+	
+	template<typename T, typename... Args>
+	T* create(Args&&... args)
+	{
+		return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+	
+	// release all memory
+	void clear();
+	
+private:
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	
+	std::vector<uint8_t*> m_blocks;
+	size_t m_blockSize;
+	uint8_t *m_pos, *m_end; // free space in the current block
+};
+
+#endif // __ARENA_H
@@ -0,0 +1,592 @@
+#include "batch.h"
+#include "cache.h"
+#include "render.h"
+#include "threadpool.h"
+#include "wav.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+
+// number of output samples generated at a time
+static const unsigned blockSize = 4096;
+
+const unsigned OPLBatch::checkpointSize;
+
+// ----------------------------------------------------------------------------
+// compare a block of output (stereo or mono, like the reference) to the next block of a reference file,
+// and describe the first difference (if any)
+static std::string compare(WAVReader& ref, const int16_t *data, unsigned numSamples,
+                           uint32_t startSample, int tolerance)
+{
+	const unsigned numChannels = ref.stereo() ? 2 : 1;
+	static const char *channelNames[2] = {"left", "right"};
+	std::vector<int16_t> refData(numSamples * 2);
+	const unsigned count = ref.read(refData.data(), numSamples);
+	
+	for (unsigned i = 0; i < count; i++)
+	{
+		for (unsigned ch = 0; ch < numChannels; ch++)
+		{
+			const int sample = data[i*numChannels + ch];
+			const int refSample = refData[i*2 + ch];
+			if (abs(sample - refSample) > tolerance)
+			{
+				char buf[128];
+				snprintf(buf, sizeof(buf), "sample %u at %.3fs differs, %s: %d, expected %d",
+					startSample + i, (double)(startSample + i) / ref.sampleRate(),
+					ref.stereo() ? channelNames[ch] : "mono", sample, refSample);
+				return buf;
+			}
+		}
+	}
+	
+	if (count < numSamples)
+		return "output is longer than reference, which has " + std::to_string(ref.numSamples()) + " samples";
+	return "";
+}
+
+// ----------------------------------------------------------------------------
+// hash a block of output, and save the hash so far every 'checkpointSize' samples.
+// each checkpoint is the number of samples hashed and the hash at that point
+typedef std::pair<uint32_t, uint64_t> Checkpoint;
+
+static uint64_t hashBlock(const int16_t *data, unsigned numSamples, uint32_t startSample, bool mono,
+                          uint64_t hash, std::vector<Checkpoint>& checkpoints)
+{
+	const unsigned numChannels = mono ? 1 : 2;
+	
+	while (numSamples)
+	{
+		const unsigned count = std::min(numSamples, OPLBatch::checkpointSize - startSample % OPLBatch::checkpointSize);
+		hash = OPLRender::hash(data, count, hash, mono);
+		
+		data += count * numChannels;
+		numSamples -= count;
+		startSample += count;
+		if (!(startSample % OPLBatch::checkpointSize))
+			checkpoints.push_back({startSample, hash});
+	}
+	
+	return hash;
+}
+
+// ----------------------------------------------------------------------------
+static bool saveHashes(const char *path, const std::vector<Checkpoint>& checkpoints)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return false;
+	
+	for (auto& checkpoint : checkpoints)
+		fprintf(file, "%u %016llx\n", checkpoint.first, (unsigned long long)checkpoint.second);
+	
+	return !fclose(file);
+}
+
+// ----------------------------------------------------------------------------
+// compare the output's checkpoints to the ones in a hash file, and describe the first difference (if any)
+static std::string compareHashes(const char *path, const std::vector<Checkpoint>& checkpoints,
+                                 uint32_t sampleRate)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return std::string("couldn't open ") + path;
+	
+	std::vector<Checkpoint> expected;
+	unsigned numSamples;
+	unsigned long long hash;
+	while (fscanf(file, "%u %llx", &numSamples, &hash) == 2)
+		expected.push_back({numSamples, hash});
+	fclose(file);
+	
+	if (expected.empty())
+		return std::string("no hashes in ") + path;
+	
+	for (size_t i = 0; i < checkpoints.size() && i < expected.size(); i++)
+	{
+		if (checkpoints[i].first != expected[i].first)
+		{
+			// (only the last checkpoint can be at a different point, if the output is a different length)
+			break;
+		}
+		else if (checkpoints[i].second != expected[i].second)
+		{
+			const uint32_t start = i ? checkpoints[i-1].first : 0;
+			const uint32_t end = checkpoints[i].first - 1;
+			char buf[256];
+			snprintf(buf, sizeof(buf), "output first differs from %s in samples %u-%u (%.3f-%.3fs), use ref= to find the exact sample",
+				path, start, end, (double)start / sampleRate, (double)end / sampleRate);
+			return buf;
+		}
+	}
+	
+	if (checkpoints.back().first != expected.back().first)
+	{
+		return "output has " + std::to_string(checkpoints.back().first) + " samples, "
+			+ path + " has " + std::to_string(expected.back().first);
+	}
+	return "";
+}
+
+// ----------------------------------------------------------------------------
+BatchResult OPLBatch::render(const BatchJob& job, std::shared_ptr<const PatchBank> patches,
+                             const OPLCache *cache)
+{
+	OPLPlayer player(job.numChips, job.chipType);
+	return render(job, player, player.fixedPoint(), patches, cache);
+}
+
+// ----------------------------------------------------------------------------
+BatchResult OPLBatch::render(const BatchJob& job, OPLPlayer& player, bool fixedPoint,
+                             std::shared_ptr<const PatchBank> patches, const OPLCache *cache)
+{
+	BatchResult result;
+	const auto startTime = std::chrono::steady_clock::now();
+	
+	if (!job.patchPath.empty())
+	{
+		auto bank = std::make_shared<PatchBank>();
+		if (!bank->load(job.patchPath.c_str()))
+		{
+			result.error = "couldn't load " + job.patchPath;
+			return result;
+		}
+		patches = bank;
+	}
+	
+	player.setPatches(patches);
+	
+	if (!player.loadSequence(job.songPath.c_str()))
+	{
+		result.error = "couldn't load " + job.songPath;
+		return result;
+	}
+	
+	player.setLoop(false);
+	player.setSampleRate(job.sampleRate);
+	player.setGain(job.gain);
+	player.setFilter(job.filter);
+	player.setStereo(job.stereo);
+	// only render one channel for mono output
+	player.setMonoOutput(!player.stereo());
+	player.setFixedPoint(job.fixedPoint || fixedPoint);
+	player.setElastic(job.minChips);
+	if (job.songNum > 0)
+		player.setSongNum(job.songNum);
+	
+	// start over from silence, in case the player was used for another song
+	player.resetOutput();
+	player.reset();
+	
+	WAVWriter wav;
+	if (!wav.open(job.outPath.c_str(), player.sampleRate(), player.stereo()))
+	{
+		result.error = "couldn't open " + job.outPath;
+		return result;
+	}
+	
+	// when updating, the output is saved to the reference file instead of being compared to it
+	WAVReader ref;
+	WAVWriter refOut;
+	if (!job.refPath.empty() && job.update)
+	{
+		if (!refOut.open(job.refPath.c_str(), player.sampleRate(), player.stereo()))
+		{
+			result.error = "couldn't open " + job.refPath;
+			return result;
+		}
+	}
+	else if (!job.refPath.empty())
+	{
+		if (!ref.open(job.refPath.c_str()))
+		{
+			result.error = "couldn't open " + job.refPath;
+			return result;
+		}
+		if (ref.sampleRate() != player.sampleRate() || ref.stereo() != player.stereo())
+		{
+			result.error = "output format doesn't match " + job.refPath;
+			return result;
+		}
+	}
+	
+	bool ok = true;
+	std::string diff;
+	std::vector<Checkpoint> checkpoints;
+	result.hash = OPLRender::hashInit;
+	
+	auto output = [&](const int16_t *samples, unsigned count)
+	{
+		if (refOut.isOpen())
+			ok = refOut.write(samples, count);
+		else if (!job.refPath.empty() && diff.empty())
+			diff = compare(ref, samples, count, wav.numSamples(), job.tolerance);
+		result.hash = hashBlock(samples, count, wav.numSamples(), player.monoOutput(), result.hash, checkpoints);
+		
+		ok = ok && wav.write(samples, count);
+		return ok;
+	};
+	
+	if (cache && !job.floatOutput)
+	{
+		OPLCache::Result cacheResult;
+		cache->render(player, output, &cacheResult);
+		result.cached = (cacheResult == OPLCache::Hit);
+	}
+	else if (job.floatOutput)
+	{
+		// convert each block of floating-point output to 16-bit for comparing and writing
+		std::vector<float> floatBuffer(blockSize * 2);
+		std::vector<int16_t> buffer(blockSize * 2);
+		player.generateBlocks(floatBuffer.data(), blockSize, [&](const float *samples, unsigned count)
+		{
+			for (unsigned i = 0; i < count * (player.monoOutput() ? 1 : 2); i++)
+				buffer[i] = ymfm::clamp((int)lround(samples[i] * 32767.0), -32768, 32767);
+			return output(buffer.data(), count);
+		});
+	}
+	else
+	{
+		// blocks end at each MIDI event, so the output ends exactly when the song does
+		std::vector<int16_t> buffer(blockSize * 2);
+		player.generateBlocks(buffer.data(), blockSize, output);
+	}
+	
+	if (!ok || !wav.close())
+	{
+		result.error = "writing " + job.outPath + " failed";
+		return result;
+	}
+	if (refOut.isOpen() && !refOut.close())
+	{
+		result.error = "writing " + job.refPath + " failed";
+		return result;
+	}
+	
+	result.numSamples = wav.numSamples();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	
+	if (ref.isOpen() && diff.empty() && result.numSamples < ref.numSamples())
+		diff = "output is shorter than reference, which has " + std::to_string(ref.numSamples()) + " samples";
+	
+	// the last checkpoint is always the hash of the whole output
+	if (checkpoints.empty() || checkpoints.back().first != result.numSamples)
+		checkpoints.push_back({result.numSamples, result.hash});
+	
+	if (!job.hashPath.empty() && job.update)
+	{
+		if (!saveHashes(job.hashPath.c_str(), checkpoints))
+		{
+			result.error = "writing " + job.hashPath + " failed";
+			return result;
+		}
+	}
+	else if (!job.hashPath.empty() && diff.empty())
+	{
+		diff = compareHashes(job.hashPath.c_str(), checkpoints, player.sampleRate());
+	}
+	
+	if (!diff.empty())
+	{
+		result.error = diff;
+	}
+	else if (job.hash && result.hash != job.hash)
+	{
+		// a single hash can't tell where the output changed, but a hash file or reference WAV can
+		char buf[128];
+		snprintf(buf, sizeof(buf), "hash %016llx, expected %016llx (use hashes= or ref= to find the first difference)",
+			(unsigned long long)result.hash, (unsigned long long)job.hash);
+		result.error = buf;
+	}
+	else
+	{
+		result.ok = true;
+	}
+	
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+bool OPLBatch::render(const std::vector<BatchJob>& jobs, std::shared_ptr<const PatchBank> patches,
+                      std::vector<BatchResult>& results, unsigned numThreads,
+                      DoneFunc done, const OPLCache *cache)
+{
+	results.clear();
+	results.resize(jobs.size());
+	
+	std::mutex doneMutex;
+	bool ok = true;
+	
+	if (!numThreads)
+		numThreads = ThreadPool::defaultThreads();
+	ThreadPool pool(std::min(numThreads, (unsigned)std::max(jobs.size(), (size_t)1)));
+	
+	// players that aren't being used right now, to be reused by the next song that needs the same chips.
+	// a song only needs a new player when none of these match it, and then replaces one of them (if any),
+	// so there are never more players than songs being rendered at once
+	struct Player
+	{
+		OPLPlayer *player;
+		OPLPlayer::ChipType chipType;
+		int numChips;
+		bool fixedPoint; // default setting (see render)
+	};
+	std::mutex playerMutex;
+	std::vector<Player> players;
+	
+	auto run = [&](size_t i, const BatchJob *job)
+	{
+		pool.run([&, i, job]
+		{
+			Player player = {};
+			{
+				std::lock_guard<std::mutex> lock(playerMutex);
+				auto match = std::find_if(players.begin(), players.end(), [job](const Player& p)
+				{
+					return p.chipType == job->chipType && p.numChips == job->numChips;
+				});
+				if (match != players.end())
+				{
+					player = *match;
+					players.erase(match);
+				}
+				else if (!players.empty())
+				{
+					// nothing to reuse, so this song's player replaces an unused one
+					delete players.back().player;
+					players.pop_back();
+				}
+			}
+			if (!player.player)
+			{
+				player = {new OPLPlayer(job->numChips, job->chipType), job->chipType, job->numChips, false};
+				player.fixedPoint = player.player->fixedPoint();
+			}
+			
+			results[i] = render(*job, *player.player, player.fixedPoint, patches, cache);
+			{
+				std::lock_guard<std::mutex> lock(playerMutex);
+				players.push_back(player);
+			}
+			
+			std::lock_guard<std::mutex> lock(doneMutex);
+			ok &= results[i].ok;
+			if (done)
+				done(i, jobs[i], results[i]);
+		});
+	};
+	
+	// when updating, songs that share a reference or hash file with an earlier one
+	// wait until it's been saved, and then get checked against it
+	std::set<std::string> savedPaths;
+	std::vector<std::pair<size_t, BatchJob>> checkLater;
+	
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i].update)
+		{
+			bool shared = !jobs[i].refPath.empty() && !savedPaths.insert(jobs[i].refPath).second;
+			shared |= !jobs[i].hashPath.empty() && !savedPaths.insert(jobs[i].hashPath).second;
+			if (shared)
+			{
+				checkLater.push_back({i, jobs[i]});
+				checkLater.back().second.update = false;
+				continue;
+			}
+		}
+		run(i, &jobs[i]);
+	}
+	pool.wait();
+	
+	for (auto& job : checkLater)
+		run(job.first, &job.second);
+	pool.wait();
+	
+	for (auto& player : players)
+		delete player.player;
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+static std::vector<std::string> splitLine(const std::string& line)
+{
+	std::vector<std::string> tokens;
+	size_t pos = 0;
+	
+	while (true)
+	{
+		pos = line.find_first_not_of(" \t\r\n", pos);
+		if (pos == std::string::npos)
+			break;
+		
+		size_t end;
+		if (line[pos] == '"')
+		{
+			end = line.find('"', ++pos);
+			if (end == std::string::npos)
+				end = line.size();
+			tokens.push_back(line.substr(pos, end - pos));
+			end++;
+		}
+		else
+		{
+			end = line.find_first_of(" \t\r\n", pos);
+			if (end == std::string::npos)
+				end = line.size();
+			tokens.push_back(line.substr(pos, end - pos));
+		}
+		pos = end;
+	}
+	
+	return tokens;
+}
+
+// ----------------------------------------------------------------------------
+static bool parseSetting(const std::string& setting, BatchJob& job)
+{
+	const size_t split = setting.find('=');
+	const std::string name = setting.substr(0, split);
+	const char *value = (split != std::string::npos) ? setting.c_str() + split + 1 : nullptr;
+	
+	if (name == "mono")
+	{
+		job.stereo = false;
+		return true;
+	}
+	else if (name == "float")
+	{
+		job.floatOutput = true;
+		return true;
+	}
+	else if (name == "fixed")
+	{
+		job.fixedPoint = true;
+		return true;
+	}
+	else if (!value || !*value)
+	{
+		return false;
+	}
+	
+	if (name == "song")
+	{
+		int num = atoi(value);
+		if (num < 1) return false;
+		job.songNum = num - 1;
+	}
+	else if (name == "chip")
+	{
+		switch (atoi(value))
+		{
+		case 1: job.chipType = OPLPlayer::ChipOPL; break;
+		case 2: job.chipType = OPLPlayer::ChipOPL2; break;
+		case 3: job.chipType = OPLPlayer::ChipOPL3; break;
+		default: return false;
+		}
+	}
+	else if (name == "num")
+	{
+		job.numChips = atoi(value);
+		if (job.numChips < 1) return false;
+	}
+	else if (name == "elastic")
+	{
+		int num = atoi(value);
+		if (num < 1) return false;
+		job.minChips = num;
+	}
+	else if (name == "rate")
+	{
+		job.sampleRate = atoi(value);
+		if (!job.sampleRate) return false;
+	}
+	else if (name == "gain")
+	{
+		job.gain = atof(value);
+		if (!job.gain) return false;
+	}
+	else if (name == "filter")
+	{
+		job.filter = atof(value);
+		if (job.filter < 0.0) return false;
+	}
+	else if (name == "patches")
+	{
+		job.patchPath = value;
+	}
+	else if (name == "hash")
+	{
+		char *end;
+		job.hash = strtoull(value, &end, 16);
+		if (*end) return false;
+	}
+	else if (name == "hashes")
+	{
+		job.hashPath = value;
+	}
+	else if (name == "ref")
+	{
+		job.refPath = value;
+	}
+	else if (name == "tol")
+	{
+		job.tolerance = atoi(value);
+		if (job.tolerance < 0) return false;
+	}
+	else
+	{
+		return false;
+	}
+	
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool OPLBatch::loadList(const char *path, const BatchJob& defaults,
+                        std::vector<BatchJob>& jobs, std::string& error)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		error = std::string("couldn't open ") + path;
+		return false;
+	}
+	
+	char buf[4096];
+	unsigned lineNum = 0;
+	bool ok = true;
+	
+	while (ok && fgets(buf, sizeof(buf), file))
+	{
+		lineNum++;
+		
+		const auto tokens = splitLine(buf);
+		if (tokens.empty() || tokens[0][0] == '#')
+			continue;
+		
+		BatchJob job = defaults;
+		ok = (tokens.size() >= 2);
+		if (ok)
+		{
+			job.songPath = tokens[0];
+			job.outPath  = tokens[1];
+		}
+		
+		for (size_t i = 2; ok && i < tokens.size(); i++)
+			ok = parseSetting(tokens[i], job);
+		
+		if (ok)
+			jobs.push_back(job);
+		else
+			error = std::string(path) + ": invalid entry on line " + std::to_string(lineNum);
+	}
+	
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,100 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "player.h"
+
+class OPLCache;
+
+// settings for one song in a batch render
+struct BatchJob
+{
+	std::string songPath;
+	std::string outPath;
+	
+	OPLPlayer::ChipType chipType = OPLPlayer::ChipOPL3;
+	int numChips = 1;
+	unsigned minChips = 0; // only run this many chips until more are needed, if nonzero (see OPLPlayer::setElastic)
+	unsigned songNum = 0; // zero-based
+	uint32_t sampleRate = 44100;
+	double gain = 1.0;
+	double filter = 5.0;
+	bool stereo = true;
+	bool floatOutput = false; // render with the floating-point version of OPLPlayer::generate
+	bool fixedPoint = false; // use fixed-point resampling and filtering (see OPLPlayer::setFixedPoint)
+	
+	// patches to use for this song instead of the ones shared by the whole batch
+	std::string patchPath;
+	
+	// for regression testing:
+	// expected hash of the output (see OPLRender::hash), if nonzero
+	uint64_t hash = 0;
+	// reference WAV file to compare the output to, if any,
+	// and the maximum difference allowed for each sample
+	std::string refPath;
+	int tolerance = 0;
+	// file of the output's hash at regular points (see OPLBatch::checkpointSize) to check it against.
+	// if it doesn't match, a reference WAV file can tell exactly where the output changed
+	std::string hashPath;
+	// save the output to the reference and hash files (if any) instead of checking it
+	bool update = false;
+};
+
+struct BatchResult
+{
+	bool ok = false;
+	std::string error;
+	uint32_t numSamples = 0;
+	double seconds = 0.0; // time spent loading and rendering this song
+	uint64_t hash = 0; // hash of the output (see OPLRender::hash)
+	bool cached = false; // output was read from a render cache
+};
+
+class OPLBatch
+{
+public:
+	// number of output samples between each hash saved to a hash file (see BatchJob::hashPath)
+	static const unsigned checkpointSize = 4096;
+	
+	// called as each song finishes rendering (one call at a time, from any worker thread)
+	typedef std::function<void(size_t index, const BatchJob& job, const BatchResult& result)> DoneFunc;
+	
+	// render a list of songs to WAV files, using up to 'numThreads' songs at once
+	// (or one per CPU core if 0), with one OPLPlayer per worker sharing the same patches.
+	// each worker's player is reused for the next song, unless that one needs a different number or type of chips.
+	// if 'cache' is set, songs that have been rendered before are read from it instead (see cache.h).
+	// when updating, a reference or hash file that's used by more than one song is only saved once,
+	// and the other songs are checked against it afterwards.
+	// returns true if all songs were rendered successfully
+	static bool render(const std::vector<BatchJob>& jobs, std::shared_ptr<const PatchBank> patches,
+	                   std::vector<BatchResult>& results, unsigned numThreads = 0,
+	                   DoneFunc done = nullptr, const OPLCache *cache = nullptr);
+	
+	// render a single song to a WAV file.
+	// if the job has an expected hash, a hash file or a reference WAV file and the output doesn't match it,
+	// the result isn't ok and 'error' describes the first difference (down to the sample, if there's a reference)
+	static BatchResult render(const BatchJob& job, std::shared_ptr<const PatchBank> patches,
+	                          const OPLCache *cache = nullptr);
+	
+	// read a list of songs from a text file, one per line:
+	//   song_path out_path [setting=value ...]
+	// paths containing spaces can be quoted, and lines starting with '#' are ignored.
+	// supported settings (any others use the values from 'defaults'):
+	//   song=<num> (one-based), chip=<1-3>, num=<num>, elastic=<num>, rate=<num>, gain=<num>,
+	//   filter=<num>, mono, fixed, float, patches=<path>, hash=<hex>, hashes=<path>, ref=<path>, tol=<num>
+	// on failure, 'error' describes the first invalid line
+	static bool loadList(const char *path, const BatchJob& defaults,
+	                     std::vector<BatchJob>& jobs, std::string& error);
+
+private:
+	// render a single song with a player that may have already been used for another one
+	// (with the same number and type of chips), restoring all of its settings first.
+	// 'fixedPoint' is the player's default fixed-point setting, for songs that don't enable it
+	static BatchResult render(const BatchJob& job, OPLPlayer& player, bool fixedPoint,
+	                          std::shared_ptr<const PatchBank> patches, const OPLCache *cache);
+};
+
+#endif // __BATCH_H
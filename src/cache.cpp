@@ -0,0 +1,499 @@
+#include "cache.h"
+#include "datablock.h"
+#include "sequence.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/file.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const char cacheMagic[16] = "YMFMIDI-CACHE";
+static const uint16_t cacheVersion = 4;
+static const unsigned cacheHeaderSize = 64;
+static const unsigned stateHeaderSize = 16;
+
+// number of output samples rendered and saved at a time
+static const uint32_t chunkSize = 1 << 16;
+// number of cached output samples passed to the output function at a time
+static const uint32_t outputBlockSize = 4096;
+
+struct CacheHeader
+{
+	bool complete = false;
+	uint32_t chunkSize = 0;
+	uint32_t numSamples = 0; // number of samples saved so far
+};
+
+// ----------------------------------------------------------------------------
+static uint32_t read32(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+}
+
+// ----------------------------------------------------------------------------
+static void write32(uint8_t *data, uint32_t value)
+{
+	for (unsigned i = 0; i < 4; i++)
+		data[i] = value >> (8 * i);
+}
+
+// ----------------------------------------------------------------------------
+static uint64_t hashBytes(const void *data, size_t size, uint64_t hash)
+{
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	
+	return hash;
+}
+
+// ----------------------------------------------------------------------------
+static bool lockFile(FILE *file, bool exclusive)
+{
+	// (locks are released when the file is closed)
+#ifndef _WIN32
+	return !flock(fileno(file), (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB);
+#else
+	// lock the whole file (including anything written past the current end)
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	OVERLAPPED overlapped = {0};
+	const DWORD flags = (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | LOCKFILE_FAIL_IMMEDIATELY;
+	return handle != INVALID_HANDLE_VALUE && LockFileEx(handle, flags, 0, MAXDWORD, MAXDWORD, &overlapped);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+static bool readHeader(FILE *file, uint64_t key, CacheHeader& header)
+{
+	uint8_t data[cacheHeaderSize];
+	if (fseek(file, 0, SEEK_SET)
+	    || fread(data, 1, sizeof(data), file) != sizeof(data)
+	    || memcmp(data, cacheMagic, sizeof(cacheMagic))
+	    || (data[16] | (data[17] << 8)) != cacheVersion
+	    || read32(data + 32) != (uint32_t)key
+	    || read32(data + 36) != (uint32_t)(key >> 32))
+		return false;
+	
+	header.complete = data[18] & 1;
+	header.chunkSize = read32(data + 20);
+	header.numSamples = read32(data + 24);
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+static bool writeHeader(FILE *file, uint64_t key, const CacheHeader& header)
+{
+	uint8_t data[cacheHeaderSize] = {0};
+	memcpy(data, cacheMagic, sizeof(cacheMagic));
+	data[16] = cacheVersion;
+	data[17] = cacheVersion >> 8;
+	data[18] = header.complete ? 1 : 0;
+	write32(data + 20, header.chunkSize);
+	write32(data + 24, header.numSamples);
+	write32(data + 32, key);
+	write32(data + 36, key >> 32);
+	
+	return !fseek(file, 0, SEEK_SET)
+		&& fwrite(data, 1, sizeof(data), file) == sizeof(data)
+		&& !fflush(file);
+}
+
+// ----------------------------------------------------------------------------
+static bool loadState(const std::string& path, uint64_t key, uint32_t& numSamples, std::vector<uint8_t>& state)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file) return false;
+	
+	uint8_t header[stateHeaderSize];
+	bool ok = fread(header, 1, sizeof(header), file) == sizeof(header)
+		&& read32(header) == (uint32_t)key
+		&& read32(header + 4) == (uint32_t)(key >> 32);
+	if (ok)
+	{
+		numSamples = read32(header + 8);
+		state.resize(read32(header + 12));
+		ok = numSamples && fread(state.data(), 1, state.size(), file) == state.size();
+	}
+	
+	fclose(file);
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+static bool saveState(const std::string& path, uint64_t key, uint32_t numSamples, const std::vector<uint8_t>& state)
+{
+	// replace the old state all at once, so it's never only partially written
+	const std::string tempPath = path + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if (!file) return false;
+	
+	uint8_t header[stateHeaderSize];
+	write32(header, key);
+	write32(header + 4, key >> 32);
+	write32(header + 8, numSamples);
+	write32(header + 12, state.size());
+	
+	bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header)
+		&& fwrite(state.data(), 1, state.size(), file) == state.size();
+	ok &= !fclose(file);
+#ifdef _WIN32
+	// (rename doesn't replace an existing file on Windows)
+	if (ok)
+		remove(path.c_str());
+#endif
+	
+	return ok && !rename(tempPath.c_str(), path.c_str());
+}
+
+// ----------------------------------------------------------------------------
+static uint32_t outputSamples(const DataBlock& block, uint32_t numSamples, unsigned numChannels,
+                              OPLRender::OutputFunc output)
+{
+	const int16_t *samples = (const int16_t*)block.data();
+	uint32_t samplesDone = 0;
+	while (samplesDone < numSamples)
+	{
+		const uint32_t count = std::min(numSamples - samplesDone, outputBlockSize);
+		samplesDone += count;
+		
+		if (!output(samples + (samplesDone - count) * numChannels, count))
+			break;
+	}
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+OPLCache::OPLCache(const char *dir, uint64_t maxSize)
+{
+	m_dir = dir;
+	m_maxSize = maxSize;
+	
+	// (fails harmlessly if it already exists)
+#ifdef _WIN32
+	mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+std::string OPLCache::path(uint64_t key, const char *ext) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx%s", (unsigned long long)key, ext);
+	return m_dir + name;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t OPLCache::key(const OPLPlayer& player)
+{
+	auto song = player.sequenceData();
+	// (the patch bank's hash is only worked out once, however many songs use it)
+	const uint64_t patches = player.m_patches ? player.m_patches->hash() : 0;
+	
+	const uint32_t settings[] =
+	{
+		cacheVersion,
+		song ? (uint32_t)song->block.size() : 0,
+		player.m_patches ? (uint32_t)player.m_patches->size() : 0,
+		player.m_chipType,
+		(uint32_t)player.m_voices.size(),
+		player.m_minChips,
+		player.m_chipIdleLimit,
+		player.m_sampleRate,
+		player.m_stereo,
+		player.m_monoOutput,
+		player.m_fixedPoint,
+		player.songNum()
+	};
+	
+	uint64_t hash = hashBytes(settings, sizeof(settings), OPLRender::hashInit);
+	hash = hashBytes(&player.m_sampleGain, sizeof(double), hash);
+	hash = hashBytes(&player.m_hpFilterFreq, sizeof(double), hash);
+	if (song)
+		hash = hashBytes(song->block.data(), song->block.size(), hash);
+	hash = hashBytes(&patches, sizeof(patches), hash);
+	
+	return hash;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t OPLCache::render(OPLPlayer& player, OPLRender::OutputFunc output, Result *result) const
+{
+	const uint64_t key = OPLCache::key(player);
+	const std::string entryPath = path(key, ".ymc");
+	const unsigned numChannels = player.m_monoOutput ? 1 : 2;
+	const size_t sampleSize = numChannels * sizeof(int16_t);
+	
+	// if the song has already been rendered, just read it back
+	FILE *file = fopen(entryPath.c_str(), "rb");
+	if (file)
+	{
+		CacheHeader header;
+		DataBlock block;
+		if (lockFile(file, false) && readHeader(file, key, header) && header.complete
+		    && (!header.numSamples || block.map(file, cacheHeaderSize, (size_t)header.numSamples * sampleSize)))
+		{
+			fclose(file);
+			// (mark it as recently used)
+			utime(entryPath.c_str(), nullptr);
+			
+			if (result) *result = Hit;
+			return outputSamples(block, header.numSamples, numChannels, output);
+		}
+		
+		fclose(file);
+	}
+	
+	// otherwise render (or finish rendering) it, unless another process already is
+	// (note: opening with fopen would either fail or truncate the file if it doesn't exist yet)
+	int fd = open(entryPath.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+	file = (fd >= 0) ? fdopen(fd, "r+b") : nullptr;
+	if (file && lockFile(file, true))
+	{
+		const uint32_t numSamples = renderEntry(player, output, file, key, result);
+		fclose(file);
+		
+		trim();
+		return numSamples;
+	}
+	
+	if (file)
+		fclose(file);
+	else if (fd >= 0)
+		close(fd);
+	
+	if (result) *result = Uncached;
+	
+	const bool looping = player.m_looping;
+	player.m_looping = false;
+	player.resetOutput();
+	player.reset();
+	
+	std::vector<int16_t> buffer(outputBlockSize * 2);
+	uint32_t samplesDone = 0;
+	bool running = true;
+	while (running && !player.atEnd())
+	{
+		uint32_t count = 0;
+		while (count < outputBlockSize && !player.atEnd())
+			count += player.generateBlock(&buffer[numChannels * count], outputBlockSize - count);
+		
+		samplesDone += count;
+		running = output(buffer.data(), count);
+	}
+	
+	player.m_looping = looping;
+	player.resetOutput();
+	player.reset();
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t OPLCache::renderEntry(OPLPlayer& player, OPLRender::OutputFunc output, FILE *file, uint64_t key,
+                               Result *result) const
+{
+	const std::string statePath = path(key, ".state");
+	const unsigned numChannels = player.m_monoOutput ? 1 : 2;
+	const size_t sampleSize = numChannels * sizeof(int16_t);
+	
+	CacheHeader header;
+	DataBlock block;
+	std::vector<uint8_t> state;
+	uint32_t resumeSamples = 0;
+	
+	if (readHeader(file, key, header) && header.chunkSize == chunkSize)
+	{
+		if (header.complete)
+		{
+			// another process finished it after we checked
+			if (!header.numSamples || block.map(file, cacheHeaderSize, (size_t)header.numSamples * sampleSize))
+			{
+				if (result) *result = Hit;
+				return outputSamples(block, header.numSamples, numChannels, output);
+			}
+		}
+		// the chunk that the state was saved after may not have been written completely,
+		// so only resume from it if the header says it was
+		else if (!loadState(statePath, key, resumeSamples, state)
+		         || resumeSamples > header.numSamples || resumeSamples % chunkSize
+		         || !block.map(file, cacheHeaderSize, (size_t)resumeSamples * sampleSize))
+		{
+			resumeSamples = 0;
+		}
+	}
+	
+	header = CacheHeader();
+	header.chunkSize = chunkSize;
+	header.numSamples = resumeSamples;
+	bool saving = writeHeader(file, key, header);
+	
+	const bool looping = player.m_looping;
+	player.m_looping = false;
+	player.resetOutput();
+	player.reset();
+	
+	uint32_t samplesDone = 0;
+	bool running = true;
+	
+	if (resumeSamples)
+	{
+		// output the part that was already rendered, while playing the song up to the same point
+		// without synthesis (like OPLRender::log), then pick up where the last render left off
+		samplesDone = outputSamples(block, resumeSamples, numChannels, output);
+		running = (samplesDone == resumeSamples);
+		block.clear();
+		
+		std::vector<OPLRegWrite> regLog;
+		player.m_regLog = &regLog;
+		std::vector<int16_t> samples(outputBlockSize * 2);
+		for (uint32_t i = 0; running && i < resumeSamples; )
+		{
+			i += player.generateBlock(samples.data(), std::min(resumeSamples - i, outputBlockSize));
+			regLog.clear();
+		}
+		player.m_regLog = nullptr;
+		player.restoreOutput(state);
+	}
+	
+	if (result) *result = resumeSamples ? Resumed : Miss;
+	
+	std::vector<int16_t> buffer(chunkSize * 2);
+	while (running && !player.atEnd())
+	{
+		uint32_t count = 0;
+		while (count < chunkSize && !player.atEnd())
+			count += player.generateBlock(&buffer[numChannels * count], chunkSize - count);
+		
+		// save each chunk, and then the state of the chips at the end of it
+		// (if there's any more of the song left to render)
+		if (saving)
+		{
+			saving = !fseek(file, cacheHeaderSize + (size_t)samplesDone * sampleSize, SEEK_SET)
+				&& fwrite(buffer.data(), sampleSize, count, file) == count
+				&& !fflush(file);
+		}
+		samplesDone += count;
+		
+		if (saving && !player.atEnd())
+		{
+			header.numSamples = samplesDone;
+			saving = writeHeader(file, key, header);
+			
+			if (saving)
+			{
+				player.saveOutput(state);
+				saveState(statePath, key, samplesDone, state);
+			}
+		}
+		
+		running = output(buffer.data(), count);
+	}
+	
+	if (saving && player.atEnd())
+	{
+		header.complete = true;
+		header.numSamples = samplesDone;
+		if (writeHeader(file, key, header))
+		{
+			ftruncate(fileno(file), cacheHeaderSize + (size_t)samplesDone * sampleSize);
+			remove(statePath.c_str());
+		}
+	}
+	
+	player.m_looping = looping;
+	player.resetOutput();
+	player.reset();
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+void OPLCache::trim() const
+{
+	if (!m_maxSize)
+		return;
+	
+	DIR *dir = opendir(m_dir.c_str());
+	if (!dir)
+		return;
+	
+	struct Entry
+	{
+		std::string path; // (without extension)
+		uint64_t size;
+		time_t time;
+	};
+	std::vector<Entry> entries;
+	uint64_t totalSize = 0;
+	
+	while (dirent *ent = readdir(dir))
+	{
+		const size_t len = strlen(ent->d_name);
+		if (len < 4 || strcmp(ent->d_name + len - 4, ".ymc"))
+			continue;
+		
+		Entry entry;
+		entry.path = m_dir + "/" + std::string(ent->d_name, len - 4);
+		
+		struct stat st;
+		if (stat((entry.path + ".ymc").c_str(), &st))
+			continue;
+		entry.size = st.st_size;
+		entry.time = st.st_mtime;
+		if (!stat((entry.path + ".state").c_str(), &st))
+			entry.size += st.st_size;
+		
+		totalSize += entry.size;
+		entries.push_back(entry);
+	}
+	
+	closedir(dir);
+	
+	std::sort(entries.begin(), entries.end(),
+		[](const Entry& a, const Entry& b) { return a.time < b.time; });
+	
+	for (const auto& entry : entries)
+	{
+		if (totalSize <= m_maxSize)
+			break;
+		
+		// skip entries that are currently being read or written
+		FILE *file = fopen((entry.path + ".ymc").c_str(), "rb");
+		if (!file)
+			continue;
+		const bool unused = lockFile(file, true);
+#ifdef _WIN32
+		// open files can't be removed on Windows, so close it first
+		// (if anyone else opens it again in the meantime, removing it just fails)
+		fclose(file);
+#endif
+		if (unused && !remove((entry.path + ".ymc").c_str()))
+		{
+			remove((entry.path + ".state").c_str());
+			totalSize -= entry.size;
+		}
+#ifndef _WIN32
+		fclose(file);
+#endif
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "render.h"
+
+// an on-disk cache of rendered songs, so that rendering a song again with the same patches
+// and settings only has to read the output back from a (memory-mapped) file.
+// songs are rendered in chunks, and each chunk is saved as soon as it's finished along with
+// the state of the chips at that point, so a render that's interrupted (or stopped early)
+// resumes from its last complete chunk the next time.
+// any number of processes can share the same cache directory: each entry is locked while
+// it's being written or read, and a song that's already being rendered somewhere else
+// is just rendered again without the cache.
+// (entries contain 16-bit samples in native byte order, so a cache shouldn't be shared between machines)
+class OPLCache
+{
+public:
+	enum Result
+	{
+		Miss,     // rendered from scratch and saved
+		Hit,      // read from the cache
+		Resumed,  // partially read from the cache, and the rest rendered and saved
+		Uncached  // rendered without the cache (e.g. because another process was writing it)
+	};
+	
+	// 'maxSize' limits the total size of the cache in bytes (0 = unlimited).
+	// after a new entry is saved, the least recently used ones are removed until it fits
+	OPLCache(const char *dir, uint64_t maxSize = 0);
+	
+	// render the player's current song once from the beginning (regardless of loop setting),
+	// using the cache when possible. the output is identical to calling the 16-bit version of
+	// OPLPlayer::generate until OPLPlayer::atEnd() on a newly loaded player with the same settings.
+	// can be called from multiple threads at once (with a different player on each).
+	// (extra outputs added with OPLPlayer::addTap aren't cached, and get no output from a cached song)
+	// returns the number of output samples rendered
+	uint32_t render(OPLPlayer& player, OPLRender::OutputFunc output, Result *result = nullptr) const;
+	
+	// hash of everything that affects a song's rendered output: song data, patches,
+	// chip type/count, elastic chip settings, sample rate, gain, filter, stereo/mono output,
+	// fixed-point output and song number
+	static uint64_t key(const OPLPlayer& player);
+	
+	// remove the least recently used entries (that aren't currently in use)
+	// until the cache is within its size limit
+	void trim() const;
+
+private:
+	std::string path(uint64_t key, const char *ext) const;
+	
+	// play the song from the beginning, writing it to a locked cache entry
+	uint32_t renderEntry(OPLPlayer& player, OPLRender::OutputFunc output, FILE *file, uint64_t key,
+	                     Result *result) const;
+	
+	std::string m_dir;
+	uint64_t m_maxSize;
+};
+
+#endif // __CACHE_H
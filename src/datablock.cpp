@@ -0,0 +1,123 @@
+#include "datablock.h"
+
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+DataBlock::DataBlock()
+{
+	m_data = nullptr;
+	m_size = 0;
+	m_heap = nullptr;
+	m_map = nullptr;
+	m_mapSize = 0;
+}
+
+// ----------------------------------------------------------------------------
+DataBlock::~DataBlock()
+{
+	clear();
+}
+
+// ----------------------------------------------------------------------------
+void DataBlock::clear()
+{
+	delete[] m_heap;
+#ifndef _WIN32
+	if (m_map)
+		munmap(m_map, m_mapSize);
+#endif
+	
+	m_data = nullptr;
+	m_size = 0;
+	m_heap = nullptr;
+	m_map = nullptr;
+	m_mapSize = 0;
+}
+
+// ----------------------------------------------------------------------------
+bool DataBlock::map(FILE *file, size_t offset, size_t size)
+{
+	clear();
+	
+	if (!size)
+	{
+		if (fseek(file, 0, SEEK_END))
+			return false;
+		const long end = ftell(file);
+		if (end < 0 || end < (long)offset)
+			return false;
+		size = end - offset;
+	}
+	if (!size)
+		return false;
+
+#ifndef _WIN32
+	// reading mapped pages past the end of the file would crash instead of just failing,
+	// so make sure all of the requested data is actually there
+	struct stat st;
+	if (fstat(fileno(file), &st) || (S_ISREG(st.st_mode) && (uint64_t)offset + size > (uint64_t)st.st_size))
+		return false;
+#endif
+	
+	// leave the file at the end of the data, as if it had been read normally
+	if (fseek(file, offset + size, SEEK_SET))
+		return false;
+	
+#ifndef _WIN32
+	// mappings have to start on a page boundary
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+	const size_t mapOffset = offset - (offset % pageSize);
+	
+	void *map = mmap(nullptr, size + (offset - mapOffset), PROT_READ, MAP_PRIVATE, fileno(file), mapOffset);
+	if (map != MAP_FAILED)
+	{
+		m_map = map;
+		m_mapSize = size + (offset - mapOffset);
+		m_data = (const uint8_t*)map + (offset - mapOffset);
+		m_size = size;
+		return true;
+	}
+#endif
+	
+	// not mappable, so just read it instead
+	fseek(file, offset, SEEK_SET);
+	m_heap = new uint8_t[size];
+	if (fread(m_heap, 1, size, file) != size)
+	{
+		clear();
+		return false;
+	}
+	
+	m_data = m_heap;
+	m_size = size;
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool DataBlock::copy(const uint8_t *data, size_t size)
+{
+	clear();
+	if (!data || !size)
+		return false;
+	
+	m_heap = new uint8_t[size];
+	memcpy(m_heap, data, size);
+	m_data = m_heap;
+	m_size = size;
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+void DataBlock::borrow(const uint8_t *data, size_t size)
+{
+	clear();
+	
+	m_data = data;
+	m_size = size;
+}
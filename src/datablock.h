@@ -0,0 +1,43 @@
+#ifndef __DATABLOCK_H
+#define __DATABLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// a read-only block of file data, which is either memory-mapped from a file,
+// copied once to the heap, or borrowed from the caller
+class DataBlock
+{
+public:
+	DataBlock();
+	~DataBlock();
+	
+	// map part of an already opened file (or the rest of it, if 'size' is 0).
+	// fails if the file isn't seekable (e.g. it's a pipe) or doesn't contain all of the requested data.
+	// if the file can't be mapped (e.g. on Windows), its contents are read into memory instead.
+	// the file itself doesn't need to stay open afterwards
+	bool map(FILE *file, size_t offset = 0, size_t size = 0);
+	// make a copy of a block of memory
+	bool copy(const uint8_t *data, size_t size);
+	// use a block of memory directly, which must remain valid for as long as this one is used
+	void borrow(const uint8_t *data, size_t size);
+	
+	void clear();
+	
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	
+private:
+	DataBlock(const DataBlock&) = delete;
+	DataBlock& operator=(const DataBlock&) = delete;
+	
+	const uint8_t *m_data;
+	size_t m_size;
+	
+	uint8_t *m_heap; // copied data, if any
+	void *m_map; // start of mapped pages, if any
+	size_t m_mapSize;
+};
+
+#endif // __DATABLOCK_H
@@ -0,0 +1,309 @@
+#include "engine.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+// ----------------------------------------------------------------------------
+static uint64_t threadTime()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
+#else
+	// no per-thread CPU time available, so use elapsed time instead
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// ----------------------------------------------------------------------------
+OPLStream::OPLStream(OPLEngine *engine, OPLPlayer *player, unsigned bufferSize)
+{
+	m_engine = engine;
+	m_player = player;
+	
+	m_state = Idle;
+	m_removed = false;
+	m_hasCommands = false;
+	
+	m_bufferSize = bufferSize;
+	m_buffer.resize(bufferSize * 2);
+	m_readPos = m_writePos = 0;
+	
+	m_cpuTime = 0;
+}
+
+// ----------------------------------------------------------------------------
+OPLStream::~OPLStream()
+{
+	delete m_player;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLStream::available() const
+{
+	return m_writePos - m_readPos;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLStream::space() const
+{
+	return m_bufferSize - available();
+}
+
+// ----------------------------------------------------------------------------
+bool OPLStream::atEnd() const
+{
+	return (m_state == Finished || m_removed) && !available();
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLStream::read(int16_t *data, unsigned numSamples)
+{
+	const uint64_t readPos = m_readPos;
+	numSamples = std::min(numSamples, available());
+	
+	// copy up to the end of the buffer, then wrap around if needed
+	const unsigned pos = readPos % m_bufferSize;
+	const unsigned count = std::min(numSamples, m_bufferSize - pos);
+	memcpy(data, &m_buffer[pos * 2], count * 2 * sizeof(int16_t));
+	memcpy(data + count * 2, &m_buffer[0], (numSamples - count) * 2 * sizeof(int16_t));
+	
+	m_readPos = readPos + numSamples;
+	
+	// there's room for more output now
+	if (numSamples)
+		m_engine->wake(this);
+	
+	return numSamples;
+}
+
+// ----------------------------------------------------------------------------
+void OPLStream::post(std::function<void(OPLPlayer&)> command)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_commandMutex);
+		m_commands.push_back(std::move(command));
+		m_hasCommands = true;
+	}
+	
+	m_engine->wake(this);
+}
+
+// ----------------------------------------------------------------------------
+OPLStream::State OPLStream::render(std::vector<int16_t>& buffer)
+{
+	const uint64_t startTime = threadTime();
+	
+	if (m_hasCommands)
+	{
+		std::vector<std::function<void(OPLPlayer&)>> commands;
+		{
+			std::lock_guard<std::mutex> lock(m_commandMutex);
+			commands.swap(m_commands);
+			m_hasCommands = false;
+		}
+		
+		for (auto& command : commands)
+			command(*m_player);
+	}
+	
+	const unsigned blockSize = buffer.size() / 2;
+	unsigned numSamples = 0;
+	
+	if (space() >= blockSize)
+	{
+		if (m_player->loop())
+		{
+			m_player->generate(buffer.data(), blockSize);
+			numSamples = blockSize;
+		}
+		else
+		{
+			// stop exactly at the end of the song
+			while (numSamples < blockSize && !m_player->atEnd())
+				numSamples += m_player->generateBlock(&buffer[2 * numSamples], blockSize - numSamples);
+		}
+		
+		// copy up to the end of the ring buffer, then wrap around if needed
+		const uint64_t writePos = m_writePos;
+		const unsigned pos = writePos % m_bufferSize;
+		const unsigned count = std::min(numSamples, m_bufferSize - pos);
+		memcpy(&m_buffer[pos * 2], buffer.data(), count * 2 * sizeof(int16_t));
+		memcpy(&m_buffer[0], buffer.data() + count * 2, (numSamples - count) * 2 * sizeof(int16_t));
+		
+		m_writePos = writePos + numSamples;
+	}
+	
+	m_cpuTime += threadTime() - startTime;
+	
+	if (!m_player->loop() && m_player->atEnd())
+		return Finished;
+	if (space() >= blockSize)
+		return Queued;
+	return Idle;
+}
+
+// ----------------------------------------------------------------------------
+OPLEngine::OPLEngine(unsigned numThreads, unsigned blockSize)
+{
+	if (!numThreads)
+		numThreads = ThreadPool::defaultThreads();
+	
+	m_blockSize = std::max(blockSize, 1u);
+	m_nextWorker = 0;
+	m_numQueued = 0;
+	m_quit = false;
+	
+	// create all workers' queues before any of them start looking at each other's
+	for (unsigned i = 0; i < numThreads; i++)
+		m_workers.push_back(new Worker());
+	for (unsigned i = 0; i < numThreads; i++)
+		m_workers[i]->thread = std::thread(&OPLEngine::run, this, i);
+}
+
+// ----------------------------------------------------------------------------
+OPLEngine::~OPLEngine()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_ready.notify_all();
+	
+	// wait for every worker to stop before any queues go away, since idle workers steal from each other
+	for (auto worker : m_workers)
+		worker->thread.join();
+	
+	// drop any streams still waiting to be rendered
+	for (auto worker : m_workers)
+	{
+		worker->queue.clear();
+		delete worker;
+	}
+	m_numQueued = 0;
+}
+
+// ----------------------------------------------------------------------------
+std::shared_ptr<OPLStream> OPLEngine::addStream(OPLPlayer *player, unsigned bufferSize)
+{
+	player->setMonoOutput(false);
+	std::shared_ptr<OPLStream> stream(new OPLStream(this, player, std::max(bufferSize, m_blockSize)));
+	wake(stream.get());
+	
+	return stream;
+}
+
+// ----------------------------------------------------------------------------
+void OPLEngine::removeStream(const std::shared_ptr<OPLStream>& stream)
+{
+	// if it's queued or being rendered, the worker will drop it afterwards
+	stream->m_removed = true;
+}
+
+// ----------------------------------------------------------------------------
+void OPLEngine::wake(OPLStream *stream)
+{
+	if (stream->m_removed)
+		return;
+	
+	int state = OPLStream::Idle;
+	bool wake = stream->m_state.compare_exchange_strong(state, OPLStream::Queued);
+	
+	// finished streams can also be restarted by commands (e.g. resetting the player)
+	if (!wake && state == OPLStream::Finished && stream->m_hasCommands)
+		wake = stream->m_state.compare_exchange_strong(state, OPLStream::Queued);
+	
+	if (wake)
+		queue(stream->shared_from_this(), m_nextWorker++ % m_workers.size());
+}
+
+// ----------------------------------------------------------------------------
+void OPLEngine::queue(std::shared_ptr<OPLStream> stream, unsigned worker)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_workers[worker]->mutex);
+		m_workers[worker]->queue.push_back(std::move(stream));
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_numQueued++;
+	}
+	m_ready.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+std::shared_ptr<OPLStream> OPLEngine::next(unsigned worker)
+{
+	std::shared_ptr<OPLStream> stream;
+	
+	// take the oldest stream from our own queue, if there is one...
+	{
+		Worker *self = m_workers[worker];
+		std::lock_guard<std::mutex> lock(self->mutex);
+		if (!self->queue.empty())
+		{
+			stream = std::move(self->queue.front());
+			self->queue.pop_front();
+		}
+	}
+	
+	// ...otherwise steal the newest one from someone else's
+	for (unsigned i = 1; !stream && i < m_workers.size(); i++)
+	{
+		Worker *other = m_workers[(worker + i) % m_workers.size()];
+		std::lock_guard<std::mutex> lock(other->mutex);
+		if (!other->queue.empty())
+		{
+			stream = std::move(other->queue.back());
+			other->queue.pop_back();
+		}
+	}
+	
+	if (stream)
+		m_numQueued--;
+	return stream;
+}
+
+// ----------------------------------------------------------------------------
+void OPLEngine::run(unsigned worker)
+{
+	std::vector<int16_t> buffer(m_blockSize * 2);
+	
+	while (!m_quit)
+	{
+		auto stream = next(worker);
+		if (!stream)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_ready.wait(lock, [this] { return m_quit || m_numQueued; });
+			continue;
+		}
+		
+		if (stream->m_removed)
+		{
+			stream->m_state = OPLStream::Idle;
+			continue;
+		}
+		
+		stream->m_state = OPLStream::Running;
+		const OPLStream::State state = stream->render(buffer);
+		stream->m_state = state;
+		
+		if (state == OPLStream::Queued)
+		{
+			// back to the end of our own queue
+			if (!stream->m_removed)
+				queue(std::move(stream), worker);
+		}
+		else if (stream->space() >= m_blockSize || stream->m_hasCommands)
+		{
+			// the stream may have been read from (or sent commands) while this block was being rendered
+			wake(stream.get());
+		}
+	}
+}
@@ -0,0 +1,137 @@
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "player.h"
+
+class OPLEngine;
+
+// one player being rendered by an OPLEngine, with a buffer of output waiting to be read
+class OPLStream : public std::enable_shared_from_this<OPLStream>
+{
+public:
+	~OPLStream();
+	
+	// read up to 'numSamples' rendered stereo samples (same format as OPLPlayer::generate).
+	// returns the number of samples actually read, which may be less if the engine hasn't caught up yet.
+	// only one thread should read from a stream at a time
+	unsigned read(int16_t *data, unsigned numSamples);
+	// number of samples ready to be read
+	unsigned available() const;
+	
+	// run a function on this stream's player before rendering its next block
+	// (e.g. for real-time MIDI events or changing settings).
+	// the player must not be accessed any other way while the stream is in use
+	void post(std::function<void(OPLPlayer&)> command);
+	
+	// true if the song has ended (and isn't looping) and all of its output has been read
+	bool atEnd() const;
+	
+	// total thread CPU time spent rendering this stream, in seconds
+	double cpuTime() const { return m_cpuTime / 1e9; }
+	// total number of samples rendered so far
+	uint64_t samplesRendered() const { return m_writePos; }
+
+private:
+	friend class OPLEngine;
+	
+	enum State
+	{
+		Idle,     // waiting for room in the output buffer
+		Queued,   // waiting for a worker thread
+		Running,  // being rendered by a worker thread
+		Finished  // song is over
+	};
+	
+	OPLStream(OPLEngine *engine, OPLPlayer *player, unsigned bufferSize);
+	
+	// render the next block of output, using 'buffer' as scratch space.
+	// returns the state that the stream should be left in afterwards
+	State render(std::vector<int16_t>& buffer);
+	
+	// number of samples that can be written without overwriting unread output
+	unsigned space() const;
+	
+	OPLEngine *m_engine;
+	OPLPlayer *m_player;
+	
+	std::atomic<int> m_state;
+	std::atomic<bool> m_removed;
+	
+	// commands waiting to be run on the player
+	std::mutex m_commandMutex;
+	std::vector<std::function<void(OPLPlayer&)>> m_commands;
+	std::atomic<bool> m_hasCommands;
+	
+	// output ring buffer (only written by the worker rendering the stream, and only read by one reader)
+	std::vector<int16_t> m_buffer;
+	unsigned m_bufferSize; // in stereo samples
+	std::atomic<uint64_t> m_readPos, m_writePos;
+	
+	std::atomic<uint64_t> m_cpuTime; // in nanoseconds
+};
+
+// renders any number of OPLPlayer streams in fixed-size blocks using a pool of worker threads.
+// each worker has its own queue of streams waiting for a block to be rendered;
+// a stream goes back on the end of the queue after each block (to keep things fair between streams),
+// and workers with nothing to do steal waiting streams from other workers' queues.
+// a stream waits whenever its output buffer is full, and is queued again as soon as it's been read from
+class OPLEngine
+{
+public:
+	// if 'numThreads' is 0, one thread per available CPU core will be used.
+	// 'blockSize' is the number of samples rendered for a stream at a time
+	OPLEngine(unsigned numThreads = 0, unsigned blockSize = 1024);
+	// all streams stop being rendered when the engine is destroyed, and can't be read from afterwards
+	~OPLEngine();
+	
+	// start rendering a player, which is then owned by the stream.
+	// 'bufferSize' is the size of the stream's output buffer, in samples
+	// (at least twice the block size is recommended).
+	// streams are always stereo, so the player's mono output setting is turned off
+	std::shared_ptr<OPLStream> addStream(OPLPlayer *player, unsigned bufferSize = 8192);
+	// stop rendering a stream (any output still in its buffer can still be read)
+	void removeStream(const std::shared_ptr<OPLStream>& stream);
+	
+	unsigned numThreads() const { return m_workers.size(); }
+	unsigned blockSize() const { return m_blockSize; }
+
+private:
+	friend class OPLStream;
+	
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::deque<std::shared_ptr<OPLStream>> queue;
+	};
+	
+	// queue a stream to have its next block rendered, if it's not already queued or rendering
+	void wake(OPLStream *stream);
+	// add a stream to a worker's queue
+	void queue(std::shared_ptr<OPLStream> stream, unsigned worker);
+	// get the next stream from a worker's own queue, or from another one's if it's empty
+	std::shared_ptr<OPLStream> next(unsigned worker);
+	
+	void run(unsigned worker);
+	
+	std::vector<Worker*> m_workers;
+	unsigned m_blockSize;
+	std::atomic<unsigned> m_nextWorker;
+	
+	// for idle workers to wait on
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::atomic<unsigned> m_numQueued; // total number of streams waiting in all queues
+	std::atomic<bool> m_quit; // checked before each block, so the engine can stop with streams still queued
+};
+
+#endif // __ENGINE_H
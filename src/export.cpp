@@ -0,0 +1,235 @@
+#include "export.h"
+#include "render.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t vgmSampleRate = 44100;
+static const unsigned vgmHeaderSize = 0x80;
+
+static const unsigned droHeaderSize = 26;
+// DRO codes with the high bit set are for the second register set
+static const unsigned droMaxCodes = 0x80 - 2; // (leaving room for the two delay codes)
+
+// ----------------------------------------------------------------------------
+static void write16(uint8_t *data, uint16_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+// ----------------------------------------------------------------------------
+static void write32(uint8_t *data, uint32_t value)
+{
+	write16(data, value);
+	write16(data + 2, value >> 16);
+}
+
+// ----------------------------------------------------------------------------
+static bool saveFile(const char *path, std::function<bool(FILE*)> save)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	
+	bool ok = save(file);
+	
+	ok &= !fclose(file);
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+static uint64_t logWrites(OPLPlayer& player, std::vector<OPLRegWrite>& regLog, unsigned& numChips)
+{
+	uint64_t numChipSamples;
+	OPLRender::log(player, regLog, &numChipSamples);
+	
+	// each chip may have been clocked ahead of the others while writing to it,
+	// so put all chips' writes back in order
+	std::stable_sort(regLog.begin(), regLog.end(),
+		[](const OPLRegWrite& a, const OPLRegWrite& b) { return a.time < b.time; });
+	// neither format has a way to stop clocking a chip, so leave out any parking (see OPLPlayer::setElastic)
+	regLog.erase(std::remove_if(regLog.begin(), regLog.end(),
+		[](const OPLRegWrite& write) { return write.addr >= OPLRegWrite::ChipParked; }), regLog.end());
+	
+	// (every chip gets at least one write when the player is reset)
+	numChips = 0;
+	for (const auto& write : regLog)
+		numChips = std::max(numChips, write.chip + 1u);
+	
+	return numChipSamples;
+}
+
+// ----------------------------------------------------------------------------
+static void waitVGM(std::vector<uint8_t>& data, uint32_t samples)
+{
+	while (samples)
+	{
+		if (samples <= 16)
+		{
+			data.push_back(0x70 + samples - 1);
+			samples = 0;
+		}
+		else if (samples == 735 || samples == 882)
+		{
+			data.push_back(samples == 735 ? 0x62 : 0x63);
+			samples = 0;
+		}
+		else
+		{
+			const uint16_t count = std::min(samples, 0xffffu);
+			data.push_back(0x61);
+			data.push_back(count);
+			data.push_back(count >> 8);
+			samples -= count;
+		}
+	}
+}
+
+// ----------------------------------------------------------------------------
+bool OPLExport::saveVGM(OPLPlayer& player, const char *path)
+{
+	return saveFile(path, [&](FILE *file) { return saveVGM(player, file); });
+}
+
+// ----------------------------------------------------------------------------
+bool OPLExport::saveVGM(OPLPlayer& player, FILE *file)
+{
+	std::vector<OPLRegWrite> regLog;
+	unsigned numChips;
+	const uint64_t numChipSamples = logWrites(player, regLog, numChips);
+	
+	// VGM only supports up to two of each chip
+	if (numChips > 2)
+		return false;
+	
+	const uint64_t chipRate = player.chipSampleRate();
+	auto vgmTime = [&](uint64_t time) -> uint32_t
+	{
+		return (time * vgmSampleRate + chipRate / 2) / chipRate;
+	};
+	
+	std::vector<uint8_t> data(vgmHeaderSize);
+	uint32_t time = 0;
+	for (const auto& write : regLog)
+	{
+		const uint32_t writeTime = vgmTime(write.time);
+		waitVGM(data, writeTime - time);
+		time = writeTime;
+		
+		// 5E/5F for the first chip's two register sets, AE/AF for the second chip's
+		data.push_back((write.chip ? 0xae : 0x5e) | (write.addr >> 8));
+		data.push_back(write.addr);
+		data.push_back(write.data);
+	}
+	
+	const uint32_t numSamples = std::max(time, vgmTime(numChipSamples));
+	waitVGM(data, numSamples - time);
+	data.push_back(0x66); // end of data
+	
+	memcpy(&data[0x00], "Vgm ", 4);
+	write32(&data[0x04], data.size() - 0x04);
+	write32(&data[0x08], 0x151);
+	write32(&data[0x18], numSamples);
+	if (player.loop())
+	{
+		// loop the whole song, like the player would
+		write32(&data[0x1c], vgmHeaderSize - 0x1c);
+		write32(&data[0x20], numSamples);
+	}
+	write32(&data[0x34], vgmHeaderSize - 0x34);
+	write32(&data[0x5c], player.chipClock() | (numChips > 1 ? 0x40000000 : 0));
+	
+	return fwrite(data.data(), 1, data.size(), file) == data.size();
+}
+
+// ----------------------------------------------------------------------------
+bool OPLExport::saveDRO(OPLPlayer& player, const char *path)
+{
+	return saveFile(path, [&](FILE *file) { return saveDRO(player, file); });
+}
+
+// ----------------------------------------------------------------------------
+bool OPLExport::saveDRO(OPLPlayer& player, FILE *file)
+{
+	std::vector<OPLRegWrite> regLog;
+	unsigned numChips;
+	const uint64_t numChipSamples = logWrites(player, regLog, numChips);
+	
+	// DRO doesn't support more than one OPL3
+	if (numChips > 1)
+		return false;
+	
+	// map each register number to a code (in order of first use)
+	int codes[256];
+	std::vector<uint8_t> codemap;
+	std::fill(codes, codes + 256, -1);
+	for (const auto& write : regLog)
+	{
+		const uint8_t reg = write.addr;
+		if (codes[reg] >= 0)
+			continue;
+		if (codemap.size() >= droMaxCodes)
+			return false;
+		
+		codes[reg] = codemap.size();
+		codemap.push_back(reg);
+	}
+	
+	const uint8_t shortDelay = codemap.size();
+	const uint8_t longDelay = codemap.size() + 1;
+	
+	const uint64_t chipRate = player.chipSampleRate();
+	auto droTime = [&](uint64_t time) -> uint32_t
+	{
+		return (time * 1000ull + chipRate / 2) / chipRate;
+	};
+	
+	std::vector<uint8_t> pairs;
+	auto wait = [&](uint32_t ms)
+	{
+		while (ms > 256)
+		{
+			const unsigned count = std::min(ms / 256, 256u);
+			pairs.push_back(longDelay);
+			pairs.push_back(count - 1);
+			ms -= count * 256;
+		}
+		if (ms)
+		{
+			pairs.push_back(shortDelay);
+			pairs.push_back(ms - 1);
+		}
+	};
+	
+	uint32_t time = 0;
+	for (const auto& write : regLog)
+	{
+		const uint32_t writeTime = droTime(write.time);
+		wait(writeTime - time);
+		time = writeTime;
+		
+		pairs.push_back(codes[write.addr & 0xff] | ((write.addr & 0x100) >> 1));
+		pairs.push_back(write.data);
+	}
+	
+	const uint32_t length = std::max(time, droTime(numChipSamples));
+	wait(length - time);
+	
+	std::vector<uint8_t> header(droHeaderSize);
+	memcpy(&header[0], "DBRAWOPL", 8);
+	write16(&header[8], 2); // version 2.0
+	write16(&header[10], 0);
+	write32(&header[12], pairs.size() / 2);
+	write32(&header[16], length);
+	header[20] = 2; // OPL3
+	header[21] = 0; // interleaved format
+	header[22] = 0; // uncompressed
+	header[23] = shortDelay;
+	header[24] = longDelay;
+	header[25] = codemap.size();
+	
+	return fwrite(header.data(), 1, header.size(), file) == header.size()
+		&& fwrite(codemap.data(), 1, codemap.size(), file) == codemap.size()
+		&& fwrite(pairs.data(), 1, pairs.size(), file) == pairs.size();
+}
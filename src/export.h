@@ -0,0 +1,25 @@
+#ifndef __EXPORT_H
+#define __EXPORT_H
+
+#include <cstdio>
+
+#include "player.h"
+
+// saves the chip register writes for a song, for playback in other programs
+// (or in OPLPlayer itself, which can load both formats like any other song).
+// the song is played once from the beginning without synthesis (see OPLRender::log),
+// using the player's current settings
+class OPLExport
+{
+public:
+	// VGM 1.51, as one or two YMF262 chips
+	static bool saveVGM(OPLPlayer& player, const char *path);
+	static bool saveVGM(OPLPlayer& player, FILE *file);
+	
+	// DOSBox raw OPL (DRO) v2.0, as a single OPL3.
+	// timing is only accurate to the nearest millisecond
+	static bool saveDRO(OPLPlayer& player, const char *path);
+	static bool saveDRO(OPLPlayer& player, FILE *file);
+};
+
+#endif // __EXPORT_H
@@ -0,0 +1,33 @@
+#include "fixed.h"
+
+#include <algorithm>
+#include <cmath>
+
+const uint64_t OPLFixed::one;
+const int64_t OPLFixed::filterOne;
+
+// ----------------------------------------------------------------------------
+uint64_t OPLFixed::step(uint32_t sampleRate, uint32_t chipRate)
+{
+	return (((uint64_t)sampleRate << 32) + chipRate / 2) / chipRate;
+}
+
+// ----------------------------------------------------------------------------
+int64_t OPLFixed::gain(double gain, uint64_t step)
+{
+	// (scaling by a power of two is exact, so this is the only rounding)
+	const int64_t gainFixed = llround(gain * 65536);
+	return (gainFixed * (int64_t)std::min(step, one) + (int64_t)(one >> 1)) >> 32;
+}
+
+// ----------------------------------------------------------------------------
+int64_t OPLFixed::filterCoef(double cutoff, uint32_t sampleRate)
+{
+	if (cutoff <= 0.0)
+		return filterOne;
+	
+	// same as 1.0 / ((2 * pi * cutoff) / sampleRate + 1), with the cutoff in 24.8
+	static const double pi = 3.14159265358979323846;
+	const int64_t w = llround(2 * pi * cutoff * 256);
+	return ((int64_t)sampleRate << 38) / (((int64_t)sampleRate << 8) + w);
+}
@@ -0,0 +1,48 @@
+#ifndef __FIXED_H
+#define __FIXED_H
+
+#include <cstdint>
+
+// helpers for the fixed-point output path (see OPLPlayer::setFixedPoint).
+// settings are converted to fixed-point once, and everything done per sample only uses integers,
+// so the output is exactly the same with any compiler or CPU
+class OPLFixed
+{
+public:
+	// output sample positions are 32.32 (see OPLPlayer::m_samplePos)
+	static const uint64_t one = 1ull << 32;
+	// filter coefficients are 2.30
+	static const int64_t filterOne = 1ll << 30;
+	
+	// ratio of output sample rate to OPL sample rate
+	static uint64_t step(uint32_t sampleRate, uint32_t chipRate);
+	// 16.16 gain, including the sample rate ratio when downsampling
+	static int64_t gain(double gain, uint64_t step);
+	// highpass filter coefficient (or 'filterOne' if the filter is disabled)
+	static int64_t filterCoef(double cutoff, uint32_t sampleRate);
+	
+	// the part of an input sample that belongs to the next output sample when downsampling,
+	// based on how far past the output sample point ('pos', after adding 'step') it is
+	static int32_t remainder(int32_t sample, uint64_t pos, uint64_t step)
+	{
+		const int64_t frac = ((pos & (one - 1)) << 16) / step;
+		return (sample * frac + 0x8000) >> 16;
+	}
+	
+	// apply gain to an accumulated output sample
+	static int32_t scale(int32_t sample, int64_t gain)
+	{
+		return (sample * gain + 0x8000) >> 16;
+	}
+	
+	// run one output sample through the highpass filter
+	static int32_t filter(int32_t sample, int32_t& lastIn, int32_t& lastOut, int64_t coef)
+	{
+		const int32_t in = lastIn;
+		lastIn = sample;
+		lastOut = (coef * (lastOut + sample - in) + (filterOne >> 1)) >> 30;
+		return lastOut;
+	}
+};
+
+#endif // __FIXED_H
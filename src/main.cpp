@@ -1,32 +1,105 @@
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
 #include <unistd.h>
 
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+// build with YMFMIDI_NO_SDL defined for a headless version that can only render to files/stdout
+#ifndef YMFMIDI_NO_SDL
 #define SDL_MAIN_HANDLED
 extern "C" {
 #include <SDL2/SDL.h>
 }
+#endif
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include "batch.h"
+#include "cache.h"
+#ifndef YMFMIDI_NO_SDL
 #include "console.h"
+#endif
+#include "export.h"
+#include "midiin.h"
 #include "player.h"
+#include "render.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "wav.h"
 
 #define VERSION "0.5.0"
 
+#ifdef YMFMIDI_NO_SDL
+#define PROGRAM "ymfmidi-render"
+#else
+#define PROGRAM "ymfmidi"
+#endif
+
 static bool g_running = true;
+#ifndef YMFMIDI_NO_SDL
 static bool g_paused = false;
+#endif
 static bool g_looping = true;
 
+// live MIDI input (see readInput and updateInput)
+static MIDIInput* g_input = nullptr;
+static std::mutex g_inputMutex;
+static std::vector<uint8_t> g_inputData;
+static bool g_inputDone = false;
+// set once the player has been sent the last of the input
+static bool g_inputEnded = false;
+static std::chrono::steady_clock::time_point g_inputEndTime;
+// longest time to keep playing released notes after the input ends
+static const unsigned maxInputTail = 10;
+// default audio buffer size when playing input, which is only picked up once per buffer
+// (about 12ms at 44.1kHz, instead of about 93ms for the usual default)
+static const int inputBufferSize = 512;
+
+#ifndef YMFMIDI_NO_SDL
 static void mainLoopSDL(OPLPlayer* player, int bufferSize, bool interactive);
-static void mainLoopWAV(OPLPlayer* player, const char* path);
+#endif
+static void mainLoopWAV(OPLPlayer* player, const char* path, FILE* stream, int bufferSize, unsigned numThreads,
+                        const OPLCache* cache, const std::vector<const char*>& tapPaths);
+static void mainReplay(OPLPlayer* player, const char* tracePath, const char* path, FILE* stream, bool realTime);
+static void mainInput(OPLPlayer* player, const char* path, FILE* stream);
+
+// read raw MIDI bytes from a file descriptor until the end of the input (runs on its own thread)
+static void readInput(int fd);
+// send any live MIDI input that's arrived so far to the player.
+// returns false once the input has ended and everything in it has been played (including release tails)
+static bool updateInput(OPLPlayer* player);
+static int mainBatch(const char* listPath, const char* patchPath, const BatchJob& defaults, unsigned numThreads,
+                     const OPLCache* cache);
 
 // ----------------------------------------------------------------------------
 void usage()
 {
 	fprintf(stderr, 
-	"usage: ymfmidi [options] song_path [patch_path]\n"
+#ifdef YMFMIDI_NO_SDL
+	"usage: " PROGRAM " [options] -o out_path song_path [patch_path]\n"
+#else
+	"usage: " PROGRAM " [options] song_path [patch_path]\n"
+#endif
+	"       " PROGRAM " [options] -B list_path [patch_path]\n"
+	"       " PROGRAM " -C out_path [patch_path]\n"
+	"       " PROGRAM " [options] -L out_path song_path [patch_path]\n"
+	"       " PROGRAM " [options] -P trace_path -o out_path [patch_path]\n"
+#ifdef YMFMIDI_NO_SDL
+	"       " PROGRAM " [options] -I input_path -o out_path [patch_path]\n"
+#else
+	"       " PROGRAM " [options] -I input_path [patch_path]\n"
+#endif
 	"\n"
 	"supported song formats:  HMI, HMP, MID, MUS, RMI, XMI\n"
+	"                         DRO, VGM (OPL2/OPL3 register logs)\n"
 	"supported patch formats: AD, OPL, OP2, TMB, WOPL\n"
 	"\n"
 	"supported options:\n"
@@ -36,14 +109,48 @@ void usage()
 	"  -s / --song <num>       select an individual song, if multiple in file\n"
 	"                            (default 1)\n"
 	"  -o / --out <path>       output to WAV file (implies -q and -1)\n"
+	"                            or raw 16-bit PCM on stdout if path is '-'\n"
+	"  -a / --also <rate:path> also output to a WAV file at another sample rate\n"
+	"                            (rendered in the same pass; can be used more than once)\n"
+	"  -j / --jobs <num>       number of threads to use for WAV output\n"
+	"                            (0 = one per CPU core; default 1). a single song uses\n"
+	"                            at most one thread per chip (-n), plus the main thread\n"
+	"  -B / --batch <path>     render a list of songs to WAV files, one per line:\n"
+	"                            song_path out_path [setting=value ...]\n"
+	"                            (settings: song, chip, num, elastic, rate, gain, filter,\n"
+	"                            mono, fixed, float, patches; other options are used\n"
+	"                            as defaults. -j sets the number of songs to render\n"
+	"                            at once. hash=<hex>, hashes=<path> or ref=<path>\n"
+	"                            [tol=<num>] check each song's output against a known\n"
+	"                            hash, hash file or WAV file)\n"
+	"  -U / --update           with -B, save each song's ref= and hashes= files\n"
+	"                            instead of checking the output against them\n"
+	"  -C / --compile <path>   save patches in compiled form (for faster loading)\n"
+	"  -L / --log <path>       save a song's OPL register writes to a VGM file\n"
+	"                            (or DRO, if the path ends with .dro)\n"
+	"  -T / --trace <path>     record all MIDI events to a trace file while playing\n"
+	"                            (WAV output is rendered with one thread)\n"
+	"  -P / --replay <path>    send the MIDI events from a trace file to the player\n"
+	"                            at their original times, instead of playing a song\n"
+	"  -R / --realtime         replay a trace in real time (default is full speed)\n"
+	"  -I / --input <path>     play raw MIDI bytes from a file or named pipe as they\n"
+	"                            arrive, instead of a song ('-' = stdin;\n"
+	"                            use /dev/fd/<num> for an open file descriptor)\n"
+	"  -D / --cache <path>     save rendered output in this directory, and reuse it\n"
+	"                            when the same song is rendered with the same settings\n"
+	"  -M / --cache-size <num> limit the cache to this many MB (default 1024)\n"
 	"\n"
 	"  -c / --chip <num>       set type of chip (1 = OPL, 2 = OPL2, 3 = OPL3; default 3)\n"
 	"  -n / --num <num>        set number of chips (default 1)\n"
+	"  -e / --elastic <num>    only run this many chips until more are needed\n"
+	"                            (up to the number set with -n)\n"
 	"  -m / --mono             ignore MIDI panning information (OPL3 only)\n"
-	"  -b / --buf <num>        set buffer size (default 4096)\n"
+	"  -b / --buf <num>        set buffer size (default 4096, or 512 with -I)\n"
 	"  -g / --gain <num>       set gain amount (default 1.0)\n"
 	"  -r / --rate <num>       set sample rate (default 44100)\n"
 	"  -f / --filter <num>     set highpass cutoff in Hz (default 5.0)\n"
+	"  -x / --fixed            resample and filter with fixed-point math only\n"
+	"                            (bit-exact output on any compiler or CPU)\n"
 	"\n"
 	);
 	
@@ -56,13 +163,28 @@ static const option options[] =
 	{"quiet",     0, nullptr, 'q'},
 	{"play-once", 0, nullptr, '1'},
 	{"song",      1, nullptr, 's'},
+	{"out",       1, nullptr, 'o'},
+	{"also",      1, nullptr, 'a'},
+	{"jobs",      1, nullptr, 'j'},
+	{"batch",     1, nullptr, 'B'},
+	{"update",    0, nullptr, 'U'},
+	{"compile",   1, nullptr, 'C'},
+	{"log",       1, nullptr, 'L'},
+	{"trace",     1, nullptr, 'T'},
+	{"replay",    1, nullptr, 'P'},
+	{"realtime",  0, nullptr, 'R'},
+	{"input",     1, nullptr, 'I'},
+	{"cache",     1, nullptr, 'D'},
+	{"cache-size", 1, nullptr, 'M'},
 	{"chip",      1, nullptr, 'c'},
 	{"num",       1, nullptr, 'n'},
+	{"elastic",   1, nullptr, 'e'},
 	{"mono",      0, nullptr, 'm'},
 	{"buf",       1, nullptr, 'b'},
 	{"gain",      1, nullptr, 'g'},
 	{"rate",      1, nullptr, 'r'},
 	{"filter",    1, nullptr, 'f'},
+	{"fixed",     0, nullptr, 'x'},
 	{0}
 };
 
@@ -93,19 +215,33 @@ int main(int argc, char **argv)
 	const char* songPath;
 	const char* patchPath = "GENMIDI.wopl";
 	const char* wavPath = nullptr;
+	std::vector<uint32_t> tapRates;
+	std::vector<const char*> tapPaths;
 	int sampleRate = 44100;
-	int bufferSize = 4096;
+	int bufferSize = 0; // default depends on whether there's MIDI input (see below)
 	double gain = 1.0;
 	double filter = 5.0;
 	OPLPlayer::ChipType chipType = OPLPlayer::ChipOPL3;
 	int numChips = 1;
+	int minChips = 0;
 	unsigned songNum = 0;
 	bool stereo = true;
-
-	printf("ymfmidi v" VERSION " - " __DATE__ "\n");
+	bool fixedPoint = false;
+	unsigned numThreads = 1;
+	const char* batchPath = nullptr;
+	bool update = false;
+	const char* compilePath = nullptr;
+	const char* logPath = nullptr;
+	const char* tracePath = nullptr;
+	const char* replayPath = nullptr;
+	bool realTime = false;
+	const char* inputPath = nullptr;
+	const char* cachePath = nullptr;
+	unsigned cacheSize = 1024;
+	FILE* stream = nullptr;
 
 	char opt;
-	while ((opt = getopt_long(argc, argv, ":hq1s:o:c:n:mb:g:r:f:", options, nullptr)) != -1)
+	while ((opt = getopt_long(argc, argv, ":hq1s:o:a:j:B:UC:L:T:P:RI:D:M:c:n:e:mb:g:r:f:x", options, nullptr)) != -1)
 	{
 		switch (opt)
 		{
@@ -129,6 +265,72 @@ int main(int argc, char **argv)
 		case 'o':
 			wavPath = optarg;
 			interactive = g_looping = false;
+			if (!strcmp(wavPath, "-") && !stream)
+			{
+				// keep audio on the original stdout and send all other output to stderr
+				stream = fdopen(dup(fileno(stdout)), "wb");
+				dup2(fileno(stderr), fileno(stdout));
+#ifdef _WIN32
+				_setmode(fileno(stream), _O_BINARY);
+#endif
+			}
+			break;
+		
+		case 'a':
+		{
+			const char *path = strchr(optarg, ':');
+			if (!path || !atoi(optarg))
+			{
+				fprintf(stderr, "invalid output: %s\n", optarg);
+				exit(1);
+			}
+			tapRates.push_back(atoi(optarg));
+			tapPaths.push_back(path + 1);
+			break;
+		}
+		
+		case 'j':
+			numThreads = atoi(optarg);
+			break;
+		
+		case 'B':
+			batchPath = optarg;
+			break;
+		
+		case 'U':
+			update = true;
+			break;
+		
+		case 'C':
+			compilePath = optarg;
+			break;
+		
+		case 'L':
+			logPath = optarg;
+			break;
+		
+		case 'T':
+			tracePath = optarg;
+			break;
+		
+		case 'P':
+			replayPath = optarg;
+			break;
+		
+		case 'R':
+			realTime = true;
+			break;
+		
+		case 'I':
+			inputPath = optarg;
+			break;
+		
+		case 'D':
+			cachePath = optarg;
+			break;
+		
+		case 'M':
+			cacheSize = atoi(optarg);
 			break;
 		
 		case 'c':
@@ -152,10 +354,23 @@ int main(int argc, char **argv)
 			}
 			break;
 		
+		case 'e':
+			minChips = atoi(optarg);
+			if (minChips < 1)
+			{
+				fprintf(stderr, "number of chips must be at least 1\n");
+				exit(1);
+			}
+			break;
+		
 		case 'm':
 			stereo = false;
 			break;
 		
+		case 'x':
+			fixedPoint = true;
+			break;
+		
 		case 'b':
 			bufferSize = atoi(optarg);
 			if (!bufferSize)
@@ -194,16 +409,99 @@ int main(int argc, char **argv)
 		}
 	}
 	
-	if (optind >= argc)
-		usage();
+	printf(PROGRAM " v" VERSION " - " __DATE__ "\n");
+	
+	if (!bufferSize)
+		bufferSize = inputPath ? inputBufferSize : 4096;
+	
+	if (compilePath)
+	{
+		if (optind < argc)
+			patchPath = argv[optind];
+		
+		PatchBank patches;
+		if (!patches.load(patchPath))
+		{
+			fprintf(stderr, "couldn't load %s\n", patchPath);
+			exit(1);
+		}
+		if (!patches.save(compilePath))
+		{
+			fprintf(stderr, "couldn't save %s\n", compilePath);
+			exit(1);
+		}
+		
+		printf("saved %u patches to %s\n", (unsigned)patches.size(), compilePath);
+		return 0;
+	}
+	
+	OPLCache* cache = nullptr;
+	if (cachePath)
+		cache = new OPLCache(cachePath, (uint64_t)cacheSize << 20);
+	
+	if (batchPath)
+	{
+		if (optind < argc)
+			patchPath = argv[optind];
+		
+		BatchJob defaults;
+		defaults.chipType = chipType;
+		defaults.numChips = numChips;
+		defaults.minChips = minChips;
+		defaults.songNum = songNum > 0 ? songNum - 1 : 0;
+		defaults.sampleRate = sampleRate;
+		defaults.gain = gain;
+		defaults.filter = filter;
+		defaults.stereo = stereo;
+		defaults.fixedPoint = fixedPoint;
+		defaults.update = update;
+		
+		const int status = mainBatch(batchPath, patchPath, defaults, numThreads, cache);
+		delete cache;
+		return status;
+	}
+	
+	if (replayPath)
+	{
+		// traces are only replayed to files/stdout
+		if (!wavPath)
+			usage();
+		
+		songPath = replayPath;
+		if (optind < argc)
+			patchPath = argv[optind];
+	}
+	else if (inputPath)
+	{
+#ifdef YMFMIDI_NO_SDL
+		if (!wavPath)
+			usage();
+#endif
+		// (the console can't read keys from stdin if it's being used for input)
+		if (!strcmp(inputPath, "-"))
+			interactive = false;
+		
+		songPath = inputPath;
+		if (optind < argc)
+			patchPath = argv[optind];
+	}
+	else
+	{
+		if (optind >= argc)
+			usage();
+#ifdef YMFMIDI_NO_SDL
+		if (!wavPath && !logPath)
+			usage();
+#endif
 	
-	songPath = argv[optind];
-	if (optind + 1 < argc)
-		patchPath = argv[optind + 1];
+		songPath = argv[optind];
+		if (optind + 1 < argc)
+			patchPath = argv[optind + 1];
+	}
 	
 	auto player = new OPLPlayer(numChips, chipType);
 	
-	if (!player->loadSequence(songPath))
+	if (!replayPath && !inputPath && !player->loadSequence(songPath))
 	{
 		fprintf(stderr, "couldn't load %s\n", songPath);
 		exit(1);
@@ -215,20 +513,53 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	
+	if (minChips)
+	{
+		player->setElastic(minChips);
+		player->reset();
+	}
+	
 	player->setLoop(g_looping);
 	player->setSampleRate(sampleRate);
 	player->setGain(gain);
 	player->setFilter(filter);
 	player->setStereo(stereo);
+	if (fixedPoint)
+		player->setFixedPoint();
 	if (songNum > 0)
 		player->setSongNum(songNum - 1);
+	for (uint32_t rate : tapRates)
+		player->addTap(rate);
+	
+	if (logPath)
+	{
+		const char *ext = strrchr(logPath, '.');
+		bool ok;
+		if (ext && (!strcmp(ext, ".dro") || !strcmp(ext, ".DRO")))
+			ok = OPLExport::saveDRO(*player, logPath);
+		else
+			ok = OPLExport::saveVGM(*player, logPath);
+		
+		if (!ok)
+		{
+			fprintf(stderr, "couldn't save %s\n", logPath);
+			exit(1);
+		}
+		
+		printf("saved register log to %s\n", logPath);
+		delete player;
+		delete cache;
+		return 0;
+	}
 	
 	if (interactive)
 	{
+#ifndef YMFMIDI_NO_SDL
 		consoleOpen();
 		consolePos(0);
 		printf("song: %-32.32s | patches: %-29.29s\n",
 			shortPath(songPath), shortPath(patchPath));
+#endif
 	}
 	else
 	{
@@ -238,16 +569,128 @@ int main(int argc, char **argv)
 
 	signal(SIGINT, quit);
 
-	if (wavPath)
-		mainLoopWAV(player, wavPath);
-	else
+	MIDITrace trace;
+	if (tracePath)
+	{
+		// (multithreaded rendering plays the song more than once, and cached output doesn't play it at all)
+		numThreads = 1;
+		delete cache;
+		cache = nullptr;
+		player->setTrace(&trace);
+	}
+	if (!tapPaths.empty())
+	{
+		// (extra outputs aren't cached)
+		delete cache;
+		cache = nullptr;
+	}
+	
+	if (inputPath)
+	{
+		int fd = fileno(stdin);
+		if (strcmp(inputPath, "-"))
+		{
+#ifdef _WIN32
+			fd = open(inputPath, O_RDONLY | O_BINARY);
+#else
+			fd = open(inputPath, O_RDONLY);
+#endif
+		}
+#ifdef _WIN32
+		else
+		{
+			_setmode(fd, _O_BINARY);
+		}
+#endif
+		if (fd < 0)
+		{
+			fprintf(stderr, "couldn't open %s\n", inputPath);
+			exit(1);
+		}
+		
+		// read input on its own thread, so that it can block without holding up the output.
+		// (the thread is never joined, since it may be waiting for input that never comes)
+		g_input = new MIDIInput();
+		g_inputData.reserve(4096);
+		std::thread(readInput, fd).detach();
+	}
+	
+	if (replayPath)
+		mainReplay(player, replayPath, wavPath, stream, realTime);
+	else if (inputPath && wavPath)
+		mainInput(player, wavPath, stream);
+#ifndef YMFMIDI_NO_SDL
+	else if (!wavPath)
 		mainLoopSDL(player, bufferSize, interactive);
+#endif
+	else
+		mainLoopWAV(player, wavPath, stream, bufferSize, numThreads, cache, tapPaths);
+	
+	if (tracePath)
+	{
+		player->setTrace(nullptr);
+		if (!trace.save(tracePath))
+		{
+			fprintf(stderr, "couldn't save %s\n", tracePath);
+			exit(1);
+		}
+		printf("saved MIDI trace to %s (%u bytes)\n", tracePath, (unsigned)trace.size());
+	}
+	
+	if (g_input)
+		printf("received %llu MIDI messages\n", (unsigned long long)g_input->numEvents());
 	
 	delete player;
+	delete cache;
 	
 	return 0;
 }
 
+// ----------------------------------------------------------------------------
+static void readInput(int fd)
+{
+	uint8_t buf[256];
+	int len;
+	
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		std::lock_guard<std::mutex> lock(g_inputMutex);
+		g_inputData.insert(g_inputData.end(), buf, buf + len);
+	}
+	
+	std::lock_guard<std::mutex> lock(g_inputMutex);
+	g_inputDone = true;
+}
+
+// ----------------------------------------------------------------------------
+static bool updateInput(OPLPlayer *player)
+{
+	// after the input ends, keep playing until any released notes have finished
+	// (notes that are still held would never end, so they're cut off like at the end of a song)
+	if (g_inputEnded)
+	{
+		return player->soundingVoices() > player->activeVoices()
+			&& std::chrono::steady_clock::now() < g_inputEndTime + std::chrono::seconds(maxInputTail);
+	}
+	
+	// don't wait for the input thread, just pick up anything new on the next update
+	std::unique_lock<std::mutex> lock(g_inputMutex, std::try_to_lock);
+	if (!lock.owns_lock())
+		return true;
+	
+	g_input->input(*player, g_inputData.data(), g_inputData.size());
+	g_inputData.clear();
+	
+	// either way, anything that just arrived still gets played on this update
+	if (g_inputDone)
+	{
+		g_inputEnded = true;
+		g_inputEndTime = std::chrono::steady_clock::now();
+	}
+	return true;
+}
+
+#ifndef YMFMIDI_NO_SDL
 // ----------------------------------------------------------------------------
 static SDL_AudioSpec g_audioSpec;
 
@@ -256,12 +699,15 @@ static void audioCallback(void *data, uint8_t *stream, int len)
 	memset(stream, g_audioSpec.silence, len);
 	
 	auto player = reinterpret_cast<OPLPlayer*>(data);
+	if (g_input)
+		g_running &= updateInput(player);
+	
 	if (g_audioSpec.format == AUDIO_F32SYS)
 		player->generate(reinterpret_cast<float*>(stream), len / (2 * sizeof(float)));
 	else if (g_audioSpec.format == AUDIO_S16SYS)
 		player->generate(reinterpret_cast<int16_t*>(stream), len / (2 * sizeof(int16_t)));
 	
-	if (!g_looping)
+	if (!g_looping && !g_input)
 		g_running &= !player->atEnd();
 }
 
@@ -360,101 +806,253 @@ static void mainLoopSDL(OPLPlayer *player, int bufferSize, bool interactive)
 
 	SDL_Quit();
 }
+#endif // YMFMIDI_NO_SDL
 
 // ----------------------------------------------------------------------------
-static void mainLoopWAV(OPLPlayer *player, const char *path)
+static void mainLoopWAV(OPLPlayer *player, const char *path, FILE *stream, int bufferSize, unsigned numThreads,
+                        const OPLCache *cache, const std::vector<const char*>& tapPaths)
 {
-	FILE *wav = fopen(path, "wb");
-	if (!wav)
+	// only render one channel for mono output
+	player->setMonoOutput(!player->stereo());
+	
+	WAVWriter wav;
+	if (stream ? !wav.open(stream, player->stereo())
+	           : !wav.open(path, player->sampleRate(), player->stereo()))
 	{
 		fprintf(stderr, "couldn't open %s\n", path);
 		exit(1);
 	}
 	
+	// extra outputs at other sample rates (see OPLPlayer::addTap)
+	std::vector<WAVWriter> tapWAVs(tapPaths.size());
+	for (unsigned i = 0; i < tapPaths.size(); i++)
+	{
+		if (!tapWAVs[i].open(tapPaths[i], player->tapSampleRate(i), player->stereo()))
+		{
+			fprintf(stderr, "couldn't open %s\n", tapPaths[i]);
+			exit(1);
+		}
+	}
+	
 	printf("rendering %s...\n", path);
 	
-	fseek(wav, 44, SEEK_SET);
+	uint64_t hash = OPLRender::hashInit;
+	std::vector<int16_t> tapSamples(bufferSize * 2);
 	
-	uint32_t numSamples = 0;
-	uint16_t samples[2];
-	char outSamples[4];
-	const unsigned bytesPerSample = player->stereo() ? 4 : 2;
+	auto writeSamples = [&](const int16_t *samples, unsigned count)
+	{
+		if (!wav.write(samples, count))
+		{
+			fprintf(stderr, "writing WAV data failed\n");
+			exit(1);
+		}
+		
+		for (unsigned i = 0; i < tapWAVs.size(); i++)
+		{
+			unsigned tapCount;
+			while ((tapCount = player->readTap(i, tapSamples.data(), bufferSize)) > 0)
+			{
+				if (!tapWAVs[i].write(tapSamples.data(), tapCount))
+				{
+					fprintf(stderr, "writing WAV data failed\n");
+					exit(1);
+				}
+			}
+		}
+		
+		hash = OPLRender::hash(samples, count, hash, player->monoOutput());
+		return g_running;
+	};
 	
-	while (!player->atEnd())
+	if (cache)
 	{
-		player->generate(reinterpret_cast<int16_t*>(samples), 1);
-		outSamples[0] = samples[0];
-		outSamples[1] = samples[0] >> 8;
-		outSamples[2] = samples[1];
-		outSamples[3] = samples[1] >> 8;
+		static const char *results[] = {"rendered", "read from cache", "resumed from cache", "rendered (uncached)"};
+		OPLCache::Result result;
+		cache->render(*player, writeSamples, &result);
+		printf("%s\n", results[result]);
+	}
+	else if (numThreads == 1)
+	{
+		// render in blocks that end at each MIDI event, so that the output ends exactly when the song does
+		std::vector<int16_t> samples(bufferSize * 2);
+		player->generateBlocks(samples.data(), bufferSize, writeSamples);
+	}
+	else
+	{
+		OPLRender::render(*player, writeSamples, numThreads);
+	}
+	
+	printf("output hash: %016llx\n", (unsigned long long)hash);
+	
+	if (!wav.close())
+	{
+		fprintf(stderr, "writing WAV header failed\n");
+		exit(1);
+	}
+	for (unsigned i = 0; i < tapWAVs.size(); i++)
+	{
+		if (!tapWAVs[i].close())
+		{
+			fprintf(stderr, "writing WAV header failed\n");
+			exit(1);
+		}
+		printf("also rendered %s (%u Hz)\n", tapPaths[i], player->tapSampleRate(i));
+	}
+}
+
+// ----------------------------------------------------------------------------
+static void mainReplay(OPLPlayer *player, const char *tracePath, const char *path, FILE *stream, bool realTime)
+{
+	MIDITrace trace;
+	if (!trace.load(tracePath))
+	{
+		fprintf(stderr, "couldn't load %s\n", tracePath);
+		exit(1);
+	}
+	
+	// only render one channel for mono output
+	player->setMonoOutput(!player->stereo());
+	
+	WAVWriter wav;
+	if (stream ? !wav.open(stream, player->stereo())
+	           : !wav.open(path, player->sampleRate(), player->stereo()))
+	{
+		fprintf(stderr, "couldn't open %s\n", path);
+		exit(1);
+	}
+	
+	printf("replaying to %s...\n", path);
+	
+	uint64_t hash = OPLRender::hashInit;
+	
+	auto writeSamples = [&](const int16_t *samples, unsigned count)
+	{
+		if (!wav.write(samples, count))
+		{
+			fprintf(stderr, "writing WAV data failed\n");
+			exit(1);
+		}
+		
+		hash = OPLRender::hash(samples, count, hash, player->monoOutput());
+		return g_running;
+	};
+	
+	MIDIReplay replay(trace);
+	const auto startTime = std::chrono::steady_clock::now();
+	const uint64_t numSamples = replay.run(*player, writeSamples, realTime);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	
+	printf("replayed %.3fs of output in %.3fs\n", (double)numSamples / player->sampleRate(), seconds);
+	printf("output hash: %016llx\n", (unsigned long long)hash);
+	
+	if (!wav.close())
+	{
+		fprintf(stderr, "writing WAV header failed\n");
+		exit(1);
+	}
+}
+
+// ----------------------------------------------------------------------------
+static void mainInput(OPLPlayer *player, const char *path, FILE *stream)
+{
+	// render in small blocks, so that each MIDI message is heard soon after it arrives
+	static const unsigned blockSize = 128;
+	
+	// only render one channel for mono output
+	player->setMonoOutput(!player->stereo());
+	
+	WAVWriter wav;
+	if (stream ? !wav.open(stream, player->stereo())
+	           : !wav.open(path, player->sampleRate(), player->stereo()))
+	{
+		fprintf(stderr, "couldn't open %s\n", path);
+		exit(1);
+	}
+	
+	printf("playing MIDI input to %s...\n", path);
+	
+	uint64_t hash = OPLRender::hashInit;
+	std::vector<int16_t> samples(blockSize * 2);
+	const auto startTime = std::chrono::steady_clock::now();
+	uint64_t samplesDone = 0;
+	
+	while (g_running && updateInput(player))
+	{
+		player->generate(samples.data(), blockSize);
+		samplesDone += blockSize;
 		
-		if (fwrite(outSamples, 1, bytesPerSample, wav) != bytesPerSample)
+		if (!wav.write(samples.data(), blockSize))
 		{
 			fprintf(stderr, "writing WAV data failed\n");
 			exit(1);
 		}
-		numSamples++;
-	}
-	
-	// fill in the rendered sample size and write the header
-	const uint32_t sampleRate = player->sampleRate();
-	const uint32_t byteRate = sampleRate * bytesPerSample;
-	const uint32_t dataSize = numSamples * bytesPerSample;
-	const uint32_t wavSize = dataSize + 36;
-	
-	char header[44] = {0};
-	
-	header[0] = 'R';
-	header[1] = 'I';
-	header[2] = 'F';
-	header[3] = 'F';
-	header[4] = (char)(wavSize);
-	header[5] = (char)(wavSize >> 8);
-	header[6] = (char)(wavSize >> 16);
-	header[7] = (char)(wavSize >> 24);
-	header[8]  = 'W';
-	header[9]  = 'A';
-	header[10] = 'V';
-	header[11] = 'E';
-	
-	// format chunk
-	header[12] = 'f';
-	header[13] = 'm';
-	header[14] = 't';
-	header[15] = ' ';
-	header[16] = 16; // chunk size
-	header[20] = 1;  // sample format (PCM)
-	if (bytesPerSample == 4)
-		header[22] = 2;  // stereo
-	else
-		header[22] = 1;  // mono
-	header[24] = (char)(sampleRate);
-	header[25] = (char)(sampleRate >> 8);
-	header[26] = (char)(sampleRate >> 16);
-	header[27] = (char)(sampleRate >> 24);
-	header[28] = (char)(byteRate);
-	header[29] = (char)(byteRate >> 8);
-	header[30] = (char)(byteRate >> 16);
-	header[31] = (char)(byteRate >> 24);
-	header[32] = 4;  // bytes per sample
-	header[34] = 16; // bits per sample
-	
-	// data chunk
-	header[36] = 'd';
-	header[37] = 'a';
-	header[38] = 't';
-	header[39] = 'a';
-	header[40] = (char)(dataSize);
-	header[41] = (char)(dataSize >> 8);
-	header[42] = (char)(dataSize >> 16);
-	header[43] = (char)(dataSize >> 24);
-	
-	fseek(wav, 0, SEEK_SET);
-	if (fwrite(header, 1, sizeof(header), wav) != sizeof(header))
+		hash = OPLRender::hash(samples.data(), blockSize, hash, player->monoOutput());
+		
+		// keep the output in real time, so that input is played at the time it arrives
+		std::this_thread::sleep_until(startTime
+			+ std::chrono::microseconds(samplesDone * 1000000 / player->sampleRate()));
+	}
+	
+	printf("played %.3fs of output\n", (double)samplesDone / player->sampleRate());
+	printf("output hash: %016llx\n", (unsigned long long)hash);
+	
+	if (!wav.close())
 	{
 		fprintf(stderr, "writing WAV header failed\n");
 		exit(1);
 	}
+}
+
+// ----------------------------------------------------------------------------
+static int mainBatch(const char *listPath, const char *patchPath, const BatchJob& defaults, unsigned numThreads,
+                     const OPLCache *cache)
+{
+	std::vector<BatchJob> jobs;
+	std::string error;
+	if (!OPLBatch::loadList(listPath, defaults, jobs, error))
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	
+	auto patches = std::make_shared<PatchBank>();
+	if (!patches->load(patchPath))
+	{
+		fprintf(stderr, "couldn't load %s\n", patchPath);
+		return 1;
+	}
+	
+	if (!numThreads)
+		numThreads = ThreadPool::defaultThreads();
+	printf("patches: %s\nrendering %u songs (%u threads)...\n",
+		shortPath(patchPath), (unsigned)jobs.size(), numThreads);
+	
+	auto done = [](size_t index, const BatchJob& job, const BatchResult& result)
+	{
+		if (result.ok)
+			printf("[%zu] %-6s  %8.3fs  %016llx  %s -> %s\n", index + 1, result.cached ? "cached" : "ok", result.seconds,
+				(unsigned long long)result.hash, job.songPath.c_str(), job.outPath.c_str());
+		else
+			printf("[%zu] FAILED                              %s (%s)\n", index + 1,
+				job.songPath.c_str(), result.error.c_str());
+	};
+	
+	const auto startTime = std::chrono::steady_clock::now();
+	std::vector<BatchResult> results;
+	OPLBatch::render(jobs, patches, results, numThreads, done, cache);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	
+	unsigned numFailed = 0;
+	double songSeconds = 0.0;
+	for (const auto& result : results)
+	{
+		if (!result.ok)
+			numFailed++;
+		songSeconds += result.seconds;
+	}
+	
+	printf("rendered %u of %u songs in %.3fs (%.3fs total song time)\n",
+		(unsigned)(results.size() - numFailed), (unsigned)results.size(), seconds, songSeconds);
 	
-	fclose(wav);
+	return numFailed ? 1 : 0;
 }
@@ -0,0 +1,110 @@
+#include "midiin.h"
+#include "player.h"
+
+const unsigned MIDIInput::maxSysEx;
+
+// ----------------------------------------------------------------------------
+static unsigned dataSize(uint8_t status)
+{
+	switch (status)
+	{
+	case 0xF1: // time code quarter frame
+	case 0xF3: // song select
+		return 1;
+	
+	case 0xF2: // song position
+		return 2;
+	}
+	
+	if (status >= 0xF0)
+		return 0;
+	if ((status >> 4) == 0xC || (status >> 4) == 0xD)
+		return 1;
+	return 2;
+}
+
+// ----------------------------------------------------------------------------
+MIDIInput::MIDIInput()
+{
+	m_sysEx.reserve(maxSysEx + 1);
+	m_numEvents = 0;
+	
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+void MIDIInput::reset()
+{
+	m_status = 0;
+	m_data[0] = m_data[1] = 0;
+	m_numData = m_dataSize = 0;
+	
+	m_inSysEx = false;
+	m_sysEx.clear();
+}
+
+// ----------------------------------------------------------------------------
+void MIDIInput::input(OPLPlayer& player, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		const uint8_t byte = data[i];
+		
+		if (byte >= 0xF8)
+		{
+			// realtime messages (clock, start/stop, active sensing, etc.) can show up anywhere,
+			// even in the middle of another message, and don't interrupt it
+			continue;
+		}
+		else if (byte & 0x80)
+		{
+			// any other status byte ends a sysex, whether it's 0xF7 or not
+			if (m_inSysEx)
+			{
+				if (byte == 0xF7)
+					m_sysEx.push_back(byte);
+				// (sent without the opening 0xF0, same as sysex events in MIDI files)
+				player.midiSysEx(m_sysEx.data(), m_sysEx.size());
+				m_numEvents++;
+				m_inSysEx = false;
+			}
+			
+			m_numData = 0;
+			m_dataSize = dataSize(byte);
+			m_data[1] = 0;
+			
+			if (byte < 0xF0)
+			{
+				m_status = byte;
+			}
+			else
+			{
+				// system messages cancel running status (and system common messages are ignored)
+				m_status = 0;
+				if (byte == 0xF0)
+				{
+					m_inSysEx = true;
+					m_sysEx.clear();
+				}
+			}
+		}
+		else if (m_inSysEx)
+		{
+			if (m_sysEx.size() < maxSysEx)
+				m_sysEx.push_back(byte);
+			else
+				m_inSysEx = false;
+		}
+		else if (m_numData < m_dataSize)
+		{
+			m_data[m_numData++] = byte;
+			if (m_numData == m_dataSize && m_status)
+			{
+				player.midiEvent(m_status, m_data[0], m_data[1]);
+				m_numEvents++;
+				// with running status, the next data byte starts another message
+				m_numData = 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef __MIDIIN_H
+#define __MIDIIN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class OPLPlayer;
+
+// turns a raw stream of MIDI bytes (e.g. from a pipe or a MIDI port) back into individual messages,
+// sending each one to a player as soon as its last byte arrives.
+// the stream can be split up anywhere, including in the middle of a message or a sysex
+class MIDIInput
+{
+public:
+	MIDIInput();
+	
+	// forget any partial message and the current running status
+	void reset();
+	
+	// handle the next part of the stream
+	void input(OPLPlayer& player, const uint8_t *data, size_t size);
+	
+	// number of messages sent to the player so far
+	uint64_t numEvents() const { return m_numEvents; }
+
+private:
+	// longest sysex message to keep (anything longer is ignored)
+	static const unsigned maxSysEx = 1024;
+	
+	uint8_t m_status; // running status, or 0 if data bytes should be ignored
+	uint8_t m_data[2];
+	unsigned m_numData, m_dataSize;
+	
+	bool m_inSysEx;
+	std::vector<uint8_t> m_sysEx;
+	
+	uint64_t m_numEvents;
+};
+
+#endif // __MIDIIN_H
@@ -1,17 +1,51 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <new>
+#include <type_traits>
 #include <vector>
 
 #include "patches.h"
 #include "player.h"
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::load(OPLPatchSet& patches, const char *path)
+void PatchVoice::bake()
+{
+	for (unsigned type = 0; type < 3; type++)
+	{
+		// OPL2 only has the first 4 waveforms (and OPL doesn't have any, but its values are never written)
+		const uint8_t waveMask = (type == OPLPlayer::ChipOPL2) ? 0x03 : 0xff;
+		
+		regs[type][0] = op_mode[0];
+		regs[type][1] = op_mode[1];
+		regs[type][2] = op_ad[0];
+		regs[type][3] = op_ad[1];
+		regs[type][4] = op_wave[0] & waveMask;
+		regs[type][5] = op_wave[1] & waveMask;
+	}
+}
+
+// ----------------------------------------------------------------------------
+void OPLPatch::setName(const char *newName, size_t maxLength)
+{
+	// (clear the whole thing, so that saved banks don't contain any leftover bytes)
+	memset(name, 0, sizeof(name));
+	memcpy(name, newName, strnlen(newName, std::min(maxLength, sizeof(name) - 1)));
+}
+
+// ----------------------------------------------------------------------------
+PatchBank::PatchBank(const PatchBank& other)
+{
+	merge(other);
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::load(const char *path)
 {
 	FILE *file = fopen(path, "rb");
 	if (!file) return false;
 
-	bool ok = load(patches, file);
+	bool ok = load(file);
 	
 	fclose(file);
 	
@@ -19,35 +53,85 @@ bool OPLPatch::load(OPLPatchSet& patches, const char *path)
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::load(OPLPatchSet& patches, FILE *file, int offset, size_t size)
+bool PatchBank::load(FILE *file, int offset, size_t size)
 {
-	if (!size)
+	m_hash = 0;
+	
+	if (!this->size())
 	{
-		fseek(file, 0, SEEK_END);
-		if (ftell(file) < 0)
+		// map the file first, in case it's a compiled bank that can be used in place
+		if (!m_block.map(file, offset, size))
 			return false;
-		size = ftell(file) - offset;
+		if (isCompiled(m_block.data(), m_block.size()))
+			return loadCompiled();
+		
+		bool ok = load(m_block.data(), m_block.size());
+		m_block.clear();
+		return ok;
 	}
 	
-	fseek(file, offset, SEEK_SET);
-	std::vector<uint8_t> data(size);
-	if (fread(data.data(), 1, size, file) != size)
+	DataBlock data;
+	if (!data.map(file, offset, size))
 		return false;
 
-	return load(patches, data.data(), size);
+	return load(data.data(), data.size());
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::load(OPLPatchSet& patches, const uint8_t *data, size_t size)
+bool PatchBank::load(const uint8_t *data, size_t size)
 {
-	return loadWOPL(patches, data, size)
-	    || loadOP2(patches, data, size)
-	    || loadAIL(patches, data, size)
-	    || loadTMB(patches, data, size);
+	m_hash = 0;
+	
+	if (isCompiled(data, size))
+	{
+		if (!this->size())
+		{
+			m_block.copy(data, size);
+			return loadCompiled();
+		}
+		
+		PatchBank other;
+		other.m_block.borrow(data, size);
+		if (!other.loadCompiled())
+			return false;
+		
+		expand();
+		merge(other);
+		return true;
+	}
+	
+	expand();
+	return loadWOPL(data, size)
+	    || loadOP2(data, size)
+	    || loadAIL(data, size)
+	    || loadTMB(data, size);
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::loadWOPL(OPLPatchSet& patches, const uint8_t *data, size_t size)
+void PatchBank::merge(const PatchBank& other)
+{
+	other.each([this](uint16_t key, const OPLPatch& patch)
+	{
+		m_patches[key] = patch;
+	});
+}
+
+// ----------------------------------------------------------------------------
+void PatchBank::expand()
+{
+	if (!isCompiled())
+		return;
+	
+	merge(*this);
+	
+	m_compiled = nullptr;
+	m_numCompiled = 0;
+	m_banks = m_tables = m_keys = nullptr;
+	m_block.clear();
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::loadWOPL(const uint8_t *data, size_t size)
 {
 	if (size < 19)
 		return false;
@@ -97,15 +181,15 @@ bool OPLPatch::loadWOPL(OPLPatchSet& patches, const uint8_t *data, size_t size)
 		if (bytes[39] & 0x3c)
 			continue;
 		
-		OPLPatch &patch = patches[key];
+		OPLPatch &patch = m_patches[key];
 		// clear patch data
 		patch = OPLPatch();
 		
 		// patch names
 		if (bytes[0])
-			patch.name = std::string((const char*)bytes, 31);
+			patch.setName((const char*)bytes, 31);
 		else
-			patch.name = names[key & 0xff];
+			patch.setName(OPLPatch::names[key & 0xff]);
 		
 		// patch global settings
 		patch.voice[0].tune     = (int8_t)bytes[33] - 12;
@@ -133,13 +217,15 @@ bool OPLPatch::loadWOPL(OPLPatchSet& patches, const uint8_t *data, size_t size)
 			voice.op_sr[n]    = bytes[pos++];
 			voice.op_wave[n]  = bytes[pos++];
 		}
+		
+		patch.bake();
 	}
 	
 	return true;
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::loadOP2(OPLPatchSet& patches, const uint8_t *data, size_t size)
+bool PatchBank::loadOP2(const uint8_t *data, size_t size)
 {
 	if (size < 175 * (36 + 32) + 8)
 		return false;
@@ -153,7 +239,7 @@ bool OPLPatch::loadOP2(OPLPatchSet& patches, const uint8_t *data, size_t size)
 		// patches 0-127 are melodic; the rest are for percussion notes 35 thru 81
 		unsigned key = (i < 128) ? i : (i + 35);
 		
-		OPLPatch &patch = patches[key];
+		OPLPatch &patch = m_patches[key];
 		// clear patch data
 		patch = OPLPatch();
 		
@@ -205,16 +291,18 @@ bool OPLPatch::loadOP2(OPLPatchSet& patches, const uint8_t *data, size_t size)
 		// seek to patch name
 		bytes = data + (32*i) + (36*175) + 8;
 		if (bytes[0])
-			patch.name = std::string((const char*)bytes, 31);
+			patch.setName((const char*)bytes, 31);
 		else
-			patch.name = names[key];
+			patch.setName(OPLPatch::names[key]);
+		
+		patch.bake();
 	}
 	
 	return true;
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::loadAIL(OPLPatchSet& patches, const uint8_t *data, size_t size)
+bool PatchBank::loadAIL(const uint8_t *data, size_t size)
 {
 	int index = 0;
 	
@@ -233,10 +321,10 @@ bool OPLPatch::loadAIL(OPLPatchSet& patches, const uint8_t *data, size_t size)
 		else
 			key = (entry[0] | (entry[1] << 8)) & 0x7f7f;
 		
-		OPLPatch &patch = patches[key];
+		OPLPatch &patch = m_patches[key];
 		// clear patch data
 		patch = OPLPatch();
-		patch.name = names[key & 0xff];
+		patch.setName(OPLPatch::names[key & 0xff]);
 		
 		uint32_t patchPos = entry[2] | (entry[3] << 8) | (entry[4] << 16) | (entry[5] << 24);
 		if (size < patchPos)
@@ -281,21 +369,23 @@ bool OPLPatch::loadAIL(OPLPatchSet& patches, const uint8_t *data, size_t size)
 					pos++;
 			}
 		}
+		
+		patch.bake();
 	}
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPatch::loadTMB(OPLPatchSet& patches, const uint8_t *data, size_t size)
+bool PatchBank::loadTMB(const uint8_t *data, size_t size)
 {
 	if (size < 256 * 13)
 		return false;
 	
 	for (uint16_t key = 0; key < 256; key++)
 	{
-		OPLPatch &patch = patches[key];
+		OPLPatch &patch = m_patches[key];
 		// clear patch data
 		patch = OPLPatch();
-		patch.name = names[key];
+		patch.setName(OPLPatch::names[key]);
 		
 		const uint8_t *bytes = data + (key * 13);
 		
@@ -320,7 +410,332 @@ bool OPLPatch::loadTMB(OPLPatchSet& patches, const uint8_t *data, size_t size)
 		voice.conn        = bytes[10];
 		voice.tune        = (int8_t)bytes[11] - 12;
 		patch.velocity    = (int8_t)bytes[12];
+		
+		patch.bake();
+	}
+	
+	return true;
+}
+// ----------------------------------------------------------------------------
+// compiled bank format (header and table values are little-endian):
+//   header (32 bytes):
+//     0  "YMFMIDI-PATCHES\0"
+//     16 version (u16)
+//     18 number of patches (u16)
+//     20 number of lookup tables (u16)
+//     22 size of each patch record (u16)
+//     24 offset of patch records (u32)
+//     28 0x01020304 (u32, in the byte order of the platform that saved the bank)
+//   256 table numbers, one for each bank (u16); bit 15 is set if the bank doesn't exist,
+//     in which case it uses bank 0's table
+//   lookup tables, 256 patch indexes each (u16) for each program/note number; bit 15 is set
+//     if the patch is a fallback instead of an exact match, or 0xffff if there isn't one at all
+//   key of each patch (u16)
+//   patch records, each one an OPLPatch exactly as it's laid out in memory (including the baked
+//     register values), at a suitably aligned offset so that they can be used straight from the mapped file
+static const char compiledMagic[16] = "YMFMIDI-PATCHES";
+static const uint16_t compiledVersion = 2;
+static const unsigned compiledHeaderSize = 32;
+static const unsigned compiledTableSize = 256 * 2;
+static const uint32_t compiledByteOrder = 0x01020304;
+
+static_assert(std::is_trivially_copyable<OPLPatch>::value, "compiled banks need OPLPatch to be plain data");
+
+static uint16_t read16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+static uint32_t read32(const uint8_t *data) { return read16(data) | (read16(data + 2) << 16); }
+
+static void write16(uint8_t *data, uint16_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static void write32(uint8_t *data, uint32_t value)
+{
+	write16(data, value);
+	write16(data + 2, value >> 16);
+}
+
+// ----------------------------------------------------------------------------
+// copy a patch one field at a time, so that any padding bytes in 'dest' are left alone
+// (compiled banks are saved with zeroed padding, so the same bank is always saved the same way)
+static void copyPatch(OPLPatch& dest, const OPLPatch& src)
+{
+	memcpy(dest.name, src.name, sizeof(dest.name));
+	dest.fourOp    = src.fourOp;
+	dest.dualTwoOp = src.dualTwoOp;
+	dest.fixedNote = src.fixedNote;
+	dest.velocity  = src.velocity;
+	
+	for (unsigned i = 0; i < 2; i++)
+	{
+		PatchVoice &voice = dest.voice[i];
+		const PatchVoice &srcVoice = src.voice[i];
+		
+		for (unsigned op = 0; op < 2; op++)
+		{
+			voice.op_mode[op]  = srcVoice.op_mode[op];
+			voice.op_ksr[op]   = srcVoice.op_ksr[op];
+			voice.op_level[op] = srcVoice.op_level[op];
+			voice.op_ad[op]    = srcVoice.op_ad[op];
+			voice.op_sr[op]    = srcVoice.op_sr[op];
+			voice.op_wave[op]  = srcVoice.op_wave[op];
+		}
+		voice.conn     = srcVoice.conn;
+		voice.tune     = srcVoice.tune;
+		voice.finetune = srcVoice.finetune;
+		memcpy(voice.regs, srcVoice.regs, sizeof(voice.regs));
+	}
+}
+
+// ----------------------------------------------------------------------------
+const OPLPatch* PatchBank::find(uint16_t key) const
+{
+	if (isCompiled())
+	{
+		const uint16_t table = read16(m_banks + 2 * (key >> 8));
+		const uint16_t index = read16(m_tables + compiledTableSize * (table & 0x7fff) + 2 * (key & 0xff));
+		// no exact match if either the bank or the patch is only a fallback
+		if ((table | index) & 0x8000)
+			return nullptr;
+		return &m_compiled[index];
+	}
+	
+	auto patch = m_patches.find(key);
+	return (patch != m_patches.end()) ? &patch->second : nullptr;
+}
+
+// ----------------------------------------------------------------------------
+const OPLPatch* PatchBank::resolve(uint16_t key) const
+{
+	if (isCompiled())
+	{
+		// compiled banks already have the fallbacks in their lookup tables
+		const uint16_t table = read16(m_banks + 2 * (key >> 8));
+		const uint16_t index = read16(m_tables + compiledTableSize * (table & 0x7fff) + 2 * (key & 0xff));
+		if (index == 0xffff)
+			return nullptr;
+		return &m_compiled[index & 0x7fff];
+	}
+	
+	const OPLPatch *patch = find(key);
+	// if this patch+bank combo doesn't exist, default to bank 0
+	if (!patch)
+		patch = find(key & 0x00ff);
+	// if patch still doesn't exist in bank 0, use patch 0 (or drum note 0)
+	// (if that somehow still doesn't exist, forget it)
+	if (!patch)
+		patch = find(key & 0x0080);
+	
+	return patch;
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::isCompiled(const uint8_t *data, size_t size)
+{
+	return size >= compiledHeaderSize
+	    && !memcmp(data, compiledMagic, sizeof(compiledMagic))
+	    && read16(data + 16) == compiledVersion;
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::loadCompiled()
+{
+	const uint8_t *data = m_block.data();
+	const size_t size = m_block.size();
+	
+	m_compiled = nullptr;
+	m_numCompiled = 0;
+	m_banks = m_tables = m_keys = nullptr;
+	
+	if (!isCompiled(data, size))
+		return false;
+	
+	const unsigned numPatches = read16(data + 18);
+	const unsigned numTables  = read16(data + 20);
+	const unsigned recordSize = read16(data + 22);
+	const size_t patchOffset  = read32(data + 24);
+	uint32_t byteOrder;
+	memcpy(&byteOrder, data + 28, sizeof(byteOrder));
+	
+	const size_t banksOffset = compiledHeaderSize;
+	const size_t tablesOffset = banksOffset + compiledTableSize;
+	const size_t keysOffset = tablesOffset + compiledTableSize * numTables;
+	
+	// the patch records can only be used as they are on the same kind of platform that saved them
+	if (!numTables
+	    || recordSize != sizeof(OPLPatch) || byteOrder != compiledByteOrder
+	    || patchOffset < keysOffset + 2 * numPatches || patchOffset % alignof(OPLPatch)
+	    || size < patchOffset || (size - patchOffset) / sizeof(OPLPatch) < numPatches)
+	{
+		m_block.clear();
+		return false;
+	}
+	
+	// make sure all of the lookup tables are valid
+	bool ok = true;
+	for (unsigned i = 0; i < 256; i++)
+		ok &= (read16(data + banksOffset + 2 * i) & 0x7fff) < numTables;
+	for (unsigned i = 0; i < 256 * numTables; i++)
+	{
+		const uint16_t index = read16(data + tablesOffset + 2 * i);
+		ok &= (index == 0xffff) || (index & 0x7fff) < numPatches;
+	}
+	
+	if (!ok || !numPatches)
+	{
+		m_block.clear();
+		return ok;
+	}
+	
+	// the block is only aligned well enough for the patch records to be used in place if it starts at
+	// the beginning of a file (or in memory allocated by the caller), so copy it otherwise
+	if ((uintptr_t)(data + patchOffset) % alignof(OPLPatch))
+	{
+		const std::vector<uint8_t> temp(data, data + size);
+		m_block.copy(temp.data(), temp.size());
+		data = m_block.data();
+	}
+	
+	// don't use any patches containing values that aren't safe to read
+	// (anything other than 0 or 1 for a bool, or a name that isn't null-terminated)
+	const OPLPatch *patches = reinterpret_cast<const OPLPatch*>(data + patchOffset);
+	for (unsigned i = 0; ok && i < numPatches; i++)
+	{
+		uint8_t flags[2];
+		memcpy(&flags[0], &patches[i].fourOp, 1);
+		memcpy(&flags[1], &patches[i].dualTwoOp, 1);
+		ok &= (flags[0] <= 1) && (flags[1] <= 1)
+		   && memchr(patches[i].name, 0, sizeof(patches[i].name));
+	}
+	
+	if (!ok)
+	{
+		m_block.clear();
+		return false;
+	}
+	
+	m_banks = data + banksOffset;
+	m_tables = data + tablesOffset;
+	m_keys = data + keysOffset;
+	m_compiled = patches;
+	m_numCompiled = numPatches;
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::save(const char *path) const
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	
+	bool ok = save(file);
+	
+	ok &= !fclose(file);
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::save(FILE *file) const
+{
+	std::vector<uint8_t> data;
+	if (!save(data))
+		return false;
+	
+	return fwrite(data.data(), 1, data.size(), file) == data.size();
+}
+
+// ----------------------------------------------------------------------------
+bool PatchBank::save(std::vector<uint8_t>& data) const
+{
+	// sort patches by key, so the same bank is always saved the same way
+	std::vector<std::pair<uint16_t, const OPLPatch*>> patches;
+	each([&](uint16_t key, const OPLPatch& patch) { patches.push_back({key, &patch}); });
+	std::sort(patches.begin(), patches.end(),
+		[](const std::pair<uint16_t, const OPLPatch*>& a, const std::pair<uint16_t, const OPLPatch*>& b)
+		{ return a.first < b.first; });
+	
+	if (patches.size() > 0x7fff)
+		return false;
+	
+	std::unordered_map<const OPLPatch*, uint16_t> indexes;
+	for (unsigned i = 0; i < patches.size(); i++)
+		indexes[patches[i].second] = i;
+	
+	// each bank that has any patches gets a lookup table (bank 0 always gets one for the others to fall back on)
+	uint16_t banks[256];
+	unsigned numTables = 0;
+	for (unsigned bank = 0; bank < 256; bank++)
+		banks[bank] = 0x8000;
+	banks[0] = numTables++;
+	for (auto& patch : patches)
+		if (banks[patch.first >> 8] & 0x8000)
+			banks[patch.first >> 8] = numTables++;
+	
+	const size_t tablesOffset = compiledHeaderSize + compiledTableSize;
+	const size_t keysOffset = tablesOffset + compiledTableSize * numTables;
+	size_t patchOffset = keysOffset + 2 * patches.size();
+	patchOffset += (alignof(OPLPatch) - patchOffset % alignof(OPLPatch)) % alignof(OPLPatch);
+	data.assign(patchOffset + sizeof(OPLPatch) * patches.size(), 0);
+	
+	memcpy(&data[0], compiledMagic, sizeof(compiledMagic));
+	write16(&data[16], compiledVersion);
+	write16(&data[18], patches.size());
+	write16(&data[20], numTables);
+	write16(&data[22], sizeof(OPLPatch));
+	write32(&data[24], patchOffset);
+	memcpy(&data[28], &compiledByteOrder, sizeof(compiledByteOrder));
+	
+	for (unsigned bank = 0; bank < 256; bank++)
+	{
+		write16(&data[compiledHeaderSize + 2 * bank], banks[bank]);
+		if (banks[bank] & 0x8000)
+			continue;
+		
+		uint8_t *table = &data[tablesOffset + compiledTableSize * banks[bank]];
+		for (unsigned num = 0; num < 256; num++)
+		{
+			const uint16_t key = (bank << 8) | num;
+			const OPLPatch *patch = resolve(key);
+			
+			if (!patch)
+				write16(table + 2 * num, 0xffff);
+			else
+				write16(table + 2 * num, indexes[patch] | (find(key) ? 0 : 0x8000));
+		}
+	}
+	
+	for (unsigned i = 0; i < patches.size(); i++)
+	{
+		write16(&data[keysOffset + 2 * i], patches[i].first);
+		
+		// (the vector's storage is aligned well enough for this)
+		OPLPatch *record = new (&data[patchOffset + sizeof(OPLPatch) * i]) OPLPatch;
+		copyPatch(*record, *patches[i].second);
 	}
 	
 	return true;
 }
+
+// ----------------------------------------------------------------------------
+uint64_t PatchBank::hash() const
+{
+	uint64_t hash = m_hash;
+	if (hash)
+		return hash;
+	
+	// 64-bit FNV-1a, like the render cache's other hashes
+	std::vector<uint8_t> data;
+	save(data);
+	hash = 0xcbf29ce484222325ull;
+	for (uint8_t byte : data)
+		hash = (hash ^ byte) * 0x100000001b3ull;
+	
+	// (0 means there's no saved hash)
+	if (!hash)
+		hash = 1;
+	
+	m_hash = hash;
+	return hash;
+}
@@ -2,9 +2,16 @@
 #define __PATCHES_H
 
 #include <stddef.h>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <cstdint>
+#include <cstdio>
+
+#include "datablock.h"
 
 // one carrier/modulator pair in a patch, out of a possible two
 struct PatchVoice
@@ -19,13 +26,21 @@ struct PatchVoice
 	
 	int8_t tune = 0; // MIDI note offset
 	double finetune = 1.0; // frequency multiplier
+	
+	// values to write to regs 0x20, 0x23, 0x60, 0x63, 0xE0, 0xE3 (plus the voice's operator offset)
+	// when assigning this patch to a voice, for each chip type (see OPLPlayer::ChipType)
+	uint8_t regs[3][6] = {{0}};
+	
+	// fill in 'regs' from the values above
+	void bake();
 };
 
 typedef std::unordered_map<uint16_t, struct OPLPatch> OPLPatchSet;
 
 struct OPLPatch
 {
-	std::string name;
+	// (stored in the patch itself, so that compiled banks can be used in place; see PatchBank::save)
+	char name[32] = {0};
 	bool fourOp = false; // true 4op
 	bool dualTwoOp = false; // only valid if fourOp = false
 	uint8_t fixedNote = 0;
@@ -33,19 +48,96 @@ struct OPLPatch
 	
 	PatchVoice voice[2];
 	
+	// set the name, keeping up to 'maxLength' chars of it
+	void setName(const char *newName, size_t maxLength = sizeof(name) - 1);
+	
+	// update register values for both voices (after loading)
+	void bake()
+	{
+		voice[0].bake();
+		voice[1].bake();
+	}
+	
 	// default names
 	static const char* names[256];
+};
+	
+// a set of instrument patches.
+// once loaded, a bank is meant to be shared (as a shared_ptr<const PatchBank>)
+// between any number of players, and isn't modified again
+class PatchBank
+{
+public:
+	PatchBank() {}
+	PatchBank(const PatchBank& other);
+	
+	// load patches from the specified path/file/block of memory,
+	// adding to (or replacing) any that are already in this bank.
+	// if a compiled bank (see save) is loaded into an empty bank, it's memory-mapped and its patches are used in place
+	bool load(const char *path);
+	// if 'size' is 0, the full file will be read (starting from 'offset')
+	bool load(FILE *file, int offset = 0, size_t size = 0);
+	bool load(const uint8_t *data, size_t size);
 	
-	static bool load(OPLPatchSet& patches, const char *path);
-	static bool load(OPLPatchSet& patches, FILE *file, int offset = 0, size_t size = 0);
-	static bool load(OPLPatchSet& patches, const uint8_t *data, size_t size);
+	// save all patches in a compiled form, which can be loaded again without any parsing
+	// (only meant to be used with the same version of the library, on the same platform)
+	bool save(const char *path) const;
+	bool save(FILE *file) const;
+	bool save(std::vector<uint8_t>& data) const;
+	// hash of the bank's compiled form (as saved above), for telling banks apart (e.g. in a render cache).
+	// it's only worked out the first time it's needed, and again after any more patches are loaded
+	uint64_t hash() const;
+	
+	// find the patch with a given key, or null if there isn't one
+	// (key is (bank << 8) | program number, or (drum kit << 8) | 0x80 | note number for percussion)
+	const OPLPatch* find(uint16_t key) const;
+	// same as above, but if there's no patch with the given key, use the same program in bank 0,
+	// then program 0 (or drum note 0) in bank 0 instead
+	const OPLPatch* resolve(uint16_t key) const;
+	
+	// number of patches in the bank
+	size_t size() const { return isCompiled() ? m_numCompiled : m_patches.size(); }
+	bool isCompiled() const { return m_compiled != nullptr; }
 
 private:
+	PatchBank& operator=(const PatchBank&) = delete;
+	
 	// individual format loaders
-	static bool loadWOPL(OPLPatchSet& patches, const uint8_t *data, size_t size);
-	static bool loadOP2(OPLPatchSet& patches, const uint8_t *data, size_t size);
-	static bool loadAIL(OPLPatchSet& patches, const uint8_t *data, size_t size);
-	static bool loadTMB(OPLPatchSet& patches, const uint8_t *data, size_t size);
+	bool loadWOPL(const uint8_t *data, size_t size);
+	bool loadOP2(const uint8_t *data, size_t size);
+	bool loadAIL(const uint8_t *data, size_t size);
+	bool loadTMB(const uint8_t *data, size_t size);
+	
+	// set up lookup tables for the compiled bank in m_block
+	bool loadCompiled();
+	static bool isCompiled(const uint8_t *data, size_t size);
+	// add all of another bank's patches to this one's regular patch set
+	void merge(const PatchBank& other);
+	// if this is a compiled bank, convert it to a regular one so that more patches can be added
+	void expand();
+	
+	// call a function for each (key, patch) pair in the bank, in no particular order
+	template<typename Func> void each(Func func) const
+	{
+		if (isCompiled())
+			for (unsigned i = 0; i < m_numCompiled; i++) func(m_keys[2*i] | (m_keys[2*i + 1] << 8), m_compiled[i]);
+		else
+			for (auto& patch : m_patches) func(patch.first, patch.second);
+	}
+	
+	OPLPatchSet m_patches;
+	
+	// compiled bank data, if any (patches are used directly from the block)
+	DataBlock m_block;
+	const uint8_t *m_banks = nullptr;  // table number for each bank (upper byte of patch key)
+	const uint8_t *m_tables = nullptr; // patch index for each program/note (lower byte of key)
+	const uint8_t *m_keys = nullptr;   // key of each patch
+	const OPLPatch *m_compiled = nullptr;
+	unsigned m_numCompiled = 0;
+	
+	// saved hash (see hash), or 0 if it hasn't been worked out yet.
+	// banks are usually shared between threads, any of which may be the first to need it
+	mutable std::atomic<uint64_t> m_hash {0};
 };
 
 #endif // __PATCHES_H
@@ -1,5 +1,9 @@
 #include "player.h"
+#include "fixed.h"
+#include "render.h"
 #include "sequence.h"
+#include "tap.h"
+#include "trace.h"
 
 #include <cmath>
 #include <cstring>
@@ -14,11 +18,20 @@ static const unsigned oper_num[18] = {
 	0x100, 0x101, 0x102, 0x108, 0x109, 0x10A, 0x110, 0x111, 0x112
 };
 
+const uint64_t OPLVoice::never;
+
 // ----------------------------------------------------------------------------
 OPLPlayer::OPLPlayer(int numChips, ChipType type)
 	: ymfm::ymfm_interface()
 {
 	m_chipType = type;
+	switch (type)
+	{
+	case ChipOPL:  initChipType<ChipOPL>();  break;
+	case ChipOPL2: initChipType<ChipOPL2>(); break;
+	default:       initChipType<ChipOPL3>(); break;
+	}
+	
 	if (type == ChipOPL3)
 	{
 		m_numChips = numChips;
@@ -32,17 +45,34 @@ OPLPlayer::OPLPlayer(int numChips, ChipType type)
 		m_voices.resize(numChips * 9);
 		m_stereo = false;
 	}
+	m_monoOutput = false;
+#ifdef YMFMIDI_FIXED_POINT
+	m_fixedPoint = true;
+#else
+	m_fixedPoint = false;
+#endif
 	
 	m_opl3.resize(m_numChips);
 	for (auto& opl : m_opl3)
 		opl = new ymfm::ymf262(*this);
-	m_sampleFIFO.resize(m_numChips);
+	m_chipTime.resize(m_numChips);
+	m_voiceTime.resize(m_numChips);
+	m_fourOpMask.resize(m_numChips);
+	m_chipActive.resize(m_numChips);
+	m_chipIdle.resize(m_numChips);
+	m_minChips = m_numChips;
+	m_chipIdleLimit = 0;
 	
 	m_sequence = nullptr;
+	m_regLog = nullptr;
+	m_sampleSource = nullptr;
+	m_trace = nullptr;
+	m_outputTime = 0;
 	
-	m_samplePos = 0.0;
+	resetOutput();
 	m_samplesLeft = 0;
 	m_hpFilterFreq = 5.0; // 5Hz default to reduce DC offset
+	m_sampleGain = 1.0;
 	setSampleRate(44100); // setup both sample step and filter coefficients
 	setGain(1.0);
 	
@@ -51,9 +81,20 @@ OPLPlayer::OPLPlayer(int numChips, ChipType type)
 	reset();
 }
 
+// ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
+void OPLPlayer::initChipType()
+{
+	m_noteOn          = &OPLPlayer::noteOn<type>;
+	m_updateVolume    = &OPLPlayer::updateVolume<type>;
+	m_updateFrequency = &OPLPlayer::updateFrequency<type>;
+	m_keyOff          = &OPLPlayer::keyOff<type>;
+}
+
 // ----------------------------------------------------------------------------
 OPLPlayer::~OPLPlayer()
 {
+	clearTaps();
 	for (auto& opl : m_opl3)
 		delete opl;
 	delete m_sequence;
@@ -64,16 +105,76 @@ void OPLPlayer::setSampleRate(uint32_t rate)
 {
 	uint32_t rateOPL = m_opl3[0]->sample_rate(masterClock);
 	m_sampleStep = (double)rate / rateOPL;
+	m_phaseStep = OPLFixed::step(rate, rateOPL);
 	m_sampleRate = rate;
 	
+	// (fixed-point gain also includes the sample rate ratio)
+	m_sampleGainFixed = OPLFixed::gain(m_sampleGain, m_phaseStep);
 	setFilter(m_hpFilterFreq);
 //	printf("OPL sample rate = %u / output sample rate = %u / step %02f\n", rateOPL, rate, m_sampleStep);
 }
 
+// ----------------------------------------------------------------------------
+uint32_t OPLPlayer::chipSampleRate() const
+{
+	return m_opl3[0]->sample_rate(masterClock);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::setElastic(unsigned minChips, double idleTime)
+{
+	if (!minChips)
+	{
+		m_minChips = m_numChips;
+		m_chipIdleLimit = 0;
+		return;
+	}
+	
+	// (OPL/OPL2 chips are simulated two at a time)
+	if (m_chipType != ChipOPL3)
+		minChips = (minChips + 1) / 2;
+	
+	m_minChips = std::max(1u, std::min(minChips, m_numChips));
+	m_chipIdleLimit = std::max(1.0, idleTime * m_opl3[0]->sample_rate(masterClock));
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::activeChips() const
+{
+	unsigned count = 0;
+	for (bool active : m_chipActive)
+		count += active;
+	
+	return count;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::activeVoices() const
+{
+	unsigned count = 0;
+	for (auto& voice : m_voices)
+		count += voice.on;
+	
+	return count;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::soundingVoices() const
+{
+	unsigned count = 0;
+	for (auto& voice : m_voices)
+		count += !voiceSilent(voice);
+	
+	return count;
+}
+
 // ----------------------------------------------------------------------------
 void OPLPlayer::setGain(double gain)
 {
 	m_sampleGain = gain;
+	m_sampleGainFixed = OPLFixed::gain(gain, m_phaseStep);
+	for (auto tap : m_taps)
+		tap->setGain(gain);
 }
 
 // ----------------------------------------------------------------------------
@@ -91,18 +192,103 @@ void OPLPlayer::setFilter(double cutoff)
 		m_hpFilterCoef = 1.0 / ((2 * pi * cutoff) / m_sampleRate + 1);
 	}
 //	printf("sample rate = %u / cutoff %f Hz / filter coef %f\n", m_sampleRate, cutoff, m_hpFilterCoef);
+	m_hpFilterCoefFixed = OPLFixed::filterCoef(cutoff, m_sampleRate);
+	
+	for (auto tap : m_taps)
+		tap->setFilter(cutoff);
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::addTap(uint32_t sampleRate)
+{
+	auto tap = new OPLOutputTap(chipSampleRate(), sampleRate);
+	tap->setGain(m_sampleGain);
+	tap->setFilter(m_hpFilterFreq);
+	tap->setMono(m_monoOutput);
+	tap->setFixedPoint(m_fixedPoint);
+	m_taps.push_back(tap);
+	
+	return m_taps.size() - 1;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::clearTaps()
+{
+	for (auto tap : m_taps)
+		delete tap;
+	m_taps.clear();
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::readTap(unsigned tap, int16_t *data, unsigned maxSamples)
+{
+	if (tap >= m_taps.size())
+		return 0;
+	return m_taps[tap]->read(data, maxSamples);
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::tapAvailable(unsigned tap) const
+{
+	if (tap >= m_taps.size())
+		return 0;
+	return m_taps[tap]->available();
+}
+
+// ----------------------------------------------------------------------------
+uint32_t OPLPlayer::tapSampleRate(unsigned tap) const
+{
+	if (tap >= m_taps.size())
+		return 0;
+	return m_taps[tap]->sampleRate();
 }
 
 // ----------------------------------------------------------------------------
 void OPLPlayer::setStereo(bool on)
 {
-	if (m_chipType == ChipOPL3)
+	// (panning doesn't need to be rewritten if nothing changed)
+	if (m_chipType == ChipOPL3 && on != m_stereo)
 	{
 		m_stereo = on;
 		updateChannelVoices(-1, &OPLPlayer::updatePanning);
 	}
 }
 
+// ----------------------------------------------------------------------------
+void OPLPlayer::setMonoOutput(bool on)
+{
+	if (on == m_monoOutput)
+		return;
+	
+	m_monoOutput = on;
+	for (auto tap : m_taps)
+		tap->setMono(on);
+	
+	// going back to stereo, start the right channel where the left one is
+	m_lastOut[1] = m_lastOut[0];
+	m_hpLastIn[1] = m_hpLastIn[0];
+	m_hpLastOut[1] = m_hpLastOut[0];
+	m_hpLastInF[1] = m_hpLastInF[0];
+	m_hpLastOutF[1] = m_hpLastOutF[0];
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::setFixedPoint(bool on)
+{
+	if (on == m_fixedPoint)
+		return;
+	
+	// carry on from the same output position
+	if (on)
+		m_phase = (uint64_t)(m_samplePos * OPLFixed::one);
+	else
+		m_samplePos = (double)m_phase / OPLFixed::one;
+	
+	m_fixedPoint = on;
+	for (auto tap : m_taps)
+		tap->setFixedPoint(on);
+}
+
 // ----------------------------------------------------------------------------
 bool OPLPlayer::loadSequence(const char* path)
 {
@@ -122,53 +308,128 @@ bool OPLPlayer::loadSequence(FILE *file, int offset, size_t size)
 }
 
 // ----------------------------------------------------------------------------
-bool OPLPlayer::loadSequence(const uint8_t *data, size_t size)
+bool OPLPlayer::loadSequence(const uint8_t *data, size_t size, bool borrow)
 {
 	delete m_sequence;
-	m_sequence = Sequence::load(data, size);
+	m_sequence = Sequence::load(data, size, borrow);
 	
 	return m_sequence != nullptr;
 }
 
+// ----------------------------------------------------------------------------
+bool OPLPlayer::loadSequence(std::shared_ptr<const SequenceData> data)
+{
+	delete m_sequence;
+	m_sequence = Sequence::load(data);
+	
+	return m_sequence != nullptr;
+}
+
+// ----------------------------------------------------------------------------
+std::shared_ptr<const SequenceData> OPLPlayer::sequenceData() const
+{
+	if (m_sequence)
+		return m_sequence->data();
+	return nullptr;
+}
+
 // ----------------------------------------------------------------------------
 bool OPLPlayer::loadPatches(const char* path)
 {
-	return OPLPatch::load(m_patches, path);
+	return addPatches([=](PatchBank& bank) { return bank.load(path); });
 }
 
 // ----------------------------------------------------------------------------
 bool OPLPlayer::loadPatches(FILE *file, int offset, size_t size)
 {
-	return OPLPatch::load(m_patches, file, offset, size);
+	return addPatches([=](PatchBank& bank) { return bank.load(file, offset, size); });
 }
 
 // ----------------------------------------------------------------------------
 bool OPLPlayer::loadPatches(const uint8_t *data, size_t size)
 {
-	return OPLPatch::load(m_patches, data, size);
+	return addPatches([=](PatchBank& bank) { return bank.load(data, size); });
+}
+
+// ----------------------------------------------------------------------------
+bool OPLPlayer::addPatches(std::function<bool(PatchBank&)> load)
+{
+	// the current bank may be shared with other players, so don't modify it
+	auto bank = m_patches ? std::make_shared<PatchBank>(*m_patches) : std::make_shared<PatchBank>();
+	
+	bool ok = load(*bank);
+	m_patches = bank;
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::setPatches(std::shared_ptr<const PatchBank> patches)
+{
+	m_patches = patches;
+}
+
+// ----------------------------------------------------------------------------
+const char* OPLPlayer::patchName(uint8_t num) const
+{
+	const OPLPatch *patch = m_patches ? m_patches->find(num) : nullptr;
+	return patch ? patch->name : "";
 }
 
 // ----------------------------------------------------------------------------
 void OPLPlayer::generate(float *data, unsigned numSamples)
+{
+	if (m_fixedPoint)
+	{
+		if (m_monoOutput)
+			renderFixed<1>(data, numSamples);
+		else
+			renderFixed<2>(data, numSamples);
+	}
+	else if (m_monoOutput)
+		render<1>(data, numSamples);
+	else
+		render<2>(data, numSamples);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::generate(int16_t *data, unsigned numSamples)
+{
+	if (m_fixedPoint)
+	{
+		if (m_monoOutput)
+			renderFixed<1>(data, numSamples);
+		else
+			renderFixed<2>(data, numSamples);
+	}
+	else if (m_monoOutput)
+		render<1>(data, numSamples);
+	else
+		render<2>(data, numSamples);
+}
+
+// ----------------------------------------------------------------------------
+template<unsigned numChannels>
+void OPLPlayer::render(float *data, unsigned numSamples)
 {
 	unsigned samp = 0;
 
-	while (samp < numSamples * 2)
+	while (samp < numSamples * numChannels)
 	{
-		updateMIDI();
+		updateMIDI<numChannels>();
 		
-		float samples[2];
-		samples[0] = m_output.data[0] / 32767.0;
-		samples[1] = m_output.data[1] / 32767.0;
+		float samples[numChannels];
+		for (unsigned i = 0; i < numChannels; i++)
+			samples[i] = m_output.data[i] / 32767.0;
 
-		while (m_samplePos >= 1.0 && samp < numSamples * 2)
+		while (m_samplePos >= 1.0 && samp < numSamples * numChannels)
 		{
-			data[samp]   = samples[0];
-			data[samp+1] = samples[1];
+			for (unsigned i = 0; i < numChannels; i++)
+				data[samp+i] = samples[i];
 			
 			if (m_hpFilterCoef < 1.0)
 			{
-				for (int i = 0; i < 2; i++)
+				for (unsigned i = 0; i < numChannels; i++)
 				{
 					const float lastIn = m_hpLastInF[i];
 					m_hpLastInF[i] = data[samp+i];
@@ -178,8 +439,9 @@ void OPLPlayer::generate(float *data, unsigned numSamples)
 				}
 			}
 			
-			samp += 2;
+			samp += numChannels;
 			m_samplePos -= 1.0;
+			m_outputTime++;
 			if (m_samplesLeft)
 				m_samplesLeft--;
 		}
@@ -187,19 +449,20 @@ void OPLPlayer::generate(float *data, unsigned numSamples)
 }
 
 // ----------------------------------------------------------------------------
-void OPLPlayer::generate(int16_t *data, unsigned numSamples)
+template<unsigned numChannels>
+void OPLPlayer::render(int16_t *data, unsigned numSamples)
 {
 	unsigned samp = 0;
 
-	while (samp < numSamples * 2)
+	while (samp < numSamples * numChannels)
 	{
-		updateMIDI();
+		updateMIDI<numChannels>();
 		
-		while (m_samplePos >= 1.0 && samp < numSamples * 2)
+		while (m_samplePos >= 1.0 && samp < numSamples * numChannels)
 		{
 			if (m_hpFilterCoef < 1.0)
 			{
-				for (int i = 0; i < 2; i++)
+				for (unsigned i = 0; i < numChannels; i++)
 				{
 					const int32_t lastIn = m_hpLastIn[i];
 					m_hpLastIn[i] = m_output.data[i];
@@ -209,11 +472,12 @@ void OPLPlayer::generate(int16_t *data, unsigned numSamples)
 				}
 			}
 
-			data[samp]   = ymfm::clamp(m_output.data[0], -32768, 32767);
-			data[samp+1] = ymfm::clamp(m_output.data[1], -32768, 32767);
+			for (unsigned i = 0; i < numChannels; i++)
+				data[samp+i] = ymfm::clamp(m_output.data[i], -32768, 32767);
 			
-			samp += 2;
+			samp += numChannels;
 			m_samplePos -= 1.0;
+			m_outputTime++;
 			if (m_samplesLeft)
 				m_samplesLeft--;
 		}
@@ -221,60 +485,161 @@ void OPLPlayer::generate(int16_t *data, unsigned numSamples)
 }
 
 // ----------------------------------------------------------------------------
-void OPLPlayer::updateMIDI()
+static inline void outputSample(float& out, int32_t sample)
+{
+	out = sample / 32767.0;
+}
+
+// ----------------------------------------------------------------------------
+static inline void outputSample(int16_t& out, int32_t sample)
+{
+	out = ymfm::clamp(sample, -32768, 32767);
+}
+
+// ----------------------------------------------------------------------------
+template<unsigned numChannels, typename T>
+void OPLPlayer::renderFixed(T *data, unsigned numSamples)
+{
+	unsigned samp = 0;
+	
+	while (samp < numSamples * numChannels)
+	{
+		updateMIDIFixed<numChannels>();
+		
+		while (m_phase >= OPLFixed::one && samp < numSamples * numChannels)
+		{
+			if (m_hpFilterCoefFixed < OPLFixed::filterOne)
+			{
+				for (unsigned i = 0; i < numChannels; i++)
+				{
+					m_output.data[i] = OPLFixed::filter(m_output.data[i], m_hpLastIn[i], m_hpLastOut[i],
+					                                    m_hpFilterCoefFixed);
+				}
+			}
+			
+			for (unsigned i = 0; i < numChannels; i++)
+				outputSample(data[samp+i], m_output.data[i]);
+			
+			samp += numChannels;
+			m_phase -= OPLFixed::one;
+			m_outputTime++;
+			if (m_samplesLeft)
+				m_samplesLeft--;
+		}
+	}
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::generateBlock(float *data, unsigned maxSamples)
 {
-	while (!m_samplesLeft && m_sequence && !atEnd())
+	const unsigned numSamples = nextBlock(maxSamples);
+	generate(data, numSamples);
+	return numSamples;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::generateBlock(int16_t *data, unsigned maxSamples)
+{
+	const unsigned numSamples = nextBlock(maxSamples);
+	generate(data, numSamples);
+	return numSamples;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t OPLPlayer::generateBlocks(float *data, unsigned maxSamples, BlockFuncFloat output)
+{
+	uint64_t samplesDone = 0;
+	while (!atEnd())
+	{
+		const unsigned count = generateBlock(data, maxSamples);
+		samplesDone += count;
+		
+		if (!output(data, count))
+			break;
+	}
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t OPLPlayer::generateBlocks(int16_t *data, unsigned maxSamples, BlockFunc output)
+{
+	uint64_t samplesDone = 0;
+	while (!atEnd())
+	{
+		const unsigned count = generateBlock(data, maxSamples);
+		samplesDone += count;
+		
+		if (!output(data, count))
+			break;
+	}
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLPlayer::nextBlock(unsigned maxSamples)
+{
+	const bool ended = atEnd();
+	updateEvents();
+	
+	if (!ended && atEnd())
+		return std::min(1u, maxSamples);
+	if (m_samplesLeft)
+		return std::min(m_samplesLeft, maxSamples);
+	return maxSamples;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::updateEvents()
+{
+	while (!m_samplesLeft && m_sequence && !atEnd() && !m_sampleSource)
 	{	
 		// time to update midi playback
 		m_samplesLeft = m_sequence->update(*this);
-		for (auto& voice : m_voices)
-		{
-			if (voice.duration < UINT_MAX)
-				voice.duration++;
-			voice.justChanged = false;
-		}
+		updateVoices();
 		
 		if (m_samplesLeft)
 			m_timePassed = true;
 	}
+	
+	// notes played outside of a song (e.g. in real time) also need to be updated
+	// before any more samples are generated, so that they can be released/stolen later
+	if (m_voicesChanged)
+		updateVoices();
+}
 
+// ----------------------------------------------------------------------------
+template<unsigned numChannels>
+void OPLPlayer::updateMIDI()
+{
+	updateEvents();
+	
 	if (m_samplePos >= 1.0)
 	{
 		return; // existing output still waiting to be consumed
 	}
 	
-	m_output.data[0] = m_lastOut[0];
-	m_output.data[1] = m_lastOut[1];
+	for (unsigned i = 0; i < numChannels; i++)
+		m_output.data[i] = m_lastOut[i];
 	
 	while (m_samplePos < 1.0)
 	{
-		ymfm::ymf262::output_data output;
-		int32_t samples[2] = {0};
-		
-		for (unsigned i = 0; i < m_numChips; i++)
-		{
-			if (m_sampleFIFO[i].empty())
-			{
-				m_opl3[i]->generate(&output);
-			}
-			else
-			{
-				output = m_sampleFIFO[i].front();
-				m_sampleFIFO[i].pop();
-			}
-			
-			samples[0] += output.data[0];
-			samples[1] += output.data[1];
-		}
+		int32_t samples[2];
+		runChips<numChannels>(samples);
+		for (auto tap : m_taps)
+			tap->input(samples);
 		
 		m_samplePos += m_sampleStep;
 		
 		if (m_samplePos <= 1.0 || m_sampleStep > 1.0)
 		{
 			// full input sample (if downsampling), or always (if upsampling)
-			m_output.data[0] += samples[0];
-			m_output.data[1] += samples[1];
-			m_lastOut[0] = m_lastOut[1] = 0;
+			for (unsigned i = 0; i < numChannels; i++)
+			{
+				m_output.data[i] += samples[i];
+				m_lastOut[i] = 0;
+			}
 		}
 		else
 		{
@@ -282,17 +647,135 @@ void OPLPlayer::updateMIDI()
 			// apply a fraction of the sample value now and save the rest for later
 			// based on how far past the output sample point we are
 			const double remainder = (m_samplePos - (int)m_samplePos) / m_sampleStep;
-			m_output.data[0] += samples[0] * (1 - remainder);
-			m_output.data[1] += samples[1] * (1 - remainder);
-			m_lastOut[0] = samples[0] * remainder;
-			m_lastOut[1] = samples[1] * remainder;
+			for (unsigned i = 0; i < numChannels; i++)
+			{
+				m_output.data[i] += samples[i] * (1 - remainder);
+				m_lastOut[i] = samples[i] * remainder;
+			}
 		}
 	}
 	
 	// apply gain and use sample rate in/out ratio to scale all accumulated samples
 	const double step = std::min(m_sampleStep, 1.0);
-	m_output.data[0] *= m_sampleGain * step;
-	m_output.data[1] *= m_sampleGain * step;
+	for (unsigned i = 0; i < numChannels; i++)
+		m_output.data[i] *= m_sampleGain * step;
+}
+
+// ----------------------------------------------------------------------------
+template<unsigned numChannels>
+void OPLPlayer::updateMIDIFixed()
+{
+	// same as updateMIDI, but in fixed-point
+	updateEvents();
+	
+	if (m_phase >= OPLFixed::one)
+		return;
+	
+	for (unsigned i = 0; i < numChannels; i++)
+		m_output.data[i] = m_lastOut[i];
+	
+	while (m_phase < OPLFixed::one)
+	{
+		int32_t samples[2];
+		runChips<numChannels>(samples);
+		for (auto tap : m_taps)
+			tap->input(samples);
+		
+		m_phase += m_phaseStep;
+		
+		if (m_phase <= OPLFixed::one || m_phaseStep > OPLFixed::one)
+		{
+			for (unsigned i = 0; i < numChannels; i++)
+			{
+				m_output.data[i] += samples[i];
+				m_lastOut[i] = 0;
+			}
+		}
+		else
+		{
+			for (unsigned i = 0; i < numChannels; i++)
+			{
+				m_lastOut[i] = OPLFixed::remainder(samples[i], m_phase, m_phaseStep);
+				m_output.data[i] += samples[i] - m_lastOut[i];
+			}
+		}
+	}
+	
+	for (unsigned i = 0; i < numChannels; i++)
+		m_output.data[i] = OPLFixed::scale(m_output.data[i], m_sampleGainFixed);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::updateVoices()
+{
+	for (auto& voice : m_voices)
+		voice.justChanged = false;
+	
+	m_voicesChanged = false;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::resetOutput()
+{
+	m_samplePos = 0.0;
+	m_phase = 0;
+	m_output.clear();
+	m_lastOut[0] = m_lastOut[1] = 0;
+	m_hpLastIn[0] = m_hpLastIn[1] = 0;
+	m_hpLastOut[0] = m_hpLastOut[1] = 0;
+	m_hpLastInF[0] = m_hpLastInF[1] = 0;
+	m_hpLastOutF[0] = m_hpLastOutF[1] = 0;
+	for (auto tap : m_taps)
+		tap->reset();
+	
+	for (unsigned i = 0; i < m_numChips; i++)
+	{
+		m_chipTime[i] = 0;
+		m_voiceTime[i] = 0;
+	}
+	
+	// chip time is starting over, so anything that was waiting on it happens right away
+	// (but a waiting note is still started before it's released)
+	for (auto& voice : m_voices)
+	{
+		if (voice.killTime != OPLVoice::never)
+			voice.killTime = 0;
+		if (voice.releaseTime != OPLVoice::never)
+			voice.releaseTime = (voice.startTime != OPLVoice::never) ? 1 : 0;
+		if (voice.startTime != OPLVoice::never)
+			voice.startTime = 0;
+		if (voice.silentTime != OPLVoice::never)
+			voice.silentTime = 0;
+		voice.noteTime = 0;
+	}
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::saveOutput(std::vector<uint8_t>& data)
+{
+	ymfm::ymfm_saved_state state(data, true);
+	
+	for (unsigned i = 0; i < m_numChips; i++)
+		m_opl3[i]->save_restore(state);
+	
+	state.save_restore(m_output.data);
+	state.save_restore(m_lastOut);
+	state.save_restore(m_hpLastIn);
+	state.save_restore(m_hpLastOut);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::restoreOutput(std::vector<uint8_t>& data)
+{
+	ymfm::ymfm_saved_state state(data, false);
+	
+	for (unsigned i = 0; i < m_numChips; i++)
+		m_opl3[i]->save_restore(state);
+	
+	state.save_restore(m_output.data);
+	state.save_restore(m_lastOut);
+	state.save_restore(m_hpLastIn);
+	state.save_restore(m_hpLastOut);
 }
 
 // ----------------------------------------------------------------------------
@@ -324,7 +807,7 @@ void OPLPlayer::displayChannels()
 		const OPLPatch *patch = findPatch(i, 0);
 	
 		printf("%3u | %-32.32s | %3u | %3u | ", i + 1, 
-			channel.percussion ? "Percussion" : (patch ? patch->name.c_str() : ""),
+			channel.percussion ? "Percussion" : (patch ? patch->name : ""),
 			channel.volume, channel.pan);
 		
 		if (m_voices.size() < 100)
@@ -357,7 +840,7 @@ void OPLPlayer::displayVoices()
 				printf("channel %2u, note %3u %c %-32.32s",
 					m_voices[i].channel->num + 1, m_voices[i].note,
 					m_voices[i].on ? '*' : ' ',
-					m_voices[i].patch ? m_voices[i].patch->name.c_str() : "");
+					m_voices[i].patch ? m_voices[i].patch->name : "");
 			}
 			else
 			{
@@ -459,11 +942,21 @@ unsigned OPLPlayer::songNum() const
 // ----------------------------------------------------------------------------
 void OPLPlayer::reset()
 {
+	if (m_trace)
+		m_trace->reset(m_outputTime);
+	
 	for (int i = 0; i < m_opl3.size(); i++)
 	{
 		m_opl3[i]->reset();
 		// enable OPL3 stuff
 		write(i, REG_NEW, 1);
+		m_fourOpMask[i] = 0;
+		
+		// (chips always start out being clocked, as far as anything using a register log is concerned)
+		m_chipActive[i] = true;
+		setChipActive(i, i < m_minChips);
+		m_chipIdle[i] = 0;
+		m_voiceTime[i] = OPLVoice::never;
 	}
 		
 	// reset MIDI channel and OPL voice status
@@ -489,6 +982,8 @@ void OPLPlayer::reset()
 		case 0: case 1: case 2:
 			m_voices[i].fourOpPrimary = true;
 			m_voices[i].fourOpOther = &m_voices[i+3];
+			// bits 0-2 for the first 3 primary voices, bits 3-5 for the 3 in the second register set
+			m_voices[i].fourOpBit = 1 << ((i % 9) + ((i % 18) >= 9 ? 3 : 0));
 			break;
 		case 3: case 4: case 5:
 			m_voices[i].fourOpPrimary = false;
@@ -505,19 +1000,125 @@ void OPLPlayer::reset()
 		m_sequence->reset();
 	m_samplesLeft = 0;
 	m_timePassed = 0;
+	m_voicesChanged = false;
 }
 
 // ----------------------------------------------------------------------------
-void OPLPlayer::runSamples(int chip, unsigned count)
+template<unsigned numChannels>
+void OPLPlayer::runChips(int32_t samples[2])
 {
-	// add some delay between register writes where needed
-	// (i.e. when forcing a voice off, changing 4op flags, etc.)
-	while (count--)
+	// with mono output, the right channel is only needed to mix it with the left one
+	// (if stereo is disabled, both are always the same)
+	const bool mix = (numChannels == 1 && m_stereo);
+	
+	if (m_sampleSource)
+	{
+		m_sampleSource->read(samples);
+		if (mix)
+			samples[0] = (samples[0] + samples[1]) / 2;
+		return;
+	}
+	
+	samples[0] = samples[1] = 0;
+	
+	for (unsigned i = 0; i < m_numChips; i++)
 	{
 		ymfm::ymf262::output_data output;
-		m_opl3[chip]->generate(&output);
-		m_sampleFIFO[chip].push(output);
+		
+		if (m_chipTime[i] >= m_voiceTime[i])
+			updateWaitingVoices(i);
+		
+		m_chipTime[i]++;
+		if (!m_chipActive[i])
+			continue; // parked (see setElastic)
+		if (i >= m_minChips && ++m_chipIdle[i] >= m_chipIdleLimit)
+			parkChip(i);
+		if (m_regLog)
+			continue; // only keeping track of time
+		m_opl3[i]->generate(&output);
+		
+		samples[0] += output.data[0];
+		if (numChannels == 2 || mix)
+			samples[1] += output.data[1];
 	}
+	
+	if (mix)
+		samples[0] = (samples[0] + samples[1]) / 2;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::updateWaitingVoices(unsigned chip)
+{
+	const uint64_t time = m_chipTime[chip];
+	const unsigned first = chip * 18;
+	const unsigned count = std::min(18u, (unsigned)m_voices.size() - first);
+	bool started[18] = {false};
+	
+	// write the new patch for any voices that are done being silenced...
+	for (unsigned i = 0; i < count; i++)
+	{
+		OPLVoice& voice = m_voices[first + i];
+		
+		if (voice.startTime <= time)
+		{
+			voice.startTime = OPLVoice::never;
+			writePatch(voice);
+			updateVolume(voice);
+			updatePanning(voice);
+			started[i] = true;
+		}
+		else if (voice.releaseTime <= time)
+		{
+			voice.releaseTime = OPLVoice::never;
+			keyOff(voice);
+		}
+	}
+	
+	// ...then key them on, once both halves of any 4op voices are ready
+	uint64_t next = OPLVoice::never;
+	for (unsigned i = 0; i < count; i++)
+	{
+		OPLVoice& voice = m_voices[first + i];
+		
+		if (started[i])
+			updateFrequency(voice);
+		next = std::min(next, std::min(voice.startTime, voice.releaseTime));
+	}
+	
+	m_voiceTime[chip] = next;
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::scheduleVoice(const OPLVoice& voice, uint64_t time)
+{
+	m_voiceTime[voice.chip] = std::min(m_voiceTime[voice.chip], time);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::parkChip(unsigned chip)
+{
+	m_chipIdle[chip] = 0;
+	
+	// still holding or releasing a note, so check again later
+	for (auto& voice : m_voices)
+	{
+		if (voice.chip == chip && !voiceSilent(voice))
+			return;
+	}
+	
+	setChipActive(chip, false);
+}
+
+// ----------------------------------------------------------------------------
+void OPLPlayer::setChipActive(unsigned chip, bool active)
+{
+	if (m_regLog && active != m_chipActive[chip])
+	{
+		const uint16_t addr = active ? OPLRegWrite::ChipActive : OPLRegWrite::ChipParked;
+		m_regLog->push_back({m_chipTime[chip], (uint16_t)chip, addr, 0});
+	}
+	
+	m_chipActive[chip] = active;
 }
 
 // ----------------------------------------------------------------------------
@@ -525,6 +1126,12 @@ void OPLPlayer::write(int chip, uint16_t addr, uint8_t data)
 {
 //	if (addr != 0x104)
 //		printf("write reg %03x val %02x\n", addr, data);
+	if (m_regLog)
+	{
+		m_regLog->push_back({m_chipTime[chip], (uint16_t)chip, addr, data});
+		return;
+	}
+	
 	if (addr < 0x100)
 		m_opl3[chip]->write_address((uint8_t)addr);
 	else
@@ -533,17 +1140,36 @@ void OPLPlayer::write(int chip, uint16_t addr, uint8_t data)
 }
 
 // ----------------------------------------------------------------------------
+void OPLPlayer::oplWrite(unsigned chip, uint16_t addr, uint8_t data)
+{
+	if (chip >= m_numChips)
+		return;
+	
+	// (there are no voices to check before parking the chip again, so just treat writes as activity)
+	setChipActive(chip, true);
+	m_chipIdle[chip] = 0;
+	write(chip, addr & 0x1ff, data);
+}
+
+// ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
 OPLVoice* OPLPlayer::findVoice(uint8_t channel, const OPLPatch *patch, uint8_t note)
 {
 	OPLVoice *found = nullptr;
-	uint32_t duration = 0;
+	uint64_t age = 0;
+	unsigned rank = 3;
 	
 	// try to find the "oldest" voice, prioritizing released notes
 	// (or voices that haven't ever been used yet)
 	for (auto& voice : m_voices)
 	{
-		if (useFourOp(patch) && !voice.fourOpPrimary)
+		if (!m_chipActive[voice.chip])
+			continue;
+		if (useFourOp<type>(patch) && !voice.fourOpPrimary)
 			continue;
+		// with extra chips online, prefer voices on the first ones so the others can go idle again
+		if (found && found->chip != voice.chip && m_minChips < m_numChips)
+			break;
 	
 		if (!voice.channel)
 			return &voice;
@@ -551,35 +1177,56 @@ OPLVoice* OPLPlayer::findVoice(uint8_t channel, const OPLPatch *patch, uint8_t n
 		if (!voice.on && !voice.justChanged)
 		{
 			if (voice.channel->num == channel && voice.note == note
-				&& voice.duration < UINT_MAX)
+				&& voice.killTime == OPLVoice::never && !voiceSilent(voice))
 			{
 				// found an old voice that was using the same note and patch
 				// don't immediately use it, but make it a high priority candidate for later
 				// (to help avoid pop/click artifacts when retriggering a recently off note)
 				silenceVoice(voice);
-				if (useFourOp(voice.patch) && voice.fourOpOther)
+				if (useFourOp<type>(voice.patch) && voice.fourOpOther)
 					silenceVoice(*voice.fourOpOther);
 			}
-			else if (voice.duration > duration)
+			else
 			{
-				found = &voice;
-				duration = voice.duration;
+				// prefer voices that have completely finished releasing, then ones that are still
+				// ringing out but can start a new note right away, then ones that have to be silenced first
+				const unsigned voiceRank = voiceSilent(voice) ? 0 : voiceReady(voice, patch) ? 1 : 2;
+				if (voiceRank < rank || (voiceRank == rank && voiceAge(voice) > age))
+				{
+					found = &voice;
+					age = voiceAge(voice);
+					rank = voiceRank;
+				}
 			}
 		}
 	}
 	
 	if (found) return found;
+	// all active voices are in use, so bring a parked chip back online if there is one
+	for (auto& voice : m_voices)
+	{
+		if (m_chipActive[voice.chip])
+			continue;
+		if (useFourOp<type>(patch) && !voice.fourOpPrimary)
+			continue;
+		
+		setChipActive(voice.chip, true);
+		return &voice;
+	}
+	
 	// if we didn't find one yet, just try to find an old one
 	// using the same patch, even if it should still be playing.
 	for (auto& voice : m_voices)
 	{
-		if (useFourOp(patch) && !voice.fourOpPrimary)
+		if (!m_chipActive[voice.chip])
+			continue;
+		if (useFourOp<type>(patch) && !voice.fourOpPrimary)
 			continue;
 		
-		if (voice.patch == patch && voice.duration > duration)
+		if (voice.patch == patch && voiceAge(voice) > age)
 		{
 			found = &voice;
-			duration = voice.duration;
+			age = voiceAge(voice);
 		}
 	}
 	
@@ -588,22 +1235,104 @@ OPLVoice* OPLPlayer::findVoice(uint8_t channel, const OPLPatch *patch, uint8_t n
 	
 	for (auto& voice : m_voices)
 	{
-		if (useFourOp(patch) && !voice.fourOpPrimary)
+		if (!m_chipActive[voice.chip])
+			continue;
+		if (useFourOp<type>(patch) && !voice.fourOpPrimary)
 			continue;
 		// don't let a 2op instrument steal an active voice from a 4op one
-		if (!useFourOp(patch) && voice.on && useFourOp(voice.patch))
+		if (!useFourOp<type>(patch) && voice.on && useFourOp<type>(voice.patch))
 			continue;
 		
-		if (voice.duration > duration)
+		if (voiceAge(voice) > age)
 		{
 			found = &voice;
-			duration = voice.duration;
+			age = voiceAge(voice);
 		}
 	}
 	
 	return found;
 }
 
+// ----------------------------------------------------------------------------
+bool OPLPlayer::voiceReady(const OPLVoice& voice, const OPLPatch *patch) const
+{
+	if (voice.startTime != OPLVoice::never)
+		return false;
+	return voice.patch == patch || voiceSilent(voice) || voice.killTime <= m_chipTime[voice.chip];
+}
+
+// ----------------------------------------------------------------------------
+bool OPLPlayer::voiceSilent(const OPLVoice& voice) const
+{
+	return !voice.on && voice.startTime == OPLVoice::never && voice.releaseTime == OPLVoice::never
+		&& voice.silentTime <= m_chipTime[voice.chip];
+}
+
+// ----------------------------------------------------------------------------
+uint64_t OPLPlayer::voiceAge(const OPLVoice& voice) const
+{
+	// voices that have been silenced since their last note (or never played one) count as the oldest
+	if (voice.killTime != OPLVoice::never || !voice.channel)
+		return UINT64_MAX;
+	return m_chipTime[voice.chip] - voice.noteTime;
+}
+
+// ----------------------------------------------------------------------------
+static uint32_t envelopeRelease(unsigned rate, bool keyScale, uint16_t freq)
+{
+	if (!rate)
+		return UINT32_MAX;
+	
+	// the actual rate (0-63) also depends on the block and the top bit of the F-number
+	const unsigned keyCode = (freq >> 9) & 0xf;
+	rate = std::min(63u, rate * 4 + (keyScale ? keyCode : (keyCode >> 2)));
+	
+	// attenuation increases by an average of (4 + rate % 4) / 8 every 2^(11 - rate / 4) samples,
+	// and the operator is inaudible once it reaches 0x380 (out of 0x3ff)
+	return (0x380u << 14) / ((4 + (rate & 3)) << (rate >> 2));
+}
+
+// ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
+uint32_t OPLPlayer::releaseSamples(const OPLVoice& voice) const
+{
+	if (!voice.patchVoice)
+		return 0;
+	
+	// both halves of a 4op voice use the frequency of the first one
+	const bool fourOp = useFourOp<type>(voice.patch) && voice.fourOpOther;
+	const uint16_t freq = (fourOp && !voice.fourOpPrimary) ? voice.fourOpOther->freq : voice.freq;
+	const OPLVoice *voices[2] = {&voice, fourOp ? voice.fourOpOther : nullptr};
+	
+	// only the carriers matter, since nothing can be heard once they're silent
+	uint32_t samples = 0;
+	for (const OPLVoice *v : voices)
+	{
+		if (!v || !v->patchVoice)
+			continue;
+		
+		const auto patchVoice = v->patchVoice;
+		const auto carriers = activeCarriers<type>(*v);
+		if (carriers.first)
+			samples = std::max(samples, envelopeRelease(patchVoice->op_sr[0] & 15, patchVoice->op_mode[0] & 0x10, freq));
+		if (carriers.second)
+			samples = std::max(samples, envelopeRelease(patchVoice->op_sr[1] & 15, patchVoice->op_mode[1] & 0x10, freq));
+	}
+	
+	return samples;
+}
+
+// ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
+void OPLPlayer::keyOff(OPLVoice& voice)
+{
+	// (also keep track of when the release will be finished)
+	const uint32_t samples = releaseSamples<type>(voice);
+	voice.silentTime = (samples == UINT32_MAX) ? OPLVoice::never : m_chipTime[voice.chip] + samples;
+	
+	write(voice.chip, REG_VOICE_FREQH + voice.num, voice.freq >> 8);
+}
+
 // ----------------------------------------------------------------------------
 OPLVoice* OPLPlayer::findVoice(uint8_t channel, uint8_t note, bool justChanged)
 {
@@ -633,28 +1362,15 @@ const OPLPatch* OPLPlayer::findPatch(uint8_t channel, uint8_t note) const
 	else
 		key = ch.patchNum | (ch.bank << 8);
 	
-	// if this patch+bank combo doesn't exist, default to bank 0
-	if (!m_patches.count(key))
-		key &= 0x00ff;
-	// if patch still doesn't exist in bank 0, use patch 0 (or drum note 0)
-	if (!m_patches.count(key))
-		key &= 0x0080;
-	// if that somehow still doesn't exist, forget it
-	if (!m_patches.count(key))
+	if (!m_patches)
 		return nullptr;
 	
-	return &m_patches.at(key);
-}
-
-// ----------------------------------------------------------------------------
-bool OPLPlayer::useFourOp(const OPLPatch *patch) const
-{
-	if (m_chipType == ChipOPL3)
-		return patch->fourOp;
-	return false;
+	// if this patch+bank combo doesn't exist, this falls back to bank 0 (then patch 0 or drum note 0)
+	return m_patches->resolve(key);
 }
 
 // ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
 std::pair<bool, bool> OPLPlayer::activeCarriers(const OPLVoice& voice) const
 {
 	bool scale[2] = {0};
@@ -664,7 +1380,7 @@ std::pair<bool, bool> OPLPlayer::activeCarriers(const OPLVoice& voice) const
 	{
 		scale[0] = scale[1] = false;
 	}
-	else if (!useFourOp(voice.patch))
+	else if (!useFourOp<type>(voice.patch))
 	{
 		// 2op FM (0): scale op 2 only
 		// 2op AM (1): scale op 1 and 2
@@ -705,6 +1421,7 @@ void OPLPlayer::updateChannelVoices(int8_t channel, void(OPLPlayer::*func)(OPLVo
 }
 
 // ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
 void OPLPlayer::updatePatch(OPLVoice& voice, const OPLPatch *newPatch, uint8_t numVoice)
 {	
 	// assign the MIDI channel's current patch (or the current drum patch) to this voice
@@ -713,70 +1430,84 @@ void OPLPlayer::updatePatch(OPLVoice& voice, const OPLPatch *newPatch, uint8_t n
 	
 	if (voice.patchVoice != &patchVoice)
 	{
-		bool oldFourOp = voice.patch ? useFourOp(voice.patch) : false;
+		bool oldFourOp = voice.patch ? useFourOp<type>(voice.patch) : false;
+		// (a voice that's finished releasing, or was silenced long enough ago, can switch patches right away)
+		const bool ready = voiceSilent(voice) || voice.killTime <= m_chipTime[voice.chip];
 	
 		voice.patch = newPatch;
 		voice.patchVoice = &patchVoice;
 		
 		// update enable status for 4op channels on this chip
-		if (useFourOp(newPatch) != oldFourOp)
+		if (useFourOp<type>(newPatch) != oldFourOp)
 		{
 			// if going from part of a 4op patch to a 2op one, kill the other one
 			OPLVoice *other = voice.fourOpOther;
 			if (other && other->patch
-				&& useFourOp(other->patch) && !useFourOp(newPatch))
+				&& useFourOp<type>(other->patch) && !useFourOp<type>(newPatch))
 			{
 				silenceVoice(*other);
 			}
 		
-			uint8_t enable = 0x00;
-			uint8_t bit = 0x01;
-			for (unsigned i = voice.chip * 18; i < voice.chip * 18 + 18; i++)
-			{
-				if (m_voices[i].fourOpPrimary)
-				{
-					if (m_voices[i].patch && useFourOp(m_voices[i].patch))
-						enable |= bit;
-					bit <<= 1;
-				}
-			}
+			if (useFourOp<type>(newPatch))
+				m_fourOpMask[voice.chip] |= voice.fourOpBit;
+			else
+				m_fourOpMask[voice.chip] &= ~voice.fourOpBit;
 			
-			write(voice.chip, REG_4OP, enable);
+			write(voice.chip, REG_4OP, m_fourOpMask[voice.chip]);
 		//	runSamples(voice.chip, 1);
 		}
 
-		// kill an existing voice, then send the chip far enough forward in time to let the envelope die off
+		// otherwise, kill the existing voice and wait for the envelope to die off before starting the new one
 		// (ROTT: fixes nasty reverse cymbal noises in spray.mid
 		//        without disrupting note timing too much for the staccato drums in fanfare2.mid)
-		silenceVoice(voice);
-		runSamples(voice.chip, 48);
-		
-		// 0x20: vibrato, sustain, multiplier
-		write(voice.chip, REG_OP_MODE + voice.op,     patchVoice.op_mode[0]);
-		write(voice.chip, REG_OP_MODE + voice.op + 3, patchVoice.op_mode[1]);
-		// 0x60: attack/decay
-		write(voice.chip, REG_OP_AD + voice.op,     patchVoice.op_ad[0]);
-		write(voice.chip, REG_OP_AD + voice.op + 3, patchVoice.op_ad[1]);
-		// 0xe0: waveform
-		if (m_chipType == ChipOPL2)
+		// the new note is started by updateWaitingVoices once the chip gets there during normal rendering,
+		// so other voices keep playing on time in the meantime
+		if (!ready)
 		{
-			write(voice.chip, REG_OP_WAVEFORM + voice.op,     patchVoice.op_wave[0] & 3);
-			write(voice.chip, REG_OP_WAVEFORM + voice.op + 3, patchVoice.op_wave[1] & 3);
+			if (voice.killTime == OPLVoice::never)
+				silenceVoice(voice);
+			voice.startTime = voice.killTime;
+			scheduleVoice(voice, voice.startTime);
 		}
-		else if (m_chipType == ChipOPL3)
+		else if (voice.startTime == OPLVoice::never)
 		{
-			write(voice.chip, REG_OP_WAVEFORM + voice.op,     patchVoice.op_wave[0]);
-			write(voice.chip, REG_OP_WAVEFORM + voice.op + 3, patchVoice.op_wave[1]);
+			writePatch(voice);
 		}
 	}
+	else if (voice.startTime == OPLVoice::never)
+	{
+		// 0x80: sustain/release
+		// update even for the same patch in case silenceVoice was called from somewhere else on this voice
+		write(voice.chip, REG_OP_SR + voice.op,     patchVoice.op_sr[0]);
+		write(voice.chip, REG_OP_SR + voice.op + 3, patchVoice.op_sr[1]);
+	}
+}
+		
+// ----------------------------------------------------------------------------
+void OPLPlayer::writePatch(OPLVoice& voice)
+{
+	const PatchVoice& patchVoice = *voice.patchVoice;
+	
+	// 0x20: vibrato, sustain, multiplier
+	// 0x60: attack/decay
+	// 0xe0: waveform (OPL2/OPL3 only)
+	static const uint16_t patchRegs[6] =
+	{
+		REG_OP_MODE,     REG_OP_MODE + 3,
+		REG_OP_AD,       REG_OP_AD + 3,
+		REG_OP_WAVEFORM, REG_OP_WAVEFORM + 3
+	};
+	const unsigned numRegs = (m_chipType == ChipOPL) ? 4 : 6;
+	for (unsigned i = 0; i < numRegs; i++)
+		write(voice.chip, patchRegs[i] + voice.op, patchVoice.regs[m_chipType][i]);
 
 	// 0x80: sustain/release
-	// update even for the same patch in case silenceVoice was called from somewhere else on this voice
 	write(voice.chip, REG_OP_SR + voice.op,     patchVoice.op_sr[0]);
 	write(voice.chip, REG_OP_SR + voice.op + 3, patchVoice.op_sr[1]);
 }
 
 // ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
 void OPLPlayer::updateVolume(OPLVoice& voice)
 {
 	// lookup table shamelessly stolen from Nuke.YKT
@@ -788,13 +1519,13 @@ void OPLPlayer::updateVolume(OPLVoice& voice)
 		 3,  3,  2,  2,  1,  1,  0,  0
 	};
 
-	if (!voice.patch || !voice.channel) return;
+	if (!voice.patch || !voice.channel || voice.startTime != OPLVoice::never) return;
 	
 	uint8_t atten = opl_volume_map[(voice.velocity * voice.channel->volume) >> 9];
 	uint8_t level;
 	
 	const auto patchVoice = voice.patchVoice;
-	const auto scale = activeCarriers(voice);
+	const auto scale = activeCarriers<type>(voice);
 	
 	// 0x40: key scale / volume
 	if (scale.first)
@@ -813,7 +1544,7 @@ void OPLPlayer::updateVolume(OPLVoice& voice)
 // ----------------------------------------------------------------------------
 void OPLPlayer::updatePanning(OPLVoice& voice)
 {
-	if (!voice.patch || !voice.channel) return;
+	if (!voice.patch || !voice.channel || voice.startTime != OPLVoice::never) return;
 	
 	// 0xc0: output/feedback/mode
 	uint8_t pan = 0x30;
@@ -829,6 +1560,7 @@ void OPLPlayer::updatePanning(OPLVoice& voice)
 }
 
 // ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
 void OPLPlayer::updateFrequency(OPLVoice& voice)
 {
 	static const uint16_t noteFreq[12] = {
@@ -836,8 +1568,8 @@ void OPLPlayer::updateFrequency(OPLVoice& voice)
 		345, 365, 387, 410, 435, 460, 488, 517, 547, 580, 615, 651
 	};
 
-	if (!voice.patch || !voice.channel) return;
-	if (useFourOp(voice.patch) && !voice.fourOpPrimary) return;
+	if (!voice.patch || !voice.channel || voice.startTime != OPLVoice::never) return;
+	if (useFourOp<type>(voice.patch) && !voice.fourOpPrimary) return;
 	
 	int note = (!voice.channel->percussion ? voice.note : voice.patch->fixedNote)
 	         + voice.patchVoice->tune;
@@ -865,7 +1597,9 @@ void OPLPlayer::updateFrequency(OPLVoice& voice)
 	voice.freq = freq | (octave << 10);
 	
 	write(voice.chip, REG_VOICE_FREQL + voice.num, voice.freq & 0xff);
-	write(voice.chip, REG_VOICE_FREQH + voice.num, (voice.freq >> 8) | (voice.on ? (1 << 5) : 0));
+	// (a note that was released before it started still plays for as long as it was held)
+	const bool keyOn = voice.on || voice.releaseTime != OPLVoice::never;
+	write(voice.chip, REG_VOICE_FREQH + voice.num, (voice.freq >> 8) | (keyOn ? (1 << 5) : 0));
 }
 
 // ----------------------------------------------------------------------------
@@ -873,7 +1607,12 @@ void OPLPlayer::silenceVoice(OPLVoice& voice)
 {
 	voice.on = false;
 	voice.justChanged = true;
-	voice.duration = UINT_MAX;
+	voice.releaseTime = OPLVoice::never;
+	m_voicesChanged = true;
+	// (it can switch to another patch once the envelope has had time to die off, see updatePatch)
+	if (voice.killTime == OPLVoice::never)
+		voice.killTime = m_chipTime[voice.chip] + 48;
+	voice.silentTime = std::min(voice.silentTime, m_chipTime[voice.chip] + envelopeRelease(15, false, 0));
 
 	write(voice.chip, REG_OP_SR + voice.op,     0xff);
 	write(voice.chip, REG_OP_SR + voice.op + 3, 0xff);
@@ -923,6 +1662,10 @@ void OPLPlayer::midiNoteOn(uint8_t channel, uint8_t note, uint8_t velocity)
 	note &= 0x7f;
 	velocity &= 0x7f;
 
+	// (note on with zero velocity is recorded as a note off below)
+	if (m_trace && velocity)
+		m_trace->event(m_outputTime, 0x90 | (channel & 15), note, velocity);
+	
 	// if we just now turned this same note on, don't do it again
 	if (findVoice(channel, note, true))
 		return;
@@ -934,37 +1677,59 @@ void OPLPlayer::midiNoteOn(uint8_t channel, uint8_t note, uint8_t velocity)
 	const OPLPatch *newPatch = findPatch(channel, note);
 	if (!newPatch) return;
 	
-	const int numVoices = ((useFourOp(newPatch) || newPatch->dualTwoOp) ? 2 : 1);
+	(this->*m_noteOn)(channel, note, velocity, newPatch);
+}
+
+// ----------------------------------------------------------------------------
+template<OPLPlayer::ChipType type>
+void OPLPlayer::noteOn(uint8_t channel, uint8_t note, uint8_t velocity, const OPLPatch *newPatch)
+{
+	const int numVoices = ((useFourOp<type>(newPatch) || newPatch->dualTwoOp) ? 2 : 1);
 
 	OPLVoice *voice = nullptr;
 	for (int i = 0; i < numVoices; i++)
 	{
-		if (voice && useFourOp(newPatch) && voice->fourOpOther)
+		if (voice && useFourOp<type>(newPatch) && voice->fourOpOther)
 			voice = voice->fourOpOther;
 		else
-			voice = findVoice(channel, newPatch, note);
+			voice = findVoice<type>(channel, newPatch, note);
 		if (!voice) continue; // ??
 		
-		updatePatch(*voice, newPatch, i);
+		updatePatch<type>(*voice, newPatch, i);
+		m_chipIdle[voice->chip] = 0;
 
 		// update the note parameters for this voice
 		voice->channel = &m_channels[channel & 15];
 		voice->on = voice->justChanged = true;
+		m_voicesChanged = true;
 		voice->note = note;
 		voice->velocity = ymfm::clamp((int)velocity + newPatch->velocity, 0, 127);
-		voice->duration = 0;
+		voice->killTime = voice->releaseTime = OPLVoice::never;
+		voice->noteTime = m_chipTime[voice->chip];
+		voice->silentTime = OPLVoice::never;
 		
-		updateVolume(*voice);
+		updateVolume<type>(*voice);
 		updatePanning(*voice);
 		
 		// for 4op instruments, don't key on until we've written both voices...
-		if (!useFourOp(newPatch))
+		if (!useFourOp<type>(newPatch))
 		{
-			updateFrequency(*voice);
+			updateFrequency<type>(*voice);
 		}
 		else if (i > 0)
 		{
-			updateFrequency(*voice->fourOpOther);
+			// ...and if either one has to wait to start, so does the other one
+			OPLVoice *other = voice->fourOpOther;
+			if (voice->startTime != OPLVoice::never || other->startTime != OPLVoice::never)
+			{
+				if (voice->startTime == OPLVoice::never)
+					voice->startTime = other->startTime;
+				else if (other->startTime != OPLVoice::never)
+					voice->startTime = std::max(voice->startTime, other->startTime);
+				other->startTime = voice->startTime;
+				scheduleVoice(*voice, voice->startTime);
+			}
+			updateFrequency<type>(*other);
 		}
 	}
 }
@@ -974,14 +1739,39 @@ void OPLPlayer::midiNoteOff(uint8_t channel, uint8_t note)
 {
 	note &= 0x7f;
 	
+	if (m_trace)
+		m_trace->event(m_outputTime, 0x80 | (channel & 15), note);
+
 //	printf("midiNoteOff: chn %u, note %u\n", channel, note);
 	OPLVoice *voice;
 	while ((voice = findVoice(channel, note)) != nullptr)
 	{
 		voice->justChanged = voice->on;
 		voice->on = false;
+		m_voicesChanged = true;
+		m_chipIdle[voice->chip] = 0;
 
-		write(voice->chip, REG_VOICE_FREQH + voice->num, voice->freq >> 8);
+		if (voice->startTime != OPLVoice::never)
+		{
+			// this note hasn't actually started yet (see updatePatch),
+			// so release it once it's been playing for as long as it was held
+			const uint64_t held = m_chipTime[voice->chip] - voice->noteTime;
+			if (held)
+			{
+				voice->releaseTime = voice->startTime + held;
+				scheduleVoice(*voice, voice->releaseTime);
+			}
+			else
+			{
+				// (or don't play it at all, if it was released right away)
+				voice->releaseTime = OPLVoice::never;
+				voice->silentTime = voice->startTime;
+			}
+		}
+		else
+		{
+			keyOff(*voice);
+		}
 	}
 }
 
@@ -989,16 +1779,22 @@ void OPLPlayer::midiNoteOff(uint8_t channel, uint8_t note)
 void OPLPlayer::midiPitchControl(uint8_t channel, double pitch)
 {
 //	printf("midiPitchControl: chn %u, val %.02f\n", channel, pitch);
+	if (m_trace)
+		m_trace->pitch(m_outputTime, channel, pitch);
+	
 	MIDIChannel& ch = m_channels[channel & 15];
 	
 	ch.basePitch = pitch;
 	ch.pitch = midiCalcBend(pitch * ch.bendRange);
-	updateChannelVoices(channel, &OPLPlayer::updateFrequency);
+	updateChannelVoices(channel, m_updateFrequency);
 }
 
 // ----------------------------------------------------------------------------
 void OPLPlayer::midiProgramChange(uint8_t channel, uint8_t patchNum)
 {
+	if (m_trace)
+		m_trace->event(m_outputTime, 0xc0 | (channel & 15), patchNum & 0x7f);
+	
 	m_channels[channel & 15].patchNum = patchNum & 0x7f;
 	// patch change will take effect on the next note for this channel
 }
@@ -1010,6 +1806,9 @@ void OPLPlayer::midiControlChange(uint8_t channel, uint8_t control, uint8_t valu
 	control &= 0x7f;
 	value   &= 0x7f;
 	
+	if (m_trace)
+		m_trace->event(m_outputTime, 0xb0 | channel, control, value);
+	
 	MIDIChannel& ch = m_channels[channel];
 	
 //	printf("midiControlChange: chn %u, ctrl %u, val %u\n", channel, control, value);
@@ -1025,14 +1824,16 @@ void OPLPlayer::midiControlChange(uint8_t channel, uint8_t control, uint8_t valu
 	case 6:
 		if (ch.rpn == 0)
 		{
+			// (same as midiPitchControl, but without tracing it as a separate event)
 			ch.bendRange = value;
-			midiPitchControl(channel, ch.basePitch);
+			ch.pitch = midiCalcBend(ch.basePitch * ch.bendRange);
+			updateChannelVoices(channel, m_updateFrequency);
 		}
 		break;
 	
 	case 7:
 		ch.volume = value;
-		updateChannelVoices(channel, &OPLPlayer::updateVolume);
+		updateChannelVoices(channel, m_updateVolume);
 		break;
 	
 	case 10:
@@ -1067,6 +1868,9 @@ void OPLPlayer::midiControlChange(uint8_t channel, uint8_t control, uint8_t valu
 // ----------------------------------------------------------------------------
 void OPLPlayer::midiSysEx(const uint8_t *data, uint32_t length)
 {
+	if (m_trace)
+		m_trace->sysEx(m_outputTime, data, length);
+	
 	if (length > 0 && data[0] == 0xF0)
 	{
 		data++;
@@ -1112,6 +1916,17 @@ void OPLPlayer::midiSysEx(const uint8_t *data, uint32_t length)
 	}
 }
 
+// ----------------------------------------------------------------------------
+void OPLPlayer::setTrace(MIDITrace *trace)
+{
+	if (m_trace)
+		m_trace->stop(m_outputTime);
+	
+	m_trace = trace;
+	if (m_trace)
+		m_trace->start(m_outputTime, m_sampleRate);
+}
+
 // ----------------------------------------------------------------------------
 double OPLPlayer::midiCalcBend(double semitones)
 {
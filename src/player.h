@@ -3,12 +3,30 @@
 
 #include <ymfm_opl.h>
 #include <climits>
-#include <queue>
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "patches.h"
 
 class Sequence;
+class SequenceData;
+class OPLSampleSource;
+class MIDITrace;
+class OPLOutputTap;
+
+// a single register write, timestamped with the number of samples
+// that the chip had been clocked for at the time of the write
+struct OPLRegWrite
+{
+	// not real registers: the chip stops or starts being clocked at this time (see OPLPlayer::setElastic)
+	enum { ChipParked = 0x200, ChipActive = 0x201 };
+	
+	uint64_t time;
+	uint16_t chip;
+	uint16_t addr;
+	uint8_t data;
+};
 
 struct MIDIChannel
 {
@@ -29,6 +47,9 @@ struct MIDIChannel
 
 struct OPLVoice
 {
+	// chip time for things that haven't been scheduled (or won't ever happen)
+	static const uint64_t never = UINT64_MAX;
+	
 	int chip = 0;
 	const MIDIChannel *channel = nullptr;
 	const OPLPatch *patch = nullptr;
@@ -38,6 +59,7 @@ struct OPLVoice
 	uint16_t op = 0; // base operator number, set based on voice num.
 	bool fourOpPrimary = false;
 	OPLVoice *fourOpOther = nullptr;
+	uint8_t fourOpBit = 0; // bit in the chip's 4op enable register (primary voices only)
 	
 	bool on = false;
 	bool justChanged = false; // true after note on/off, false after generating at least 1 sample
@@ -47,8 +69,18 @@ struct OPLVoice
 	// block and F number, calculated from note and channel pitch
 	uint16_t freq = 0;
 	
-	// how long has this note been playing (incremented each midi update)
-	uint32_t duration = UINT_MAX;
+	// chip time when this voice will have been silent long enough to change patches (see silenceVoice),
+	// or 'never' if it hasn't been silenced since its last note
+	uint64_t killTime = never;
+	// chip time when a note waiting on the above will actually start (see OPLPlayer::updatePatch),
+	// and when it will be released, if the note off already happened before then
+	uint64_t startTime = never;
+	uint64_t releaseTime = never;
+	// chip time when the current note was played
+	uint64_t noteTime = 0;
+	// chip time when the voice will be completely silent after being released
+	// ('never' while holding a note, see OPLPlayer::releaseSamples)
+	uint64_t silentTime = 0;
 };
 
 class OPLPlayer : public ymfm::ymfm_interface
@@ -72,14 +104,54 @@ public:
 	OPLPlayer(int numChips = 1, ChipType type = ChipOPL3);
 	virtual ~OPLPlayer();
 	
+	// only run 'minChips' chips (out of the number given to the constructor) until more voices are needed.
+	// when all active voices are in use, another chip is brought online instead of stealing a voice,
+	// and chips past the first 'minChips' stop being clocked again after 'idleTime' seconds without any notes.
+	// takes full effect after the next reset (by default, all chips are always active, which a 'minChips' of 0 goes back to)
+	void setElastic(unsigned minChips, double idleTime = 5.0);
+	// number of chips currently being clocked
+	unsigned activeChips() const;
+	// number of voices currently holding a note, and the number still making any sound at all
+	// (including notes that have been released, until their envelopes have finished)
+	unsigned activeVoices() const;
+	unsigned soundingVoices() const;
+	
 	void setLoop(bool loop) { m_looping = loop; }
+	bool loop() const { return m_looping; }
 	void setSampleRate(uint32_t rate);
 	void setGain(double gain);
 	void setFilter(double cutoff);
 	
+	// add an extra output at another sample rate, with its own resampling and filter state
+	// (using the same gain and filter settings as the main output), but fed by the same chips and
+	// MIDI playback, so that rendering more sample rates at once doesn't cost any more chip emulation.
+	// MIDI events still happen on the main output's sample boundaries, so a tap's output can differ
+	// very slightly from what the player would output at the same rate.
+	// returns the new tap's number (starting at 0)
+	unsigned addTap(uint32_t sampleRate);
+	void clearTaps();
+	// get a tap's output (16-bit, stereo or mono like the main output) from previous calls to generate, returning the number of samples read.
+	// each tap buffers its output until it's read, so read them regularly
+	unsigned readTap(unsigned tap, int16_t *data, unsigned maxSamples);
+	unsigned tapAvailable(unsigned tap) const;
+	uint32_t tapSampleRate(unsigned tap) const;
+	unsigned numTaps() const { return m_taps.size(); }
+	
 	// enable/disable OPL3 stereo support. can be called during active playback
-	// (note: the output of OPLPlayer::generate is a stereo stream regardless of this setting)
+	// (note: the output of OPLPlayer::generate is a stereo stream regardless of this setting,
+	// unless mono output is also enabled below)
 	void setStereo(bool on = true);
+	// output one channel instead of two from generate, generateBlock(s) and any taps.
+	// if stereo is disabled (or for OPL/OPL2), only that one channel is mixed, resampled and filtered,
+	// since the other would always be the same; otherwise both are mixed down to one
+	void setMonoOutput(bool on = true);
+	bool monoOutput() const { return m_monoOutput; }
+	// resample, apply gain and filter using only integer math (see fixed.h) instead of floating-point,
+	// so that output is bit-exact across compilers and CPUs (and usually a bit faster on older ones).
+	// the floating-point version of generate is converted from the same output.
+	// enabled by default if built with YMFMIDI_FIXED_POINT defined (e.g. 'make FIXED=1')
+	void setFixedPoint(bool on = true);
+	bool fixedPoint() const { return m_fixedPoint; }
 	
 	// load MIDI data from the specified path
 	bool loadSequence(const char* path);
@@ -87,7 +159,14 @@ public:
 	// if 'size' is 0, the full file will be read (starting from 'offset')
 	bool loadSequence(FILE *file, int offset = 0, size_t size = 0);
 	// load MIDI data from a block of memory
-	bool loadSequence(const uint8_t *data, size_t size);
+	// if 'borrow' is true, the data isn't copied and must remain valid for as long as
+	// the song is loaded (in this player or any others it's shared with)
+	bool loadSequence(const uint8_t *data, size_t size, bool borrow = false);
+	// play song data that's already loaded, e.g. by another player (see sequenceData()).
+	// each player keeps its own playback position, so any number of them can play the same song at once
+	bool loadSequence(std::shared_ptr<const SequenceData> data);
+	// get the currently loaded song data (or null, if none)
+	std::shared_ptr<const SequenceData> sequenceData() const;
 	
 	// load instrument patches from the specified path
 	bool loadPatches(const char* path);
@@ -97,12 +176,35 @@ public:
 	bool loadPatches(FILE *file, int offset = 0, size_t size = 0);
 	// load instrument patches from a block of memory
 	bool loadPatches(const uint8_t *data, size_t size);
+	// (patches loaded with the above are added to any that are already loaded)
+	
+	// use an already loaded patch bank, which can be shared by any number of players
+	void setPatches(std::shared_ptr<const PatchBank> patches);
+	// get the current patch bank (or null, if no patches are loaded)
+	std::shared_ptr<const PatchBank> patches() const { return m_patches; }
 	
 	// render the audio output during playback.
 	// note: regardless of sound settings, output stream is always stereo (two floats or int16s per sample)
+	// unless mono output is enabled (see setMonoOutput)
 	void generate(float *data, unsigned numSamples);
 	void generate(int16_t *data, unsigned numSamples);
 	
+	// render output in blocks that end at the song's MIDI events, so that nothing changes in the middle
+	// of a block: any events that are due are handled first, then up to 'maxSamples' are rendered
+	// until the next one. if the song ends, the block ends on the sample that it ended on
+	// (so rendering blocks until atEnd() gives the same output as rendering one sample at a time).
+	// returns the number of samples rendered ('maxSamples' if there are no more events to wait for)
+	unsigned generateBlock(float *data, unsigned maxSamples);
+	unsigned generateBlock(int16_t *data, unsigned maxSamples);
+	
+	// render the rest of the song in blocks (as above), using 'data' as the buffer,
+	// and pass each one to 'output' as soon as it's rendered. stops at the end of the song
+	// (never, if looping) or when 'output' returns false. returns the number of samples rendered
+	typedef std::function<bool(const float *data, unsigned numSamples)> BlockFuncFloat;
+	typedef std::function<bool(const int16_t *data, unsigned numSamples)> BlockFunc;
+	uint64_t generateBlocks(float *data, unsigned maxSamples, BlockFuncFloat output);
+	uint64_t generateBlocks(int16_t *data, unsigned maxSamples, BlockFunc output);
+	
 	// reset OPL and midi file
 	void reset();
 	// reached end of song?
@@ -123,6 +225,14 @@ public:
 	// sysex data (data and length *don't* include the opening 0xF0)
 	void midiSysEx(const uint8_t *data, uint32_t length);
 	
+	// write directly to a chip register, bypassing MIDI playback and voice allocation
+	// (used for playing back register logs; writes to chips past the number being emulated are ignored)
+	void oplWrite(unsigned chip, uint16_t addr, uint8_t data);
+	
+	// record all MIDI events sent to the player (by the current song or otherwise) to a trace,
+	// until this is called again with null. the trace must remain valid until then (see trace.h)
+	void setTrace(MIDITrace *trace);
+	
 	// helper for pitch bend and finetune
 	static double midiCalcBend(double semitones);
 	
@@ -135,9 +245,15 @@ public:
 	uint32_t sampleRate() const { return m_sampleRate; }
 	ChipType chipType() const { return m_chipType; }
 	bool stereo() const { return m_stereo; }
-	const std::string& patchName(uint8_t num) { return m_patches[num].name; }
+	static unsigned chipClock() { return masterClock; }
+	uint32_t chipSampleRate() const;
+	const char* patchName(uint8_t num) const;
 	
 private:
+	friend class OPLRender;
+	friend class OPLCache;
+	friend class OPLBatch;
+
 	static const unsigned masterClock = 14318181;
 
 	enum {
@@ -156,15 +272,51 @@ private:
 		REG_NEW         = 0x105,
 	};
 
-	void updateMIDI();
+	// render one or two channels of output (see setMonoOutput)
+	template<unsigned numChannels> void render(float *data, unsigned numSamples);
+	template<unsigned numChannels> void render(int16_t *data, unsigned numSamples);
+	
+	// the same, using fixed-point resampling and filtering (see setFixedPoint)
+	template<unsigned numChannels, typename T> void renderFixed(T *data, unsigned numSamples);
+	
+	template<unsigned numChannels> void updateMIDI();
+	template<unsigned numChannels> void updateMIDIFixed();
+	// handle any MIDI events that are due, without generating output
+	void updateEvents();
+	// handle due events and find the size of the next block for generateBlock
+	unsigned nextBlock(unsigned maxSamples);
+	// reset voice status after a MIDI update (see OPLVoice::justChanged)
+	void updateVoices();
+
+	// reset resampling/filter state (and start or release any waiting voices right away)
+	void resetOutput();
+	// save/restore the state of the chips and the 16-bit output path (but not MIDI playback),
+	// e.g. to resume synthesis after playing up to the same point without it (see cache.h)
+	void saveOutput(std::vector<uint8_t>& data);
+	void restoreOutput(std::vector<uint8_t>& data);
 
-	void runSamples(int chip, unsigned count);
+	// get the combined output of all chips for the next OPL sample
+	// (only the left channel for mono output, see setMonoOutput)
+	template<unsigned numChannels> void runChips(int32_t samples[2]);
+	// start or release any voices on a chip that were waiting until its current time (see updatePatch)
+	void updateWaitingVoices(unsigned chip);
+	void scheduleVoice(const OPLVoice& voice, uint64_t time);
+	// stop clocking an extra chip once all of its voices are silent
+	void parkChip(unsigned chip);
+	// start or stop clocking a chip (also logged, if logging register writes)
+	void setChipActive(unsigned chip, bool active);
 
 	void write(int chip, uint16_t addr, uint8_t data);
 	
 	// find a voice with the oldest note, or the same patch & note
 	// if no "off" voices are found, steal one using the same patch or MIDI channel
-	OPLVoice* findVoice(uint8_t channel, const OPLPatch *patch, uint8_t note);
+	template<ChipType type> OPLVoice* findVoice(uint8_t channel, const OPLPatch *patch, uint8_t note);
+	// determine whether a voice can play a patch without waiting for it to be silenced first
+	bool voiceReady(const OPLVoice& voice, const OPLPatch *patch) const;
+	// determine whether a voice has completely finished releasing its last note
+	bool voiceSilent(const OPLVoice& voice) const;
+	// how long ago a voice's last note was played, for choosing which one to reuse
+	uint64_t voiceAge(const OPLVoice& voice) const;
 	// find a voice that's playing a specific note on a specific channel
 	OPLVoice* findVoice(uint8_t channel, uint8_t note, bool justChanged = false);
 
@@ -172,26 +324,55 @@ private:
 	const OPLPatch* findPatch(uint8_t channel, uint8_t note) const;
 
 	// determine whether this patch should be configured as 4op
-	bool useFourOp(const OPLPatch *patch) const;
+	template<ChipType type> static bool useFourOp(const OPLPatch *patch)
+	{
+		return type == ChipOPL3 && patch->fourOp;
+	}
 
 	// determine which operator(s) to scale based on the current operator settings
-	std::pair<bool, bool> activeCarriers(const OPLVoice& voice) const;
+	template<ChipType type> std::pair<bool, bool> activeCarriers(const OPLVoice& voice) const;
 
 	// update a property of all currently playing voices on a MIDI channel
 	// (or all channels if `channel` < 0)
 	void updateChannelVoices(int8_t channel, void(OPLPlayer::*func)(OPLVoice&));
 
 	// update the patch parameters for a voice
-	void updatePatch(OPLVoice& voice, const OPLPatch *newPatch, uint8_t numVoice = 0);
+	template<ChipType type> void updatePatch(OPLVoice& voice, const OPLPatch *newPatch, uint8_t numVoice = 0);
+	// write a voice's current patch to the chip
+	void writePatch(OPLVoice& voice);
+	
+	// assign voice(s) to a new note and start playing it.
+	// this and the above (as well as the voice updates below) are specialized for each chip type,
+	// so that e.g. 4op voice handling isn't compiled in for OPL/OPL2
+	template<ChipType type> void noteOn(uint8_t channel, uint8_t note, uint8_t velocity, const OPLPatch *newPatch);
+	
+	// choose the right version of each of the above for a chip type (called by the constructor)
+	template<ChipType type> void initChipType();
+	void (OPLPlayer::*m_noteOn)(uint8_t channel, uint8_t note, uint8_t velocity, const OPLPatch *newPatch);
+	void (OPLPlayer::*m_updateVolume)(OPLVoice& voice);
+	void (OPLPlayer::*m_updateFrequency)(OPLVoice& voice);
+	void (OPLPlayer::*m_keyOff)(OPLVoice& voice);
+
+	// load patches into a new bank, starting with a copy of the current one (if any)
+	bool addPatches(std::function<bool(PatchBank&)> load);
 
 	// update the volume level for a voice
-	void updateVolume(OPLVoice& voice);
+	template<ChipType type> void updateVolume(OPLVoice& voice);
+	void updateVolume(OPLVoice& voice) { (this->*m_updateVolume)(voice); }
 
 	// update the pan position for a voice
 	void updatePanning(OPLVoice& voice);
 
 	// update the block and F-number for a voice (also key on/off)
-	void updateFrequency(OPLVoice& voice);
+	template<ChipType type> void updateFrequency(OPLVoice& voice);
+	void updateFrequency(OPLVoice& voice) { (this->*m_updateFrequency)(voice); }
+	
+	// key off a voice (i.e. start releasing it)
+	template<ChipType type> void keyOff(OPLVoice& voice);
+	void keyOff(OPLVoice& voice) { (this->*m_keyOff)(voice); }
+	// estimate how many samples it takes a voice to finish releasing, based on its patch and frequency
+	// (UINT32_MAX if it never will)
+	template<ChipType type> uint32_t releaseSamples(const OPLVoice& voice) const;
 
 	// silence a voice immediately
 	void silenceVoice(OPLVoice& voice);
@@ -199,33 +380,61 @@ private:
 	std::vector<ymfm::ymf262*> m_opl3;
 	unsigned m_numChips;
 	ChipType m_chipType;
+	// current value of the 4op enable register for each chip
+	std::vector<uint8_t> m_fourOpMask;
+	
+	// chips that are currently being clocked, and for how long they've had no new notes (see setElastic)
+	unsigned m_minChips;
+	uint32_t m_chipIdleLimit;
+	std::vector<bool> m_chipActive;
+	std::vector<uint32_t> m_chipIdle;
 	
 	bool m_stereo;
+	bool m_monoOutput;
 	uint32_t m_sampleRate; // output sample rate (default 44.1k)
 	double m_sampleGain;
 	double m_sampleStep; // ratio of OPL sample rate to output sample rate (usually < 1.0)
 	double m_samplePos; // number of pending output samples (when >= 1.0, output one)
+	// fixed-point versions of the above (see setFixedPoint and fixed.h)
+	bool m_fixedPoint;
+	uint64_t m_phaseStep, m_phase; // 32.32
+	int64_t m_sampleGainFixed; // 16.16, including the sample rate ratio
 	uint32_t m_samplesLeft; // remaining samples until next midi event
 	ymfm::ymf262::output_data m_output; // output sample data
-	// if we need to clock one of the OPLs between register writes, save the resulting sample
-	std::vector<std::queue<ymfm::ymf262::output_data>> m_sampleFIFO;
+	// number of samples each chip has been clocked for (since the last output reset)
+	std::vector<uint64_t> m_chipTime;
+	// earliest chip time that any voice on each chip is waiting for (see updateWaitingVoices)
+	std::vector<uint64_t> m_voiceTime;
+	// total number of samples output (never reset, for timestamping trace events)
+	uint64_t m_outputTime;
+	
+	// used for offline rendering (see render.h):
+	// if set, register writes are only logged here and the chips aren't clocked
+	std::vector<OPLRegWrite> *m_regLog;
+	// if set, chip output is read from here instead and MIDI playback is suspended
+	OPLSampleSource *m_sampleSource;
 	
 	// last output for downsampling
 	int32_t m_lastOut[2] = {0};
 	// recursive highpass filter to remove/reduce DC offset
 	double m_hpFilterFreq, m_hpFilterCoef;
+	int64_t m_hpFilterCoefFixed; // 2.30
 	int32_t m_hpLastIn[2] = {0}, m_hpLastOut[2] = {0};
 	float m_hpLastInF[2] = {0}, m_hpLastOutF[2] = {0};
+	// extra outputs at other sample rates (see addTap)
+	std::vector<OPLOutputTap*> m_taps;
 	
 	bool m_looping;
 	bool m_timePassed;
+	bool m_voicesChanged; // true if any notes were played/released since the last MIDI update
 	
 	MIDIChannel m_channels[16];
 	std::vector<OPLVoice> m_voices;
 	MIDIType m_midiType;
 	
 	Sequence *m_sequence;
-	OPLPatchSet m_patches;
+	std::shared_ptr<const PatchBank> m_patches;
+	MIDITrace *m_trace;
 };
 
 #endif // __PLAYER_H
@@ -0,0 +1,394 @@
+#include "render.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+
+// number of OPL samples in each segment of the song
+static const uint32_t segmentSize = 1 << 16;
+// number of segments to log ahead of the one currently being mixed
+static const unsigned segmentsAhead = 4;
+// number of output samples generated at a time
+static const unsigned outputBlockSize = 4096;
+
+// a range of OPL samples, along with the register writes logged for each chip during that time,
+// and each chip's output once it's been synthesized
+struct Segment
+{
+	Segment(unsigned numChips, uint32_t numSamples)
+		: size(numSamples)
+		, writes(numChips)
+		, output(numChips)
+	{
+		chipsLeft = numChips;
+	}
+	
+	uint32_t size;
+	std::vector<std::vector<OPLRegWrite>> writes;
+	std::vector<std::vector<int32_t>> output; // (stereo)
+	unsigned chipsLeft; // number of chips still being synthesized
+};
+
+// one chip being synthesized from a register write log, one segment at a time
+class ChipRender
+{
+public:
+	ChipRender()
+		: m_chip(m_interface)
+	{
+		m_chip.reset();
+		m_time = 0;
+		m_parked = false;
+		m_running = false;
+	}
+	
+	void run(Segment *segment, unsigned num);
+	
+	// segments waiting to be synthesized, and whether a thread is already working through them
+	// (both guarded by ChipMixer::m_mutex)
+	std::queue<Segment*> m_pending;
+	bool m_running;
+
+private:
+	ymfm::ymfm_interface m_interface;
+	ymfm::ymf262 m_chip;
+	
+	uint64_t m_time;
+	bool m_parked; // not being clocked (see OPLPlayer::setElastic)
+};
+
+// keeps the chips synthesizing a few segments ahead of the player, and mixes their output
+class ChipMixer : public OPLSampleSource
+{
+public:
+	// 'logSegment' logs the next segment's register writes, or returns null at the end of the song
+	typedef std::function<Segment*()> LogFunc;
+	
+	ChipMixer(std::vector<ChipRender*>& chips, ThreadPool& pool, LogFunc logSegment);
+	~ChipMixer();
+	
+	// log the next segment and start synthesizing it, returning false if there are no more
+	bool queueSegment();
+	
+	void read(int32_t samples[2]);
+
+private:
+	void runChip(unsigned num);
+	void nextSegment();
+	
+	std::vector<ChipRender*>& m_chips;
+	ThreadPool& m_pool;
+	LogFunc m_logSegment;
+	
+	// segments logged but not yet mixed (the first one is the one currently being read)
+	std::deque<Segment*> m_segments;
+	std::mutex m_mutex;
+	std::condition_variable m_segmentDone;
+	
+	std::vector<int32_t> m_mix;
+	uint32_t m_pos, m_size;
+};
+
+// ----------------------------------------------------------------------------
+void ChipRender::run(Segment *segment, unsigned num)
+{
+	const std::vector<OPLRegWrite>& writes = segment->writes[num];
+	std::vector<int32_t>& output = segment->output[num];
+	size_t nextWrite = 0;
+	
+	output.resize(segment->size * 2);
+	
+	for (uint32_t i = 0; i < segment->size; i++, m_time++)
+	{
+		while (nextWrite < writes.size() && writes[nextWrite].time <= m_time)
+		{
+			const OPLRegWrite& write = writes[nextWrite++];
+			if (write.addr >= OPLRegWrite::ChipParked)
+			{
+				m_parked = (write.addr == OPLRegWrite::ChipParked);
+				continue;
+			}
+			
+			if (write.addr < 0x100)
+				m_chip.write_address((uint8_t)write.addr);
+			else
+				m_chip.write_address_hi((uint8_t)write.addr);
+			m_chip.write_data(write.data);
+		}
+		
+		if (m_parked)
+		{
+			output[i*2] = output[i*2+1] = 0;
+			continue;
+		}
+		
+		ymfm::ymf262::output_data out;
+		m_chip.generate(&out);
+		output[i*2]   = out.data[0];
+		output[i*2+1] = out.data[1];
+	}
+}
+
+// ----------------------------------------------------------------------------
+ChipMixer::ChipMixer(std::vector<ChipRender*>& chips, ThreadPool& pool, LogFunc logSegment)
+	: m_chips(chips)
+	, m_pool(pool)
+	, m_logSegment(logSegment)
+{
+	m_pos = m_size = 0;
+}
+
+// ----------------------------------------------------------------------------
+ChipMixer::~ChipMixer()
+{
+	// (anything still being synthesized should be finished by now, see OPLRender::render)
+	for (auto segment : m_segments)
+		delete segment;
+}
+
+// ----------------------------------------------------------------------------
+bool ChipMixer::queueSegment()
+{
+	Segment *segment = m_logSegment();
+	if (!segment)
+		return false;
+	
+	m_segments.push_back(segment);
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (unsigned i = 0; i < m_chips.size(); i++)
+	{
+		// each chip's segments are synthesized in order by one job at a time,
+		// since each one picks up where the chip left off at the end of the last one
+		ChipRender *chip = m_chips[i];
+		chip->m_pending.push(segment);
+		if (!chip->m_running)
+		{
+			chip->m_running = true;
+			m_pool.run([this, i] { runChip(i); });
+		}
+	}
+	
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+void ChipMixer::runChip(unsigned num)
+{
+	ChipRender *chip = m_chips[num];
+	std::unique_lock<std::mutex> lock(m_mutex);
+	
+	while (!chip->m_pending.empty())
+	{
+		Segment *segment = chip->m_pending.front();
+		lock.unlock();
+		chip->run(segment, num);
+		lock.lock();
+		
+		chip->m_pending.pop();
+		if (!--segment->chipsLeft)
+			m_segmentDone.notify_all();
+	}
+	
+	chip->m_running = false;
+}
+
+// ----------------------------------------------------------------------------
+void ChipMixer::nextSegment()
+{
+	// done with the last segment (if any)
+	if (m_size)
+	{
+		delete m_segments.front();
+		m_segments.pop_front();
+	}
+	m_pos = m_size = 0;
+	
+	// keep logging ahead so that the chips always have something to do
+	while (m_segments.size() <= segmentsAhead)
+	{
+		if (!queueSegment())
+			break;
+	}
+	if (m_segments.empty())
+		return;
+	
+	Segment *segment = m_segments.front();
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_segmentDone.wait(lock, [segment] { return !segment->chipsLeft; });
+	}
+	
+	m_mix.assign(segment->size * 2, 0);
+	for (const auto& output : segment->output)
+	{
+		for (uint32_t i = 0; i < segment->size * 2; i++)
+			m_mix[i] += output[i];
+	}
+	m_size = segment->size;
+}
+
+// ----------------------------------------------------------------------------
+void ChipMixer::read(int32_t samples[2])
+{
+	if (m_pos >= m_size)
+		nextSegment();
+	
+	if (m_pos < m_size)
+	{
+		samples[0] = m_mix[m_pos*2];
+		samples[1] = m_mix[m_pos*2+1];
+		m_pos++;
+	}
+	else
+	{
+		// shouldn't happen, but just in case the player asks for more than was logged
+		samples[0] = samples[1] = 0;
+	}
+}
+
+// ----------------------------------------------------------------------------
+uint32_t OPLRender::log(OPLPlayer& player, std::vector<OPLRegWrite>& regLog, uint64_t *numChipSamples)
+{
+	const bool looping = player.m_looping;
+	
+	// play through the whole song without clocking the chips
+	// and just log all register writes (and the time they happen)
+	player.m_looping = false;
+	player.m_regLog = &regLog;
+	player.resetOutput();
+	player.reset();
+	
+	uint32_t numSamples = 0;
+	int16_t samples[outputBlockSize * 2];
+	while (!player.atEnd())
+		numSamples += player.generateBlock(samples, outputBlockSize);
+	
+	// total number of OPL samples actually used by the player
+	if (numChipSamples)
+		*numChipSamples = player.m_chipTime[0];
+	
+	player.m_regLog = nullptr;
+	player.m_looping = looping;
+	player.resetOutput();
+	player.reset();
+	
+	return numSamples;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t OPLRender::render(OPLPlayer& player, OutputFunc output, unsigned numThreads)
+{
+	// the song is played without synthesis by a second player with the same song and settings
+	// (as far as they affect when anything happens), which logs register writes just ahead of the output
+	const unsigned voicesPerChip = (player.m_chipType == OPLPlayer::ChipOPL3) ? 18 : 9;
+	OPLPlayer logPlayer(player.m_voices.size() / voicesPerChip, player.m_chipType);
+	logPlayer.m_minChips = player.m_minChips;
+	logPlayer.m_chipIdleLimit = player.m_chipIdleLimit;
+	logPlayer.m_stereo = player.m_stereo;
+	logPlayer.setMonoOutput(player.m_monoOutput);
+	logPlayer.setFixedPoint(player.m_fixedPoint);
+	logPlayer.setSampleRate(player.m_sampleRate);
+	logPlayer.setPatches(player.m_patches);
+	if (player.m_sequence)
+	{
+		logPlayer.loadSequence(player.sequenceData());
+		logPlayer.setSongNum(player.songNum());
+	}
+	
+	std::vector<OPLRegWrite> regLog;
+	logPlayer.m_regLog = &regLog;
+	logPlayer.resetOutput();
+	logPlayer.reset();
+	
+	uint32_t numSamples = 0; // number of output samples logged so far
+	uint64_t segmentStart = 0;
+	std::vector<int16_t> logBuffer(outputBlockSize * 2);
+	
+	auto logSegment = [&]() -> Segment*
+	{
+		const uint64_t segmentEnd = segmentStart + segmentSize;
+		while (logPlayer.m_chipTime[0] < segmentEnd && !logPlayer.atEnd())
+			numSamples += logPlayer.generateBlock(logBuffer.data(), outputBlockSize);
+		
+		const uint32_t size = std::min(logPlayer.m_chipTime[0], segmentEnd) - segmentStart;
+		if (!size)
+			return nullptr;
+		
+		// the last block may have gone past the end of the segment,
+		// so keep any writes after that for the next one
+		Segment *segment = new Segment(logPlayer.m_numChips, size);
+		auto next = std::stable_partition(regLog.begin(), regLog.end(),
+			[segmentEnd](const OPLRegWrite& write) { return write.time < segmentEnd; });
+		for (auto write = regLog.begin(); write != next; write++)
+			segment->writes[write->chip].push_back(*write);
+		regLog.erase(regLog.begin(), next);
+		
+		segmentStart += size;
+		return segment;
+	};
+	
+	std::vector<ChipRender*> chips(player.m_numChips);
+	for (auto& chip : chips)
+		chip = new ChipRender();
+	
+	// each segment is synthesized on all chips in parallel, while later segments are being logged
+	// and the player does the usual mixing, resampling and filtering of earlier ones
+	if (!numThreads)
+		numThreads = ThreadPool::defaultThreads();
+	ThreadPool pool(std::min(numThreads, player.m_numChips));
+	ChipMixer mixer(chips, pool, logSegment);
+	
+	player.m_sampleSource = &mixer;
+	player.resetOutput();
+	player.reset();
+	
+	std::vector<int16_t> buffer(outputBlockSize * 2);
+	uint32_t samplesDone = 0;
+	while (true)
+	{
+		// only output as much as the song actually lasts
+		while (numSamples - samplesDone < outputBlockSize)
+		{
+			if (!mixer.queueSegment())
+				break;
+		}
+		
+		const unsigned count = std::min(numSamples - samplesDone, (uint32_t)outputBlockSize);
+		if (!count)
+			break;
+		
+		player.generate(buffer.data(), count);
+		samplesDone += count;
+		
+		if (!output(buffer.data(), count))
+			break;
+	}
+	
+	pool.wait();
+	for (auto chip : chips)
+		delete chip;
+	
+	player.m_sampleSource = nullptr;
+	player.resetOutput();
+	player.reset();
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t OPLRender::hash(const int16_t *data, size_t numSamples, uint64_t hash, bool mono)
+{
+	const unsigned repeat = mono ? 2 : 1;
+	for (size_t i = 0; i < numSamples * 2; i++)
+	{
+		const int16_t sample = data[i / repeat];
+		hash = (hash ^ (uint8_t)sample) * 0x100000001b3ull;
+		hash = (hash ^ (uint8_t)(sample >> 8)) * 0x100000001b3ull;
+	}
+	
+	return hash;
+}
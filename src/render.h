@@ -0,0 +1,52 @@
+#ifndef __RENDER_H
+#define __RENDER_H
+
+#include <functional>
+
+#include "player.h"
+
+// supplies pre-rendered chip output to an OPLPlayer in place of its own emulated chips
+class OPLSampleSource
+{
+public:
+	virtual ~OPLSampleSource() {}
+
+	// get the combined output of all chips for the next OPL sample
+	virtual void read(int32_t samples[2]) = 0;
+};
+
+class OPLRender
+{
+public:
+	// called with each block of rendered output (16-bit stereo, or mono; see OPLPlayer::setMonoOutput)
+	// return false to stop rendering early
+	typedef std::function<bool(const int16_t *data, unsigned numSamples)> OutputFunc;
+
+	// render the player's current song once from the beginning (regardless of loop setting).
+	// the song is split into segments, which are worked on in a pipeline: a second player logs the
+	// register writes for upcoming segments (playing the song without synthesis), each emulated chip
+	// synthesizes the segments in order on its own thread (up to 'numThreads' at once, or one per
+	// CPU core if 0), and the player resamples and mixes the finished ones.
+	// the output is identical to calling OPLPlayer::generate until OPLPlayer::atEnd()
+	// on a newly loaded player with the same settings.
+	// a chip's state at the start of a segment is only known once it's synthesized the ones before it,
+	// so at most one thread per chip is useful: songs played on a single chip don't scale with
+	// 'numThreads' at all, and only gain from running synthesis alongside the logging and mixing.
+	// returns the number of output samples rendered
+	static uint32_t render(OPLPlayer& player, OutputFunc output, unsigned numThreads = 0);
+
+	// play the player's current song once from the beginning without synthesis,
+	// and log all register writes (timestamped in OPL samples, including when chips are parked; see OPLRegWrite).
+	// 'numChipSamples' is set to the length of the song in OPL samples.
+	// returns the number of output samples that would have been rendered
+	static uint32_t log(OPLPlayer& player, std::vector<OPLRegWrite>& regLog, uint64_t *numChipSamples = nullptr);
+	
+	// 64-bit FNV-1a hash of 16-bit output samples, for comparing rendered output
+	// (pass the previous result as 'hash' to continue hashing across multiple blocks).
+	// mono output is hashed as if it were stereo with both channels the same,
+	// so it gives the same result as rendering in stereo with stereo disabled
+	static const uint64_t hashInit = 0xcbf29ce484222325ull;
+	static uint64_t hash(const int16_t *data, size_t numSamples, uint64_t hash = hashInit, bool mono = false);
+};
+
+#endif // __RENDER_H
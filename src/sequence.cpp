@@ -2,66 +2,117 @@
 
 #include "sequence.h"
 #include "sequence_hmi.h"
+#include "sequence_dro.h"
 #include "sequence_hmp.h"
 #include "sequence_mid.h"
 #include "sequence_mus.h"
+#include "sequence_vgm.h"
 #include "sequence_xmi.h"
 
 // ----------------------------------------------------------------------------
-Sequence::~Sequence() {}
-
-// ----------------------------------------------------------------------------
-Sequence* Sequence::load(const char *path)
+std::shared_ptr<const SequenceData> SequenceData::load(const char *path)
 {
 	FILE *file = fopen(path, "rb");
 	if (!file) return nullptr;
 	
-	Sequence *seq = load(file);
+	auto song = load(file);
 	
 	fclose(file);
-	return seq;
+	return song;
 }
 
 // ----------------------------------------------------------------------------
-Sequence* Sequence::load(FILE *file, int offset, size_t size)
+std::shared_ptr<const SequenceData> SequenceData::load(FILE *file, int offset, size_t size)
 {
-	if (!size)
-	{
-		fseek(file, 0, SEEK_END);
-		if (ftell(file) < 0)
-			return nullptr;
-		size = ftell(file) - offset;
-	}
-	
-	fseek(file, offset, SEEK_SET);
-	std::vector<uint8_t> data(size);
-	if (fread(data.data(), 1, size, file) != size)
+	auto song = std::make_shared<SequenceData>();
+	if (!song->block.map(file, offset, size))
 		return nullptr;
-
-	return load(data.data(), size);
+	
+	return read(song);
 }
 
 // ----------------------------------------------------------------------------
-Sequence* Sequence::load(const uint8_t *data, size_t size)
+std::shared_ptr<const SequenceData> SequenceData::load(const uint8_t *data, size_t size, bool borrow)
 {
-	Sequence *seq = nullptr;
+	auto song = std::make_shared<SequenceData>();
+	if (borrow)
+		song->block.borrow(data, size);
+	else
+		song->block.copy(data, size);
+	
+	return read(song);
+}
 
+// ----------------------------------------------------------------------------
+std::shared_ptr<const SequenceData> SequenceData::read(std::shared_ptr<SequenceData> song)
+{
+	const uint8_t *data = song->block.data();
+	const size_t size = song->block.size();
+	
 	if (SequenceMUS::isValid(data, size))
-		seq = new SequenceMUS();
+		SequenceMUS::read(*song, data, size);
 	else if (SequenceMID::isValid(data, size))
-		seq = new SequenceMID();
+		SequenceMID::read(*song, data, size);
 	else if (SequenceXMI::isValid(data, size))
-		seq = new SequenceXMI();
+		SequenceXMI::read(*song, data, size);
 	else if (SequenceHMI::isValid(data, size))
-		seq = new SequenceHMI();
+		SequenceHMI::read(*song, data, size);
 	else if (SequenceHMP::isValid(data, size))
-		seq = new SequenceHMP();
+		SequenceHMP::read(*song, data, size);
+	else if (SequenceVGM::isValid(data, size))
+		SequenceVGM::read(*song, data, size);
+	else if (SequenceDRO::isValid(data, size))
+		SequenceDRO::read(*song, data, size);
+	else
+		return nullptr;
+	
+	return song;
+}
+
+// ----------------------------------------------------------------------------
+Sequence::~Sequence() {}
+
+// ----------------------------------------------------------------------------
+Sequence* Sequence::load(const char *path)
+{
+	return load(SequenceData::load(path));
+}
+
+// ----------------------------------------------------------------------------
+Sequence* Sequence::load(FILE *file, int offset, size_t size)
+{
+	return load(SequenceData::load(file, offset, size));
+}
+
+// ----------------------------------------------------------------------------
+Sequence* Sequence::load(const uint8_t *data, size_t size, bool borrow)
+{
+	return load(SequenceData::load(data, size, borrow));
+}
+
+// ----------------------------------------------------------------------------
+Sequence* Sequence::load(std::shared_ptr<const SequenceData> data)
+{
+	if (!data)
+		return nullptr;
 	
-	if (seq)
+	Sequence *seq = nullptr;
+
+	switch (data->format)
 	{
-		seq->read(data, size);
-		seq->reset();
+	case SequenceData::FormatMID: seq = new SequenceMID(); break;
+	case SequenceData::FormatMUS: seq = new SequenceMUS(); break;
+	case SequenceData::FormatXMI: seq = new SequenceXMI(); break;
+	case SequenceData::FormatHMI: seq = new SequenceHMI(); break;
+	case SequenceData::FormatHMP: seq = new SequenceHMP(); break;
+	case SequenceData::FormatVGM: seq = new SequenceVGM(); break;
+	case SequenceData::FormatDRO: seq = new SequenceDRO(); break;
+	default: return nullptr;
 	}
 	
+	seq->m_songData = data;
+	seq->init();
+	seq->reset();
+	
 	return seq;
 }
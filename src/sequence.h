@@ -1,8 +1,59 @@
 #ifndef __SEQUENCE_H
 #define __SEQUENCE_H
 
+#include <memory>
+
+#include "arena.h"
+#include "datablock.h"
 #include "player.h"
 
+// parsed song data, which is never modified after loading.
+// any number of sequences (i.e. players) can play the same song data at once
+class SequenceData
+{
+public:
+	enum Format
+	{
+		FormatNone,
+		FormatMID,
+		FormatMUS,
+		FormatXMI,
+		FormatHMI,
+		FormatHMP,
+		FormatVGM,
+		FormatDRO
+	};
+
+	struct Track
+	{
+		const uint8_t *data;
+		size_t size;
+	};
+	
+	// load song data from the given path/file/block of memory
+	// (see Sequence::load for details)
+	static std::shared_ptr<const SequenceData> load(const char *path);
+	static std::shared_ptr<const SequenceData> load(FILE *path, int offset = 0, size_t size = 0);
+	static std::shared_ptr<const SequenceData> load(const uint8_t *data, size_t size, bool borrow = false);
+	
+	Format format = FormatNone;
+	// event data for each track, pointing into 'block'
+	// (single-track formats just have the song data here)
+	std::vector<Track> tracks;
+	
+	// format-specific header info
+	uint16_t type = 0; // MIDI file type (0-2), or chip type for register logs (0-2 = OPL2, dual OPL2, OPL3)
+	uint16_t ticksPerBeat = 24;
+	double ticksPerSec = 48; // initial tempo (if the format doesn't set it with events)
+	
+	DataBlock block;
+
+private:
+	// detect the format of the song in 'block' and read it
+	static std::shared_ptr<const SequenceData> read(std::shared_ptr<SequenceData> song);
+};
+
+// playback state for a song
 class Sequence
 {
 public:
@@ -14,9 +65,17 @@ public:
 	virtual ~Sequence();
 	
 	// load a sequence from the given path/file
+	// (the file data is memory-mapped if possible, and tracks are read from it in place)
 	static Sequence* load(const char *path);
 	static Sequence* load(FILE *path, int offset = 0, size_t size = 0);
-	static Sequence* load(const uint8_t *data, size_t size);
+	// load a sequence from a block of memory.
+	// if 'borrow' is true, the data is used in place instead of being copied,
+	// and must remain valid for as long as the song data is in use
+	static Sequence* load(const uint8_t *data, size_t size, bool borrow = false);
+	// play already loaded song data, which is shared with any other sequences using it
+	static Sequence* load(std::shared_ptr<const SequenceData> data);
+	
+	const std::shared_ptr<const SequenceData>& data() const { return m_songData; }
 	
 	// reset track to beginning
 	virtual void reset() { m_atEnd = false; }
@@ -42,9 +101,13 @@ protected:
 	bool m_atEnd;
 	unsigned m_songNum;
 	
+	std::shared_ptr<const SequenceData> m_songData;
+	// any other per-sequence data (e.g. track state) is allocated from here
+	Arena m_arena;
+	
 private:
-	virtual void read(const uint8_t *data, size_t size) = 0;
+	// set up playback state for m_songData
+	virtual void init() {}
 };
 
 #endif // __SEQUENCE_H
-
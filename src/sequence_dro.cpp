@@ -0,0 +1,135 @@
+#include "sequence_dro.h"
+
+#include <cmath>
+#include <cstring>
+
+#define READ_U16LE(data, pos) ((data[pos+1] << 8) | data[pos])
+#define READ_U32LE(data, pos) ((data[pos+3] << 24) | (data[pos+2] << 16) | (data[pos+1] << 8) | data[pos])
+
+static const unsigned headerSize = 26;
+
+// ----------------------------------------------------------------------------
+SequenceDRO::SequenceDRO()
+	: Sequence()
+{
+	m_data = nullptr;
+	m_size = 0;
+	m_codemap = nullptr;
+	m_codemapSize = 0;
+	m_shortDelay = m_longDelay = 0;
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+bool SequenceDRO::isValid(const uint8_t *data, size_t size)
+{
+	if (size < headerSize)
+		return false;
+	return !memcmp(data, "DBRAWOPL", 8)
+		&& READ_U16LE(data, 8) == 2 && READ_U16LE(data, 10) == 0;
+}
+
+// ----------------------------------------------------------------------------
+void SequenceDRO::read(SequenceData& song, const uint8_t *data, size_t size)
+{
+	song.format = SequenceData::FormatDRO;
+	song.type = data[20]; // 0 = OPL2, 1 = dual OPL2, 2 = OPL3
+	song.ticksPerSec = 1000;
+	
+	// only interleaved, uncompressed data is supported
+	if (data[21] || data[22])
+		return;
+	
+	const size_t start = headerSize + data[25];
+	if (start >= size)
+		return;
+	
+	size_t length = (size_t)READ_U32LE(data, 12) * 2;
+	if (length > size - start)
+		length = size - start;
+	song.tracks.push_back({data + start, length});
+}
+
+// ----------------------------------------------------------------------------
+void SequenceDRO::init()
+{
+	if (m_songData->tracks.empty())
+		return;
+	
+	const uint8_t *header = m_songData->block.data();
+	m_shortDelay = header[23];
+	m_longDelay = header[24];
+	m_codemapSize = header[25];
+	m_codemap = header + headerSize;
+	
+	m_data = m_songData->tracks[0].data;
+	m_size = m_songData->tracks[0].size;
+}
+
+// ----------------------------------------------------------------------------
+void SequenceDRO::reset()
+{
+	Sequence::reset();
+	m_pos = 0;
+	m_setup = false;
+	m_time = m_outTime = 0;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t SequenceDRO::update(OPLPlayer& player)
+{
+	m_atEnd = false;
+	
+	if (!m_setup)
+	{
+		// play OPL2 data with the OPL3 features disabled
+		// (otherwise the OPL3 stereo bits would be left off)
+		if (m_songData->type < 2)
+			player.oplWrite(0, 0x105, 0);
+		if (m_songData->type == 1)
+			player.oplWrite(1, 0x105, 0);
+		m_setup = true;
+	}
+	
+	uint32_t delay = 0;
+	while (!delay)
+	{
+		if (m_pos + 2 > m_size)
+		{
+			reset();
+			m_atEnd = true;
+			return 0;
+		}
+		
+		const uint8_t code = m_data[m_pos];
+		const uint8_t data = m_data[m_pos+1];
+		m_pos += 2;
+		
+		if (code == m_shortDelay)
+		{
+			delay = data + 1;
+		}
+		else if (code == m_longDelay)
+		{
+			delay = (data + 1) << 8;
+		}
+		else if ((code & 0x7f) < m_codemapSize)
+		{
+			// high bit = second register set (OPL3) or second chip (dual OPL2)
+			const uint8_t reg = m_codemap[code & 0x7f];
+			if (!(code & 0x80))
+				player.oplWrite(0, reg, data);
+			else if (m_songData->type == 1)
+				player.oplWrite(1, reg, data);
+			else
+				player.oplWrite(0, 0x100 | reg, data);
+		}
+	}
+	
+	m_time += delay;
+	const uint64_t outTime = round(m_time * player.sampleRate() / m_songData->ticksPerSec);
+	delay = outTime - m_outTime;
+	m_outTime = outTime;
+	
+	return delay;
+}
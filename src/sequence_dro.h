@@ -0,0 +1,35 @@
+#ifndef __SEQUENCE_DRO_H
+#define __SEQUENCE_DRO_H
+
+#include "sequence.h"
+
+// plays back register writes from a DOSBox raw OPL capture (version 2.0 only)
+class SequenceDRO : public Sequence
+{
+public:
+	SequenceDRO();
+	
+	void reset();
+	uint32_t update(OPLPlayer& player);
+	
+	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
+
+private:
+	void init();
+	
+	const uint8_t *m_data;
+	size_t m_size;
+	size_t m_pos;
+	bool m_setup; // true after the chips have been set up for this data
+	
+	// register numbers for each code used in the data
+	const uint8_t *m_codemap;
+	uint8_t m_codemapSize;
+	uint8_t m_shortDelay, m_longDelay;
+	
+	// playback time in milliseconds, and in output samples (to keep rounding from adding up)
+	uint64_t m_time, m_outTime;
+};
+
+#endif // __SEQUENCE_DRO_H
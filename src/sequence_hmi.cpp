@@ -11,7 +11,7 @@ public:
 	HMITrack(const uint8_t *data, size_t size, SequenceHMI* sequence);
 	
 protected:
-	bool metaEvent(OPLPlayer& player);
+	bool metaEvent(OPLPlayer *player);
 };
 
 // ----------------------------------------------------------------------------
@@ -22,7 +22,7 @@ HMITrack::HMITrack(const uint8_t *data, size_t size, SequenceHMI *sequence)
 }
 
 // ----------------------------------------------------------------------------
-bool HMITrack::metaEvent(OPLPlayer& player)
+bool HMITrack::metaEvent(OPLPlayer *player)
 {
 	if (m_status == 0xFE)
 	{
@@ -58,20 +58,22 @@ bool HMITrack::metaEvent(OPLPlayer& player)
 SequenceHMI::SequenceHMI()
 	: SequenceMID()
 {
-	m_type = 1;
 }
 
 // ----------------------------------------------------------------------------
 SequenceHMI::~SequenceHMI() {}
 
 // ----------------------------------------------------------------------------
-void SequenceHMI::read(const uint8_t *data, size_t size)
+void SequenceHMI::read(SequenceData& song, const uint8_t *data, size_t size)
 {
+	song.format = SequenceData::FormatHMI;
+	song.type = 1;
+	
 	uint32_t numTracks  = READ_U32LE(data, 0xE4);
 	uint32_t trackTable = READ_U32LE(data, 0xE8);
 	
-	m_ticksPerBeat = READ_U16LE(data, 0xD2);
-	m_ticksPerSec  = READ_U16LE(data, 0xD4);
+	song.ticksPerBeat = READ_U16LE(data, 0xD2);
+	song.ticksPerSec  = READ_U16LE(data, 0xD4);
 	
 	for (int i = 0; i < numTracks; i++)
 	{
@@ -97,10 +99,16 @@ void SequenceHMI::read(const uint8_t *data, size_t size)
 		if (trackStart < 0x5b)
 			continue;
 		
-		m_tracks.push_back(new HMITrack(data + offset + trackStart, trackLen - trackStart, this));
+		song.tracks.push_back({data + offset + trackStart, trackLen - trackStart});
 	}
 }
 
+// ----------------------------------------------------------------------------
+MIDTrack* SequenceHMI::newTrack(const SequenceData::Track& track)
+{
+	return m_arena.create<HMITrack>(track.data, track.size, this);
+}
+
 // ----------------------------------------------------------------------------
 bool SequenceHMI::isValid(const uint8_t *data, size_t size)
 {
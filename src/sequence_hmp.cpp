@@ -41,21 +41,21 @@ uint32_t HMPTrack::readDelay()
 SequenceHMP::SequenceHMP()
 	: SequenceMID()
 {
-	m_type = 1;
-	m_ticksPerBeat = 120;
-	m_ticksPerSec = 120;
 }
 
 // ----------------------------------------------------------------------------
 SequenceHMP::~SequenceHMP() {}
 
 // ----------------------------------------------------------------------------
-void SequenceHMP::read(const uint8_t *data, size_t size)
+void SequenceHMP::read(SequenceData& song, const uint8_t *data, size_t size)
 {
+	song.format = SequenceData::FormatHMP;
+	song.type = 1;
+	
 	uint32_t numTracks = READ_U32LE(data, 0x30);
 	
-	m_ticksPerBeat = READ_U32LE(data, 0x34);
-	m_ticksPerSec  = READ_U32LE(data, 0x38);
+	song.ticksPerBeat = READ_U32LE(data, 0x34);
+	song.ticksPerSec  = READ_U32LE(data, 0x38);
 	
 	// longer signature = extended format
 	uint32_t offset = (data[8] == 0) ? 0x308 : 0x388;
@@ -73,12 +73,18 @@ void SequenceHMP::read(const uint8_t *data, size_t size)
 		if (trackLen <= 12)
 			break;
 		
-		m_tracks.push_back(new HMPTrack(data + offset + 12, trackLen - 12, this));
+		song.tracks.push_back({data + offset + 12, trackLen - 12});
 		
 		offset += trackLen;
 	}
 }
 
+// ----------------------------------------------------------------------------
+MIDTrack* SequenceHMP::newTrack(const SequenceData::Track& track)
+{
+	return m_arena.create<HMPTrack>(track.data, track.size, this);
+}
+
 // ----------------------------------------------------------------------------
 bool SequenceHMP::isValid(const uint8_t *data, size_t size)
 {
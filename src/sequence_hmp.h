@@ -12,9 +12,10 @@ public:
 	void setTimePerBeat(uint32_t usec);
 	
 	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
 	
-private:
-	void read(const uint8_t *data, size_t size);
+protected:
+	MIDTrack* newTrack(const SequenceData::Track& track);
 };
 
 #endif // __SEQUENCE_HMP_H
@@ -1,7 +1,9 @@
 #include "sequence_mid.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <functional>
 
 #define READ_U16BE(data, pos) ((data[pos] << 8) | data[pos+1])
 #define READ_U24BE(data, pos) ((data[pos] << 16) | (data[pos+1] << 8) | data[pos+2])
@@ -10,9 +12,8 @@
 // ----------------------------------------------------------------------------
 MIDTrack::MIDTrack(const uint8_t *data, size_t size, SequenceMID *sequence)
 {
-	m_data = new uint8_t[size];
+	m_data = data;
 	m_size = size;
-	memcpy(m_data, data, size);
 	m_sequence = sequence;
 	
 	m_initDelay = true;
@@ -23,29 +24,64 @@ MIDTrack::MIDTrack(const uint8_t *data, size_t size, SequenceMID *sequence)
 }
 
 // ----------------------------------------------------------------------------
-MIDTrack::~MIDTrack()
-{
-	delete[] m_data;
-}
+MIDTrack::~MIDTrack() {}
 
 // ----------------------------------------------------------------------------
 void MIDTrack::reset()
 {
-	m_pos = m_delay = 0;
+	m_pos = m_time = 0;
 	m_atEnd = false;
 	m_status = 0x00;
+	// note offs still waiting from before the reset would otherwise end notes in the restarted song
+	m_notes.clear();
 }
 
 // ----------------------------------------------------------------------------
-void MIDTrack::advance(uint32_t time)
+void MIDTrack::reserveNotes()
 {
-	if (m_atEnd)
+	if (!m_useNoteDuration)
 		return;
 	
-	m_delay -= time;
-	if (m_useNoteDuration)
-		for (auto& note : m_notes)
-			note.delay -= time;
+	// count every note on in the track, since they could all be held at once
+	unsigned numNotes = 0;
+	
+	reset();
+	if (m_initDelay)
+		readDelay();
+	
+	while (m_size - m_pos >= 3)
+	{
+		if (!m_useRunningStatus || (m_data[m_pos] & 0x80))
+			m_status = m_data[m_pos++];
+		
+		switch (m_status >> 4)
+		{
+		case 9: // note on (plus length)
+			m_pos += 2;
+			readVLQ();
+			numNotes++;
+			break;
+		
+		case 8: case 10: case 11: case 14:
+			m_pos += 2;
+			break;
+		
+		case 12: case 13:
+			m_pos++;
+			break;
+		
+		case 15:
+			if (!metaEvent(nullptr))
+				m_pos = m_size;
+			break;
+		}
+		
+		if (m_pos < m_size)
+			readDelay();
+	}
+	
+	reset();
+	m_notes.reserve(numNotes);
 }
 
 // ----------------------------------------------------------------------------
@@ -65,39 +101,30 @@ uint32_t MIDTrack::readVLQ()
 }
 
 // ----------------------------------------------------------------------------
-int32_t MIDTrack::minDelay()
+uint32_t MIDTrack::nextTime() const
 {
-	int32_t delay = m_delay;
-	if (m_useNoteDuration)
-		for (auto& note : m_notes)
-			delay = std::min(delay, note.delay);
-	return delay;
+	if (!m_notes.empty())
+		return std::min(m_time, m_notes.front().time);
+	return m_time;
 }
 
 // ----------------------------------------------------------------------------
-uint32_t MIDTrack::update(OPLPlayer& player)
+uint32_t MIDTrack::update(OPLPlayer& player, uint32_t time)
 {
 	if (m_initDelay && !m_pos)
 	{
-		m_delay = readDelay();
+		m_time = time + readDelay();
 	}
 	
-	if (m_useNoteDuration)
+	// release any notes that are done, earliest first
+	while (!m_notes.empty() && m_notes.front().time <= time)
 	{
-		for (int i = 0; i < m_notes.size();)
-		{
-			if (m_notes[i].delay <= 0)
-			{
-				player.midiNoteOff(m_notes[i].channel, m_notes[i].note);
-				m_notes[i] = m_notes.back();
-				m_notes.pop_back();
-			}	
-			else
-				i++;
-		}
+		player.midiNoteOff(m_notes.front().channel, m_notes.front().note);
+		std::pop_heap(m_notes.begin(), m_notes.end(), MIDNote::later);
+		m_notes.pop_back();
 	}
 	
-	while (m_delay <= 0)
+	while (m_time <= time)
 	{
 		uint8_t data[2];
 		MIDNote note;
@@ -123,8 +150,9 @@ uint32_t MIDTrack::update(OPLPlayer& player)
 			{
 				note.channel = m_status & 15;
 				note.note    = data[0];
-				note.delay   = readVLQ();
+				note.time    = time + readVLQ();
 				m_notes.push_back(note);
+				std::push_heap(m_notes.begin(), m_notes.end(), MIDNote::later);
 			}
 			break;
 		
@@ -144,7 +172,7 @@ uint32_t MIDTrack::update(OPLPlayer& player)
 			break;
 		
 		case 15: // sysex / meta event
-			if (!metaEvent(player))
+			if (!metaEvent(&player))
 			{			
 				m_atEnd = true;
 				return UINT_MAX;
@@ -152,14 +180,14 @@ uint32_t MIDTrack::update(OPLPlayer& player)
 			break;
 		}
 		
-		m_delay += readDelay();
+		m_time += readDelay();
 	}
 
-	return minDelay();
+	return nextTime();
 }
 
 // ----------------------------------------------------------------------------
-bool MIDTrack::metaEvent(OPLPlayer& player)
+bool MIDTrack::metaEvent(OPLPlayer *player)
 {
 	uint32_t len;
 	
@@ -168,8 +196,8 @@ bool MIDTrack::metaEvent(OPLPlayer& player)
 		len = readVLQ();
 		if (m_pos + len < m_size)
 		{
-			if (m_status == 0xf0)
-				player.midiSysEx(m_data + m_pos, len);
+			if (m_status == 0xf0 && player)
+				player->midiSysEx(m_data + m_pos, len);
 		}
 		else
 		{
@@ -187,7 +215,7 @@ bool MIDTrack::metaEvent(OPLPlayer& player)
 			return false;
 		}
 		// tempo change
-		if (data == 0x51)
+		if (data == 0x51 && player)
 		{
 			m_sequence->setTimePerBeat(READ_U24BE(m_data, m_pos));
 		}
@@ -201,16 +229,15 @@ bool MIDTrack::metaEvent(OPLPlayer& player)
 SequenceMID::SequenceMID()
 	: Sequence()
 {
-	m_type = 0;
-	m_ticksPerBeat = 24;
 	m_ticksPerSec = 48;
+	m_time = 0;
 }
 
 // ----------------------------------------------------------------------------
 SequenceMID::~SequenceMID()
 {
 	for (auto track : m_tracks)
-		delete track;
+		track->~MIDTrack();
 }
 
 // ----------------------------------------------------------------------------
@@ -239,8 +266,10 @@ bool SequenceMID::isValid(const uint8_t *data, size_t size)
 }
 
 // ----------------------------------------------------------------------------
-void SequenceMID::read(const uint8_t *data, size_t size)
+void SequenceMID::read(SequenceData& song, const uint8_t *data, size_t size)
 {
+	song.format = SequenceData::FormatMID;
+	
 	// need at least the MIDI header + one track header
 	if (size < 23)
 		return;
@@ -266,7 +295,7 @@ void SequenceMID::read(const uint8_t *data, size_t size)
 			if (!memcmp(bytes, "data", 4))
 			{
 				if (isValid(bytes + 8, chunkLen))
-					read(bytes + 8, chunkLen);
+					read(song, bytes + 8, chunkLen);
 				break;
 			}
 		}
@@ -275,9 +304,9 @@ void SequenceMID::read(const uint8_t *data, size_t size)
 	{
 		uint32_t len = READ_U32BE(data, 4);
 		
-		m_type = READ_U16BE(data, 8);
+		song.type = READ_U16BE(data, 8);
 		uint16_t numTracks = READ_U16BE(data, 10);
-		m_ticksPerBeat = READ_U16BE(data, 12);
+		song.ticksPerBeat = READ_U16BE(data, 12);
 		
 		uint32_t offset = len + 8;
 		for (unsigned i = 0; i < numTracks; i++)
@@ -298,19 +327,46 @@ void SequenceMID::read(const uint8_t *data, size_t size)
 				offset = size;
 			}
 			
-			m_tracks.push_back(new MIDTrack(bytes + 8, len, this));
+			song.tracks.push_back({bytes + 8, len});
 		}
 	}
 }
 
+// ----------------------------------------------------------------------------
+void SequenceMID::init()
+{
+	m_ticksPerSec = m_songData->ticksPerSec;
+	
+	m_tracks.reserve(m_songData->tracks.size());
+	m_queue.reserve(m_songData->tracks.size());
+	m_dueTracks.reserve(m_songData->tracks.size());
+	for (const auto& track : m_songData->tracks)
+	{
+		m_tracks.push_back(newTrack(track));
+		m_tracks.back()->reserveNotes();
+	}
+}
+
+// ----------------------------------------------------------------------------
+MIDTrack* SequenceMID::newTrack(const SequenceData::Track& track)
+{
+	return m_arena.create<MIDTrack>(track.data, track.size, this);
+}
+
 // ----------------------------------------------------------------------------
 void SequenceMID::reset()
 {
 	Sequence::reset();
 	setDefaults();
 	
-	for (auto& track : m_tracks)
-		track->reset();
+	// every track gets updated at the start
+	m_time = 0;
+	m_queue.clear();
+	for (unsigned i = 0; i < m_tracks.size(); i++)
+	{
+		m_tracks[i]->reset();
+		m_queue.push_back({0, i});
+	}
 }
 
 // ----------------------------------------------------------------------------
@@ -322,14 +378,14 @@ void SequenceMID::setDefaults()
 // ----------------------------------------------------------------------------
 void SequenceMID::setTimePerBeat(uint32_t usec)
 {
-	double usecPerTick = (double)usec / m_ticksPerBeat;
+	double usecPerTick = (double)usec / m_songData->ticksPerBeat;
 	m_ticksPerSec = 1000000 / usecPerTick;
 }
 
 // ----------------------------------------------------------------------------
 unsigned SequenceMID::numSongs() const
 {
-	if (m_type != 2)
+	if (m_songData->type != 2)
 		return 1;
 	else
 		return m_tracks.size();
@@ -338,22 +394,42 @@ unsigned SequenceMID::numSongs() const
 // ----------------------------------------------------------------------------
 uint32_t SequenceMID::update(OPLPlayer& player)
 {
-	uint32_t tickDelay = UINT_MAX;
+	uint32_t nextTime = UINT_MAX;
 	
 	bool tracksAtEnd = true;
 
-	if (m_type != 2)
+	if (m_songData->type != 2)
 	{
-		for (auto track : m_tracks)
+		// take all of the tracks with events that are due now (in order)...
+		typedef std::greater<std::pair<uint32_t, unsigned>> Later;
+		m_dueTracks.clear();
+		while (!m_queue.empty() && m_queue.front().first <= m_time)
+		{
+			m_dueTracks.push_back(m_queue.front().second);
+			std::pop_heap(m_queue.begin(), m_queue.end(), Later());
+			m_queue.pop_back();
+		}
+		
+		// ...then update them, and put them back in the queue until their next event
+		for (unsigned num : m_dueTracks)
+		{
+			const uint32_t time = m_tracks[num]->update(player, m_time);
+			if (m_tracks[num]->atEnd())
+				continue;
+			
+			m_queue.push_back({time, num});
+			std::push_heap(m_queue.begin(), m_queue.end(), Later());
+		}
+		
+		if (!m_queue.empty())
 		{
-			if (!track->atEnd())
-				tickDelay = std::min(tickDelay, track->update(player));
-			tracksAtEnd &= track->atEnd();
+			nextTime = m_queue.front().first;
+			tracksAtEnd = false;
 		}
 	}
 	else if (m_songNum < m_tracks.size())
 	{
-		tickDelay   = m_tracks[m_songNum]->update(player);
+		nextTime    = m_tracks[m_songNum]->update(player, m_time);
 		tracksAtEnd = m_tracks[m_songNum]->atEnd();
 	}
 	
@@ -366,8 +442,8 @@ uint32_t SequenceMID::update(OPLPlayer& player)
 	
 	m_atEnd = false;
 	
-	for (auto track : m_tracks)
-		track->advance(tickDelay);
+	const uint32_t tickDelay = nextTime - m_time;
+	m_time = nextTime;
 	
 	double samplesPerTick = player.sampleRate() / m_ticksPerSec;	
 	return round(tickDelay * samplesPerTick);
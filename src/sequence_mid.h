@@ -8,25 +8,31 @@ class SequenceMID;
 class MIDTrack
 {
 public:
+	// 'data' is used in place and must remain valid for the lifetime of the track
 	MIDTrack(const uint8_t *data, size_t size, SequenceMID* sequence);
 	virtual ~MIDTrack();
 	
 	void reset();
-	void advance(uint32_t time);
-	uint32_t update(OPLPlayer& player);
+	// preallocate space for any pending note offs, so that playback never has to allocate memory
+	// (called once when the sequence is loaded)
+	void reserveNotes();
+	// handle any events that are due at 'time' (in ticks since the start of the song),
+	// returning the time of the next one (or UINT_MAX at the end of the track)
+	uint32_t update(OPLPlayer& player, uint32_t time);
 	
 	bool atEnd() const { return m_atEnd; }
 	
 protected:
 	uint32_t readVLQ();
 	virtual uint32_t readDelay() { return readVLQ(); }
-	int32_t minDelay();
-	virtual bool metaEvent(OPLPlayer& player);
+	uint32_t nextTime() const;
+	// handle a sysex or meta event (or just skip it, if 'player' is null)
+	virtual bool metaEvent(OPLPlayer *player);
 
 	SequenceMID *m_sequence;
-	uint8_t *m_data;
+	const uint8_t *m_data;
 	uint32_t m_pos, m_size;
-	int32_t m_delay;
+	uint32_t m_time; // time of the next event
 	bool m_atEnd;
 	uint8_t m_status; // for MIDI running status
 	
@@ -38,8 +44,12 @@ protected:
 	struct MIDNote
 	{
 		uint8_t channel, note;
-		int32_t delay;
+		uint32_t time; // time of the note off
+		
+		// (for keeping the earliest note off first in m_notes)
+		static bool later(const MIDNote& a, const MIDNote& b) { return a.time > b.time; }
 	};
+	// notes waiting for a note off (if m_useNoteDuration is set), as a min-heap by time
 	std::vector<MIDNote> m_notes;
 };
 
@@ -57,16 +67,25 @@ public:
 	unsigned numSongs() const;
 	
 	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
 
 protected:
+	// create the playback state for a track (allocated from m_arena)
+	virtual MIDTrack* newTrack(const SequenceData::Track& track);
+	
 	std::vector<MIDTrack*> m_tracks;
 	
-	uint16_t m_type;
-	uint16_t m_ticksPerBeat;
-	double m_ticksPerSec;
+	// current time (in ticks), and the time of each track's next event, as a min-heap of
+	// {time, track number} pairs so that only tracks with events that are due get updated
+	// (and tracks with events at the same time are still updated in order)
+	uint32_t m_time;
+	std::vector<std::pair<uint32_t, unsigned>> m_queue;
+	std::vector<unsigned> m_dueTracks;
+	
+	double m_ticksPerSec; // current tempo
 
 private:
-	void read(const uint8_t *data, size_t size);
+	void init();
 	virtual void setDefaults();
 };
 
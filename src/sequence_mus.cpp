@@ -7,9 +7,8 @@
 SequenceMUS::SequenceMUS()
 	: Sequence()
 {
-	// cheap safety measure - fill the whole song buffer w/ "end of track" commands
-	// (m_pos is 16 bits, so a malformed track will either hit this or just wrap around)
-	memset(m_data, 0x60, sizeof(m_data));
+	m_data = nullptr;
+	m_size = 0;
 	setDefaults();
 }
 
@@ -22,8 +21,10 @@ bool SequenceMUS::isValid(const uint8_t *data, size_t size)
 }
 
 // ----------------------------------------------------------------------------
-void SequenceMUS::read(const uint8_t *data, size_t size)
+void SequenceMUS::read(SequenceData& song, const uint8_t *data, size_t size)
 {
+	song.format = SequenceData::FormatMUS;
+	
 	if (size > 8)
 	{
 		uint16_t length = data[4] | (data[5] << 8);
@@ -33,11 +34,21 @@ void SequenceMUS::read(const uint8_t *data, size_t size)
 		{
 			if (pos + length > size)
 				length = size - pos;
-			memcpy(m_data, data + pos, length);
+			song.tracks.push_back({data + pos, length});
 		}
 	}
 }
 
+// ----------------------------------------------------------------------------
+void SequenceMUS::init()
+{
+	if (!m_songData->tracks.empty())
+	{
+		m_data = m_songData->tracks[0].data;
+		m_size = m_songData->tracks[0].size;
+	}
+}
+
 // ----------------------------------------------------------------------------
 void SequenceMUS::reset()
 {
@@ -63,7 +74,7 @@ uint32_t SequenceMUS::update(OPLPlayer& player)
 	do
 	{
 		lastPos = m_pos;
-		event = m_data[m_pos++];
+		event = readByte();
 		channel = event & 0xf;
 		
 		// map MUS channels to MIDI channels
@@ -76,22 +87,22 @@ uint32_t SequenceMUS::update(OPLPlayer& player)
 		switch ((event >> 4) & 0x7)
 		{
 		case 0: // note off
-			player.midiNoteOff(channel, m_data[m_pos++]);
+			player.midiNoteOff(channel, readByte());
 			break;
 			
 		case 1: // note on
-			data = m_data[m_pos++];
+			data = readByte();
 			if (data & 0x80)
-				m_lastVol[channel] = m_data[m_pos++];
+				m_lastVol[channel] = readByte();
 			player.midiNoteOn(channel, data, m_lastVol[channel]);
 			break;
 		
 		case 2: // pitch bend
-			player.midiPitchControl(channel, (m_data[m_pos++] / 128.0) - 1.0);
+			player.midiPitchControl(channel, (readByte() / 128.0) - 1.0);
 			break;
 			
 		case 3: // system event (channel mode messages)
-			data = m_data[m_pos++] & 0x7f;
+			data = readByte() & 0x7f;
 			switch (data)
 			{
 			case 10: player.midiControlChange(channel, 120, 0); break; // all sounds off
@@ -104,8 +115,8 @@ uint32_t SequenceMUS::update(OPLPlayer& player)
 			break;
 		
 		case 4: // controller
-			data  = m_data[m_pos++] & 0x7f;
-			param = m_data[m_pos++];
+			data  = readByte() & 0x7f;
+			param = readByte();
 			// clamp CC param value - some tracks from tnt.wad have bad volume CCs
 			if (param > 0x7f)
 				param = 0x7f;
@@ -143,7 +154,7 @@ uint32_t SequenceMUS::update(OPLPlayer& player)
 	uint32_t tickDelay = 0;
 	do
 	{
-		event = m_data[m_pos++];
+		event = readByte();
 		tickDelay <<= 7;
 		tickDelay |= (event & 0x7f);
 	} while ((event & 0x80) && (m_pos > lastPos));
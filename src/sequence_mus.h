@@ -12,13 +12,24 @@ public:
 	uint32_t update(OPLPlayer& player);
 	
 	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
 	
 private:
-	void read(const uint8_t *data, size_t size);
+	void init();
 	void setDefaults();
 	
-	uint8_t m_data[1 << 16];
-	uint16_t m_pos;
+	// get the next byte of song data
+	// (anything past the end of the data is treated as an "end of track" command)
+	uint8_t readByte()
+	{
+		uint8_t data = (m_pos < m_size) ? m_data[m_pos] : 0x60;
+		m_pos++;
+		return data;
+	}
+	
+	const uint8_t *m_data;
+	uint16_t m_size;
+	uint16_t m_pos; // 16 bits, so a malformed track will either hit the end or just wrap around
 	uint8_t m_lastVol[16];
 };
 
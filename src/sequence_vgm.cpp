@@ -0,0 +1,181 @@
+#include "sequence_vgm.h"
+
+#include <cmath>
+#include <cstring>
+
+#define READ_U16LE(data, pos) ((data[pos+1] << 8) | data[pos])
+#define READ_U32LE(data, pos) ((data[pos+3] << 24) | (data[pos+2] << 16) | (data[pos+1] << 8) | data[pos])
+
+// ----------------------------------------------------------------------------
+static unsigned commandSize(const uint8_t *data, size_t size)
+{
+	const uint8_t cmd = data[0];
+	
+	if (cmd >= 0x30 && cmd <= 0x3f)
+		return 2;
+	if (cmd >= 0x40 && cmd <= 0x4e)
+		return 3;
+	if (cmd == 0x4f || cmd == 0x50)
+		return 2;
+	if (cmd >= 0x51 && cmd <= 0x5f)
+		return 3;
+	if (cmd >= 0x70 && cmd <= 0x8f)
+		return 1;
+	if (cmd >= 0xa0 && cmd <= 0xbf)
+		return 3;
+	if (cmd >= 0xc0 && cmd <= 0xdf)
+		return 4;
+	if (cmd >= 0xe0)
+		return 5;
+	
+	switch (cmd)
+	{
+	case 0x61: return 3;
+	case 0x62: case 0x63: case 0x66: return 1;
+	case 0x67: return (size >= 7) ? 7 + READ_U32LE(data, 3) : 7; // data block
+	case 0x68: return 12;
+	case 0x90: case 0x91: case 0x95: return 5;
+	case 0x92: return 6;
+	case 0x93: return 11;
+	case 0x94: return 2;
+	default:   return 0; // unknown
+	}
+}
+
+// ----------------------------------------------------------------------------
+SequenceVGM::SequenceVGM()
+	: Sequence()
+{
+	m_data = nullptr;
+	m_size = m_loopPos = 0;
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+bool SequenceVGM::isValid(const uint8_t *data, size_t size)
+{
+	if (size < 0x40)
+		return false;
+	return !memcmp(data, "Vgm ", 4);
+}
+
+// ----------------------------------------------------------------------------
+void SequenceVGM::read(SequenceData& song, const uint8_t *data, size_t size)
+{
+	song.format = SequenceData::FormatVGM;
+	song.ticksPerSec = 44100;
+	
+	uint32_t version = READ_U32LE(data, 0x08);
+	size_t start = 0x40;
+	if (version >= 0x150 && READ_U32LE(data, 0x34))
+		start = 0x34 + READ_U32LE(data, 0x34);
+	
+	size_t end = 0x04 + READ_U32LE(data, 0x04);
+	if (end > size || end <= 0x04)
+		end = size;
+	
+	// use the same hardware types as DRO files
+	// (the header only goes far enough to include YMF262 info if the data starts after it)
+	song.type = 2;
+	if (start >= 0x60 && !READ_U32LE(data, 0x5c) && READ_U32LE(data, 0x50))
+		song.type = (data[0x53] & 0x40) ? 1 : 0; // dual or single YM3812
+	
+	if (start >= end)
+		return;
+	song.tracks.push_back({data + start, end - start});
+	
+	// the part to loop (if any) is the second track
+	size_t loop = READ_U32LE(data, 0x1c);
+	if (loop)
+	{
+		loop += 0x1c;
+		if (loop >= start && loop < end)
+			song.tracks.push_back({data + loop, end - loop});
+	}
+}
+
+// ----------------------------------------------------------------------------
+void SequenceVGM::init()
+{
+	const auto& tracks = m_songData->tracks;
+	if (!tracks.empty())
+	{
+		m_data = tracks[0].data;
+		m_size = tracks[0].size;
+	}
+	if (tracks.size() > 1)
+		m_loopPos = tracks[1].data - tracks[0].data;
+}
+
+// ----------------------------------------------------------------------------
+void SequenceVGM::reset()
+{
+	Sequence::reset();
+	m_pos = 0;
+	m_setup = false;
+	m_time = m_outTime = 0;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t SequenceVGM::update(OPLPlayer& player)
+{
+	m_atEnd = false;
+	
+	if (!m_setup)
+	{
+		// play OPL2 data with the OPL3 features disabled
+		// (otherwise the OPL3 stereo bits would be left off)
+		if (m_songData->type < 2)
+			player.oplWrite(0, 0x105, 0);
+		if (m_songData->type == 1)
+			player.oplWrite(1, 0x105, 0);
+		m_setup = true;
+	}
+	
+	uint32_t delay = 0;
+	while (!delay)
+	{
+		const unsigned size = (m_pos < m_size) ? commandSize(m_data + m_pos, m_size - m_pos) : 0;
+		if (!size || m_pos + size > m_size || m_data[m_pos] == 0x66)
+		{
+			// end of data (or something we can't read)
+			if (m_loopPos)
+				m_pos = m_loopPos;
+			else
+				reset();
+			m_atEnd = true;
+			return 0;
+		}
+		
+		const uint8_t *cmd = m_data + m_pos;
+		m_pos += size;
+		
+		switch (cmd[0])
+		{
+		case 0x5a: player.oplWrite(0, cmd[1], cmd[2]); break; // YM3812
+		case 0xaa: player.oplWrite(1, cmd[1], cmd[2]); break;
+		case 0x5e: player.oplWrite(0, cmd[1], cmd[2]); break; // YMF262
+		case 0x5f: player.oplWrite(0, 0x100 | cmd[1], cmd[2]); break;
+		case 0xae: player.oplWrite(1, cmd[1], cmd[2]); break;
+		case 0xaf: player.oplWrite(1, 0x100 | cmd[1], cmd[2]); break;
+		
+		case 0x61: delay = READ_U16LE(cmd, 1); break;
+		case 0x62: delay = 735; break;
+		case 0x63: delay = 882; break;
+		
+		default:
+			if (cmd[0] >= 0x70 && cmd[0] <= 0x7f)
+				delay = (cmd[0] & 0xf) + 1;
+			else if (cmd[0] >= 0x80 && cmd[0] <= 0x8f)
+				delay = cmd[0] & 0xf; // (YM2612 DAC write + delay)
+			break;
+		}
+	}
+	
+	m_time += delay;
+	const uint64_t outTime = round(m_time * player.sampleRate() / m_songData->ticksPerSec);
+	delay = outTime - m_outTime;
+	m_outTime = outTime;
+	
+	return delay;
+}
@@ -0,0 +1,31 @@
+#ifndef __SEQUENCE_VGM_H
+#define __SEQUENCE_VGM_H
+
+#include "sequence.h"
+
+// plays back OPL2/OPL3 register writes from a VGM file directly
+// (any other chips' commands are skipped)
+class SequenceVGM : public Sequence
+{
+public:
+	SequenceVGM();
+	
+	void reset();
+	uint32_t update(OPLPlayer& player);
+	
+	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
+
+private:
+	void init();
+	
+	const uint8_t *m_data;
+	size_t m_size;
+	size_t m_pos, m_loopPos;
+	bool m_setup; // true after the chips have been set up for this data
+	
+	// playback time in VGM samples, and in output samples (to keep rounding from adding up)
+	uint64_t m_time, m_outTime;
+};
+
+#endif // __SEQUENCE_VGM_H
@@ -50,19 +50,21 @@ uint32_t XMITrack::readDelay()
 SequenceXMI::SequenceXMI()
 	: SequenceMID()
 {
-	m_type = 2;
-	m_ticksPerBeat = 0; // unused
-	m_ticksPerSec = 120;
 }
 
 // ----------------------------------------------------------------------------
 SequenceXMI::~SequenceXMI() {}
 
 // ----------------------------------------------------------------------------
-void SequenceXMI::read(const uint8_t *data, size_t size)
+void SequenceXMI::read(SequenceData& song, const uint8_t *data, size_t size)
 {
+	song.format = SequenceData::FormatXMI;
+	song.type = 2;
+	song.ticksPerBeat = 0; // unused
+	song.ticksPerSec = 120;
+	
 	uint32_t chunkSize;
-	while ((chunkSize = readRootChunk(data, size)) != 0)
+	while ((chunkSize = readRootChunk(song, data, size)) != 0)
 	{
 		data += chunkSize;
 		size -= chunkSize;
@@ -70,7 +72,7 @@ void SequenceXMI::read(const uint8_t *data, size_t size)
 }
 
 // ----------------------------------------------------------------------------
-uint32_t SequenceXMI::readRootChunk(const uint8_t *data, size_t size)
+uint32_t SequenceXMI::readRootChunk(SequenceData& song, const uint8_t *data, size_t size)
 {
 	// need at least a root chunk and one subchunk (and its contents)
 	if (size > 12 + 8)
@@ -104,14 +106,14 @@ uint32_t SequenceXMI::readRootChunk(const uint8_t *data, size_t size)
 				}
 				
 				if (!memcmp(bytes, "EVNT", 4))
-					m_tracks.push_back(new XMITrack(bytes + 8, chunkLen, this));
+					song.tracks.push_back({bytes + 8, chunkLen});
 			}
 		}
 		else if (!memcmp(data, "CAT ", 4))
 		{
 			while (offset < rootEnd)
 			{
-				offset += readRootChunk(data + offset, size - offset);
+				offset += readRootChunk(song, data + offset, size - offset);
 			}
 		}
 		
@@ -121,6 +123,12 @@ uint32_t SequenceXMI::readRootChunk(const uint8_t *data, size_t size)
 	return 0;
 }
 
+// ----------------------------------------------------------------------------
+MIDTrack* SequenceXMI::newTrack(const SequenceData::Track& track)
+{
+	return m_arena.create<XMITrack>(track.data, track.size, this);
+}
+
 // ----------------------------------------------------------------------------
 bool SequenceXMI::isValid(const uint8_t *data, size_t size)
 {
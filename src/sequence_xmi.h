@@ -12,10 +12,13 @@ public:
 	void setTimePerBeat(uint32_t usec);
 	
 	static bool isValid(const uint8_t *data, size_t size);
+	static void read(SequenceData& song, const uint8_t *data, size_t size);
+	
+protected:
+	MIDTrack* newTrack(const SequenceData::Track& track);
 	
 private:
-	void read(const uint8_t *data, size_t size);
-	uint32_t readRootChunk(const uint8_t *data, size_t size);
+	static uint32_t readRootChunk(SequenceData& song, const uint8_t *data, size_t size);
 };
 
 #endif // __SEQUENCE_XMI_H
@@ -0,0 +1,185 @@
+#include "tap.h"
+#include "fixed.h"
+
+#include <algorithm>
+#include <cstring>
+
+// ----------------------------------------------------------------------------
+OPLOutputTap::OPLOutputTap(uint32_t chipRate, uint32_t sampleRate)
+{
+	m_sampleRate = sampleRate;
+	m_sampleStep = (double)sampleRate / chipRate;
+	m_phaseStep = OPLFixed::step(sampleRate, chipRate);
+	m_numChannels = 2;
+	m_fixedPoint = false;
+	
+	setGain(1.0);
+	setFilter(5.0);
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::setGain(double gain)
+{
+	m_gain = gain;
+	m_gainFixed = OPLFixed::gain(gain, m_phaseStep);
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::setFilter(double cutoff)
+{
+	if (cutoff <= 0.0)
+	{
+		m_hpFilterCoef = 1.0;
+	}
+	else
+	{
+		static const double pi = 3.14159265358979323846;
+		m_hpFilterCoef = 1.0 / ((2 * pi * cutoff) / m_sampleRate + 1);
+	}
+	m_hpFilterCoefFixed = OPLFixed::filterCoef(cutoff, m_sampleRate);
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::setMono(bool on)
+{
+	m_numChannels = on ? 1 : 2;
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::setFixedPoint(bool on)
+{
+	m_fixedPoint = on;
+	reset();
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::reset()
+{
+	m_samplePos = 0.0;
+	m_phase = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		m_output[i] = m_lastOut[i] = 0;
+		m_hpLastIn[i] = m_hpLastOut[i] = 0;
+	}
+	
+	m_buffer.clear();
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::input(const int32_t samples[2])
+{
+	if (m_fixedPoint)
+	{
+		inputFixed(samples);
+		return;
+	}
+	
+	// this works the same way as the player's own 16-bit output
+	// (see OPLPlayer::updateMIDI and OPLPlayer::generate), one OPL sample at a time
+	m_samplePos += m_sampleStep;
+	
+	if (m_samplePos <= 1.0 || m_sampleStep > 1.0)
+	{
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			m_output[i] += samples[i];
+			m_lastOut[i] = 0;
+		}
+	}
+	else
+	{
+		const double remainder = (m_samplePos - (int)m_samplePos) / m_sampleStep;
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			m_output[i] += samples[i] * (1 - remainder);
+			m_lastOut[i] = samples[i] * remainder;
+		}
+	}
+	
+	if (m_samplePos < 1.0)
+		return;
+	
+	const double step = std::min(m_sampleStep, 1.0);
+	for (unsigned i = 0; i < m_numChannels; i++)
+		m_output[i] *= m_gain * step;
+	
+	while (m_samplePos >= 1.0)
+	{
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			if (m_hpFilterCoef < 1.0)
+			{
+				const int32_t lastIn = m_hpLastIn[i];
+				m_hpLastIn[i] = m_output[i];
+				
+				m_hpLastOut[i] = m_hpFilterCoef * (m_hpLastOut[i] + m_output[i] - lastIn);
+				m_output[i] = m_hpLastOut[i];
+			}
+			
+			m_buffer.push_back(std::min(std::max(m_output[i], -32768), 32767));
+		}
+		m_samplePos -= 1.0;
+	}
+	
+	// start the next output sample with what's left of this input sample
+	for (unsigned i = 0; i < m_numChannels; i++)
+		m_output[i] = m_lastOut[i];
+}
+
+// ----------------------------------------------------------------------------
+void OPLOutputTap::inputFixed(const int32_t samples[2])
+{
+	// (see OPLPlayer::updateMIDIFixed and OPLPlayer::renderFixed)
+	m_phase += m_phaseStep;
+	
+	if (m_phase <= OPLFixed::one || m_phaseStep > OPLFixed::one)
+	{
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			m_output[i] += samples[i];
+			m_lastOut[i] = 0;
+		}
+	}
+	else
+	{
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			m_lastOut[i] = OPLFixed::remainder(samples[i], m_phase, m_phaseStep);
+			m_output[i] += samples[i] - m_lastOut[i];
+		}
+	}
+	
+	if (m_phase < OPLFixed::one)
+		return;
+	
+	for (unsigned i = 0; i < m_numChannels; i++)
+		m_output[i] = OPLFixed::scale(m_output[i], m_gainFixed);
+	
+	while (m_phase >= OPLFixed::one)
+	{
+		for (unsigned i = 0; i < m_numChannels; i++)
+		{
+			if (m_hpFilterCoefFixed < OPLFixed::filterOne)
+				m_output[i] = OPLFixed::filter(m_output[i], m_hpLastIn[i], m_hpLastOut[i], m_hpFilterCoefFixed);
+			
+			m_buffer.push_back(std::min(std::max(m_output[i], -32768), 32767));
+		}
+		m_phase -= OPLFixed::one;
+	}
+	
+	for (unsigned i = 0; i < m_numChannels; i++)
+		m_output[i] = m_lastOut[i];
+}
+
+// ----------------------------------------------------------------------------
+unsigned OPLOutputTap::read(int16_t *data, unsigned maxSamples)
+{
+	const unsigned count = std::min(maxSamples, available());
+	memcpy(data, m_buffer.data(), count * m_numChannels * sizeof(int16_t));
+	m_buffer.erase(m_buffer.begin(), m_buffer.begin() + count * m_numChannels);
+	
+	return count;
+}
@@ -0,0 +1,55 @@
+#ifndef __TAP_H
+#define __TAP_H
+
+#include <cstdint>
+#include <vector>
+
+// an extra output for an OPLPlayer at another sample rate (see OPLPlayer::addTap).
+// it has its own resampling and highpass filter state, but is fed by the same chips as the player's
+// main output, so any number of sample rates can be rendered with a single pass of chip emulation
+class OPLOutputTap
+{
+public:
+	OPLOutputTap(uint32_t chipRate, uint32_t sampleRate);
+	
+	void setGain(double gain);
+	void setFilter(double cutoff);
+	// output one channel instead of two (see OPLPlayer::setMonoOutput)
+	void setMono(bool on);
+	// use fixed-point resampling and filtering (see OPLPlayer::setFixedPoint)
+	void setFixedPoint(bool on);
+	
+	// reset resampling/filter state and discard any buffered output
+	void reset();
+	
+	// resample the next OPL sample of combined chip output
+	// (only the left channel is used for mono output)
+	void input(const int32_t samples[2]);
+	
+	// read buffered output (16-bit stereo or mono), returning the number of samples read
+	unsigned read(int16_t *data, unsigned maxSamples);
+	unsigned available() const { return m_buffer.size() / m_numChannels; }
+	
+	uint32_t sampleRate() const { return m_sampleRate; }
+
+private:
+	void inputFixed(const int32_t samples[2]);
+	
+	uint32_t m_sampleRate;
+	unsigned m_numChannels;
+	double m_sampleStep, m_samplePos;
+	double m_gain;
+	
+	int32_t m_output[2], m_lastOut[2];
+	double m_hpFilterCoef;
+	int32_t m_hpLastIn[2], m_hpLastOut[2];
+	
+	// fixed-point versions of the above (see fixed.h)
+	bool m_fixedPoint;
+	uint64_t m_phaseStep, m_phase;
+	int64_t m_gainFixed, m_hpFilterCoefFixed;
+	
+	std::vector<int16_t> m_buffer;
+};
+
+#endif // __TAP_H
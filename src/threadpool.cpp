@@ -0,0 +1,76 @@
+#include "threadpool.h"
+
+// ----------------------------------------------------------------------------
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+	if (!numThreads)
+		numThreads = defaultThreads();
+	
+	m_busy = 0;
+	m_quit = false;
+	
+	for (unsigned i = 0; i < numThreads; i++)
+		m_threads.emplace_back(&ThreadPool::worker, this);
+}
+
+// ----------------------------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_jobReady.notify_all();
+	
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+// ----------------------------------------------------------------------------
+unsigned ThreadPool::defaultThreads()
+{
+	unsigned numThreads = std::thread::hardware_concurrency();
+	return numThreads ? numThreads : 1;
+}
+
+// ----------------------------------------------------------------------------
+void ThreadPool::run(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push(std::move(job));
+	}
+	m_jobReady.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_jobsDone.wait(lock, [this] { return m_jobs.empty() && !m_busy; });
+}
+
+// ----------------------------------------------------------------------------
+void ThreadPool::worker()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	
+	while (true)
+	{
+		m_jobReady.wait(lock, [this] { return m_quit || !m_jobs.empty(); });
+		if (m_jobs.empty())
+			return; // quitting and nothing left to do
+		
+		auto job = std::move(m_jobs.front());
+		m_jobs.pop();
+		m_busy++;
+		
+		lock.unlock();
+		job();
+		lock.lock();
+		
+		m_busy--;
+		if (m_jobs.empty() && !m_busy)
+			m_jobsDone.notify_all();
+	}
+}
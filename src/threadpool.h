@@ -0,0 +1,40 @@
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// if 'numThreads' is 0, one thread per available CPU core will be used
+	ThreadPool(unsigned numThreads = 0);
+	~ThreadPool();
+
+	// queue a job to be run on one of the pool's threads
+	void run(std::function<void()> job);
+	// wait for all queued jobs to finish
+	void wait();
+
+	unsigned numThreads() const { return m_threads.size(); }
+
+	// number of threads to use when 0 is requested
+	static unsigned defaultThreads();
+
+private:
+	void worker();
+
+	std::vector<std::thread> m_threads;
+	std::queue<std::function<void()>> m_jobs;
+	unsigned m_busy;
+	bool m_quit;
+
+	std::mutex m_mutex;
+	std::condition_variable m_jobReady, m_jobsDone;
+};
+
+#endif // __THREADPOOL_H
@@ -0,0 +1,333 @@
+#include "trace.h"
+#include "player.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+static const char traceMagic[16] = "YMFMIDI-TRACE";
+static const uint16_t traceVersion = 1;
+static const unsigned traceHeaderSize = 24;
+
+// ----------------------------------------------------------------------------
+static uint64_t readVarLen(const std::vector<uint8_t>& data, size_t& pos)
+{
+	uint64_t value = 0;
+	uint8_t byte = 0;
+	
+	do
+	{
+		if (pos >= data.size())
+			break;
+		byte = data[pos++];
+		value = (value << 7) | (byte & 0x7f);
+	} while (byte & 0x80);
+	
+	return value;
+}
+
+// ----------------------------------------------------------------------------
+MIDITrace::MIDITrace()
+{
+	m_sampleRate = 0;
+	m_lastTime = 0;
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::start(uint64_t time, uint32_t sampleRate)
+{
+	m_data.clear();
+	m_sampleRate = sampleRate;
+	m_lastTime = time;
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::stop(uint64_t time)
+{
+	writeDelay(time);
+	m_data.push_back(EventEnd);
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::writeVarLen(uint64_t value)
+{
+	uint8_t bytes[10];
+	unsigned count = 0;
+	
+	do
+	{
+		bytes[count++] = value & 0x7f;
+		value >>= 7;
+	} while (value);
+	
+	// most significant bits first, with the high bit set on all but the last byte
+	while (count--)
+		m_data.push_back(bytes[count] | (count ? 0x80 : 0));
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::writeDelay(uint64_t time)
+{
+	writeVarLen(time > m_lastTime ? time - m_lastTime : 0);
+	m_lastTime = std::max(time, m_lastTime);
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::event(uint64_t time, uint8_t status, uint8_t data0, uint8_t data1)
+{
+	writeDelay(time);
+	m_data.push_back(status);
+	m_data.push_back(data0);
+	// program change and channel pressure only have one data byte
+	if ((status & 0xe0) != 0xc0)
+		m_data.push_back(data1);
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::pitch(uint64_t time, uint8_t channel, double pitch)
+{
+	// use a regular pitch bend message if it's exactly the same value
+	const double bend = (pitch + 1.0) * 8192;
+	if (bend >= 0 && bend <= 0x3fff && bend == floor(bend))
+	{
+		event(time, 0xe0 | (channel & 15), (int)bend & 0x7f, (int)bend >> 7);
+		return;
+	}
+	
+	uint64_t bits;
+	memcpy(&bits, &pitch, sizeof(double));
+	
+	writeDelay(time);
+	m_data.push_back(EventPitch);
+	m_data.push_back(channel);
+	for (unsigned i = 0; i < 8; i++)
+		m_data.push_back(bits >> (8 * i));
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::sysEx(uint64_t time, const uint8_t *data, uint32_t length)
+{
+	if (length > 0 && data[0] == 0xF0)
+	{
+		data++;
+		length--;
+	}
+	
+	writeDelay(time);
+	m_data.push_back(EventSysEx);
+	writeVarLen(length);
+	m_data.insert(m_data.end(), data, data + length);
+}
+
+// ----------------------------------------------------------------------------
+void MIDITrace::reset(uint64_t time)
+{
+	writeDelay(time);
+	m_data.push_back(EventReset);
+}
+
+// ----------------------------------------------------------------------------
+bool MIDITrace::load(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+	
+	bool ok = load(file);
+	
+	fclose(file);
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+bool MIDITrace::load(FILE *file)
+{
+	uint8_t header[traceHeaderSize];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header)
+	    || memcmp(header, traceMagic, sizeof(traceMagic))
+	    || (header[16] | (header[17] << 8)) != traceVersion)
+		return false;
+	
+	m_sampleRate = header[20] | (header[21] << 8) | (header[22] << 16) | (header[23] << 24);
+	m_lastTime = 0;
+	m_data.clear();
+	
+	uint8_t buf[4096];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), file)) > 0)
+		m_data.insert(m_data.end(), buf, buf + size);
+	
+	return !ferror(file);
+}
+
+// ----------------------------------------------------------------------------
+bool MIDITrace::save(const char *path) const
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	
+	bool ok = save(file);
+	
+	ok &= !fclose(file);
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+bool MIDITrace::save(FILE *file) const
+{
+	uint8_t header[traceHeaderSize] = {0};
+	memcpy(header, traceMagic, sizeof(traceMagic));
+	header[16] = traceVersion;
+	header[17] = traceVersion >> 8;
+	for (unsigned i = 0; i < 4; i++)
+		header[20 + i] = m_sampleRate >> (8 * i);
+	
+	return fwrite(header, 1, sizeof(header), file) == sizeof(header)
+		&& fwrite(m_data.data(), 1, m_data.size(), file) == m_data.size();
+}
+
+// ----------------------------------------------------------------------------
+MIDIReplay::MIDIReplay(const MIDITrace& trace)
+	: m_trace(trace)
+{
+	rewind();
+}
+
+// ----------------------------------------------------------------------------
+void MIDIReplay::rewind()
+{
+	m_pos = 0;
+	m_eventTime = m_outTime = 0;
+	m_samplesLeft = 0;
+	readDelay();
+}
+
+// ----------------------------------------------------------------------------
+void MIDIReplay::readDelay()
+{
+	m_eventTime += readVarLen(m_trace.m_data, m_pos);
+}
+
+// ----------------------------------------------------------------------------
+bool MIDIReplay::atEnd() const
+{
+	return m_pos >= m_trace.m_data.size() && !m_samplesLeft;
+}
+
+// ----------------------------------------------------------------------------
+uint32_t MIDIReplay::update(OPLPlayer& player)
+{
+	const std::vector<uint8_t>& data = m_trace.m_data;
+	// convert event times if the trace was recorded at a different sample rate
+	const double ratio = m_trace.sampleRate() ? (double)player.sampleRate() / m_trace.sampleRate() : 1.0;
+	
+	while (m_pos < data.size())
+	{
+		const uint64_t eventTime = round(m_eventTime * ratio);
+		if (eventTime > m_outTime)
+		{
+			const uint32_t delay = std::min(eventTime - m_outTime, (uint64_t)UINT32_MAX);
+			m_outTime += delay;
+			return delay;
+		}
+		
+		const uint8_t status = data[m_pos++];
+		if (status >= 0x80 && status < 0xf0)
+		{
+			const unsigned length = ((status & 0xe0) == 0xc0) ? 1 : 2;
+			if (m_pos + length > data.size())
+				break;
+			
+			player.midiEvent(status, data[m_pos], length > 1 ? data[m_pos+1] : 0);
+			m_pos += length;
+		}
+		else if (status == MIDITrace::EventSysEx)
+		{
+			const uint64_t length = readVarLen(data, m_pos);
+			if (length > data.size() - m_pos)
+				break;
+			
+			player.midiSysEx(&data[m_pos], length);
+			m_pos += length;
+		}
+		else if (status == MIDITrace::EventPitch)
+		{
+			if (m_pos + 9 > data.size())
+				break;
+			
+			uint64_t bits = 0;
+			for (unsigned i = 0; i < 8; i++)
+				bits |= (uint64_t)data[m_pos + 1 + i] << (8 * i);
+			double pitch;
+			memcpy(&pitch, &bits, sizeof(double));
+			
+			player.midiPitchControl(data[m_pos], pitch);
+			m_pos += 9;
+		}
+		else if (status == MIDITrace::EventReset)
+		{
+			player.reset();
+		}
+		else
+		{
+			// end of trace (or invalid data)
+			break;
+		}
+		
+		readDelay();
+	}
+	
+	m_pos = data.size();
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+unsigned MIDIReplay::generate(OPLPlayer& player, int16_t *data, unsigned numSamples)
+{
+	unsigned samplesDone = 0;
+	
+	while (samplesDone < numSamples)
+	{
+		if (!m_samplesLeft)
+		{
+			m_samplesLeft = update(player);
+			if (!m_samplesLeft)
+				break;
+		}
+		
+		const unsigned count = std::min(numSamples - samplesDone, m_samplesLeft);
+		player.generate(data + samplesDone * (player.monoOutput() ? 1 : 2), count);
+		samplesDone += count;
+		m_samplesLeft -= count;
+	}
+	
+	return samplesDone;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t MIDIReplay::run(OPLPlayer& player, OutputFunc output, bool realTime, unsigned blockSize)
+{
+	std::vector<int16_t> buffer(std::max(blockSize, 1u) * 2);
+	const auto startTime = std::chrono::steady_clock::now();
+	uint64_t samplesDone = 0;
+	
+	while (!atEnd())
+	{
+		const unsigned count = generate(player, buffer.data(), buffer.size() / 2);
+		samplesDone += count;
+		
+		if (count && !output(buffer.data(), count))
+			break;
+		
+		if (realTime)
+		{
+			// don't get ahead of the time it took to play the output originally
+			std::this_thread::sleep_until(startTime
+				+ std::chrono::microseconds(samplesDone * 1000000 / player.sampleRate()));
+		}
+	}
+	
+	return samplesDone;
+}
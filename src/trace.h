@@ -0,0 +1,105 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+class OPLPlayer;
+
+// a compact recording of every MIDI event sent to a player (see OPLPlayer::setTrace),
+// timestamped with the number of output samples the player had generated at the time.
+// events are stored as a delay (in the same variable-length format as MIDI files)
+// followed by a MIDI message, or one of a few extra event types for things MIDI can't represent
+class MIDITrace
+{
+public:
+	MIDITrace();
+	
+	// start a new recording, discarding any existing events
+	void start(uint64_t time, uint32_t sampleRate);
+	// mark the end of the recording (so that a replay lasts as long as the original)
+	void stop(uint64_t time);
+	
+	// record a single event, with the player's current output time
+	void event(uint64_t time, uint8_t status, uint8_t data0, uint8_t data1 = 0);
+	void pitch(uint64_t time, uint8_t channel, double pitch);
+	void sysEx(uint64_t time, const uint8_t *data, uint32_t length);
+	void reset(uint64_t time);
+	
+	bool load(const char *path);
+	bool load(FILE *file);
+	bool save(const char *path) const;
+	bool save(FILE *file) const;
+	
+	// sample rate of the player that recorded this trace
+	uint32_t sampleRate() const { return m_sampleRate; }
+	// size of the recorded event data, in bytes
+	size_t size() const { return m_data.size(); }
+
+private:
+	friend class MIDIReplay;
+	
+	enum
+	{
+		EventSysEx = 0xF0, // followed by length and data
+		EventPitch = 0xF4, // channel and 64-bit double (for values that don't fit in a pitch bend message)
+		EventReset = 0xFE,
+		EventEnd   = 0xFF
+	};
+	
+	void writeDelay(uint64_t time);
+	void writeVarLen(uint64_t value);
+	
+	std::vector<uint8_t> m_data;
+	uint32_t m_sampleRate;
+	uint64_t m_lastTime;
+};
+
+// sends the events in a trace to a player at the same times they were originally sent,
+// as if they were being sent to it live (the player shouldn't have a song loaded)
+class MIDIReplay
+{
+public:
+	// called with each block of rendered output (16-bit stereo, or mono; see OPLPlayer::setMonoOutput)
+	// return false to stop replaying early
+	typedef std::function<bool(const int16_t *data, unsigned numSamples)> OutputFunc;
+	
+	// the trace must remain valid for as long as it's being replayed
+	MIDIReplay(const MIDITrace& trace);
+	
+	// restart from the beginning of the trace
+	void rewind();
+	
+	// send all events that are due now, without generating any output.
+	// returns the number of output samples until the next event(s), or 0 at the end of the trace.
+	// calling this repeatedly sends all events as fast as possible (e.g. to benchmark event handling by itself)
+	uint32_t update(OPLPlayer& player);
+	
+	// generate output while sending events at the right times.
+	// returns the number of samples generated, which is less than 'numSamples' only at the end of the trace
+	unsigned generate(OPLPlayer& player, int16_t *data, unsigned numSamples);
+	
+	// replay the rest of the trace, in blocks of 'blockSize' samples.
+	// if 'realTime' is true, output is paced to match the player's sample rate;
+	// otherwise the trace is replayed as fast as possible.
+	// returns the number of output samples rendered
+	uint64_t run(OPLPlayer& player, OutputFunc output, bool realTime = false, unsigned blockSize = 1024);
+	
+	bool atEnd() const;
+
+private:
+	// read the delay before the next event, if there is one
+	void readDelay();
+	
+	const MIDITrace& m_trace;
+	size_t m_pos;
+	
+	// time of the next event (in the trace's own sample rate),
+	// and the number of output samples generated so far
+	uint64_t m_eventTime, m_outTime;
+	uint32_t m_samplesLeft; // until the next event(s)
+};
+
+#endif // __TRACE_H
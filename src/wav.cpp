@@ -0,0 +1,271 @@
+#include "wav.h"
+
+#include <algorithm>
+#include <cstring>
+
+// ----------------------------------------------------------------------------
+WAVWriter::WAVWriter()
+{
+	m_file = nullptr;
+	m_raw = false;
+	m_sampleRate = 0;
+	m_bytesPerSample = 0;
+	m_numSamples = 0;
+}
+
+// ----------------------------------------------------------------------------
+WAVWriter::~WAVWriter()
+{
+	close();
+}
+
+// ----------------------------------------------------------------------------
+bool WAVWriter::open(const char *path, uint32_t sampleRate, bool stereo)
+{
+	close();
+	
+	m_file = fopen(path, "wb");
+	if (!m_file)
+		return false;
+	
+	m_raw = false;
+	m_sampleRate = sampleRate;
+	m_bytesPerSample = stereo ? 4 : 2;
+	m_numSamples = 0;
+	
+	// leave room for the header until we know how much data there is
+	fseek(m_file, 44, SEEK_SET);
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool WAVWriter::open(FILE *file, bool stereo)
+{
+	close();
+	
+	if (!file)
+		return false;
+	
+	m_file = file;
+	m_raw = true;
+	m_sampleRate = 0;
+	m_bytesPerSample = stereo ? 4 : 2;
+	m_numSamples = 0;
+	
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool WAVWriter::write(const int16_t *data, unsigned numSamples)
+{
+	if (!m_file)
+		return false;
+	
+	char outSamples[4 * 256];
+	unsigned pos = 0;
+	
+	const unsigned count = numSamples * m_bytesPerSample / 2;
+	for (unsigned i = 0; i < count; i++)
+	{
+		outSamples[pos++] = data[i];
+		outSamples[pos++] = data[i] >> 8;
+		
+		if (pos == sizeof(outSamples) || i == count - 1)
+		{
+			if (fwrite(outSamples, 1, pos, m_file) != pos)
+				return false;
+			pos = 0;
+		}
+	}
+	
+	m_numSamples += numSamples;
+	if (m_raw)
+		return !fflush(m_file);
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+bool WAVWriter::close()
+{
+	if (!m_file)
+		return false;
+	
+	if (m_raw)
+	{
+		bool ok = !fflush(m_file);
+		m_file = nullptr;
+		return ok;
+	}
+	
+	// fill in the rendered sample size and write the header
+	const uint32_t byteRate = m_sampleRate * m_bytesPerSample;
+	const uint32_t dataSize = m_numSamples * m_bytesPerSample;
+	const uint32_t wavSize = dataSize + 36;
+	
+	char header[44] = {0};
+	
+	header[0] = 'R';
+	header[1] = 'I';
+	header[2] = 'F';
+	header[3] = 'F';
+	header[4] = (char)(wavSize);
+	header[5] = (char)(wavSize >> 8);
+	header[6] = (char)(wavSize >> 16);
+	header[7] = (char)(wavSize >> 24);
+	header[8]  = 'W';
+	header[9]  = 'A';
+	header[10] = 'V';
+	header[11] = 'E';
+	
+	// format chunk
+	header[12] = 'f';
+	header[13] = 'm';
+	header[14] = 't';
+	header[15] = ' ';
+	header[16] = 16; // chunk size
+	header[20] = 1;  // sample format (PCM)
+	if (m_bytesPerSample == 4)
+		header[22] = 2;  // stereo
+	else
+		header[22] = 1;  // mono
+	header[24] = (char)(m_sampleRate);
+	header[25] = (char)(m_sampleRate >> 8);
+	header[26] = (char)(m_sampleRate >> 16);
+	header[27] = (char)(m_sampleRate >> 24);
+	header[28] = (char)(byteRate);
+	header[29] = (char)(byteRate >> 8);
+	header[30] = (char)(byteRate >> 16);
+	header[31] = (char)(byteRate >> 24);
+	header[32] = m_bytesPerSample; // bytes per sample frame
+	header[34] = 16; // bits per sample
+	
+	// data chunk
+	header[36] = 'd';
+	header[37] = 'a';
+	header[38] = 't';
+	header[39] = 'a';
+	header[40] = (char)(dataSize);
+	header[41] = (char)(dataSize >> 8);
+	header[42] = (char)(dataSize >> 16);
+	header[43] = (char)(dataSize >> 24);
+	
+	fseek(m_file, 0, SEEK_SET);
+	bool ok = (fwrite(header, 1, sizeof(header), m_file) == sizeof(header));
+	
+	ok &= !fclose(m_file);
+	m_file = nullptr;
+	
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+WAVReader::WAVReader()
+{
+	m_file = nullptr;
+	m_sampleRate = 0;
+	m_bytesPerSample = 0;
+	m_numSamples = m_samplesLeft = 0;
+}
+
+// ----------------------------------------------------------------------------
+WAVReader::~WAVReader()
+{
+	close();
+}
+
+// ----------------------------------------------------------------------------
+bool WAVReader::open(const char *path)
+{
+	close();
+	
+	m_file = fopen(path, "rb");
+	if (!m_file)
+		return false;
+	
+	uint8_t header[12];
+	if (fread(header, 1, sizeof(header), m_file) != sizeof(header)
+	    || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+	{
+		close();
+		return false;
+	}
+	
+	// find the format and data chunks
+	while (fread(header, 1, 8, m_file) == 8)
+	{
+		const uint32_t size = header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24);
+		
+		if (!memcmp(header, "fmt ", 4) && size >= 16)
+		{
+			uint8_t format[16];
+			if (fread(format, 1, 16, m_file) != 16)
+				break;
+			
+			// only 16-bit mono/stereo PCM is supported
+			const unsigned channels = format[2] | (format[3] << 8);
+			if ((format[0] | (format[1] << 8)) != 1 || (format[14] | (format[15] << 8)) != 16
+			    || channels < 1 || channels > 2)
+				break;
+			
+			m_sampleRate = format[4] | (format[5] << 8) | (format[6] << 16) | (format[7] << 24);
+			m_bytesPerSample = channels * 2;
+			fseek(m_file, (size - 16 + 1) & ~1, SEEK_CUR);
+		}
+		else if (!memcmp(header, "data", 4) && m_bytesPerSample)
+		{
+			m_numSamples = m_samplesLeft = size / m_bytesPerSample;
+			return true;
+		}
+		else
+		{
+			// skip other chunks (which are padded to an even size)
+			fseek(m_file, (size + 1) & ~1, SEEK_CUR);
+		}
+	}
+	
+	close();
+	return false;
+}
+
+// ----------------------------------------------------------------------------
+unsigned WAVReader::read(int16_t *data, unsigned numSamples)
+{
+	if (!m_file)
+		return 0;
+	
+	uint8_t inSamples[4 * 256];
+	unsigned count = 0;
+	
+	numSamples = std::min(numSamples, m_samplesLeft);
+	while (count < numSamples)
+	{
+		const unsigned block = std::min(numSamples - count, 256u);
+		if (fread(inSamples, m_bytesPerSample, block, m_file) != block)
+			break;
+		
+		for (unsigned i = 0; i < block; i++, count++)
+		{
+			const uint8_t *bytes = inSamples + i * m_bytesPerSample;
+			data[count*2] = bytes[0] | (bytes[1] << 8);
+			if (m_bytesPerSample == 4)
+				data[count*2+1] = bytes[2] | (bytes[3] << 8);
+			else
+				data[count*2+1] = data[count*2];
+		}
+	}
+	
+	m_samplesLeft -= count;
+	return count;
+}
+
+// ----------------------------------------------------------------------------
+void WAVReader::close()
+{
+	if (m_file)
+		fclose(m_file);
+	
+	m_file = nullptr;
+	m_sampleRate = 0;
+	m_bytesPerSample = 0;
+	m_numSamples = m_samplesLeft = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __WAV_H
+#define __WAV_H
+
+#include <cstdint>
+#include <cstdio>
+
+class WAVWriter
+{
+public:
+	WAVWriter();
+	~WAVWriter();
+
+	// start writing a new 16-bit WAV file (mono or stereo)
+	bool open(const char *path, uint32_t sampleRate, bool stereo = true);
+	// start writing headerless 16-bit PCM to an already open stream (e.g. stdout),
+	// which is flushed after each write and left open afterwards
+	bool open(FILE *file, bool stereo = true);
+	// write a block of samples, in the format produced by OPLPlayer::generate
+	// (stereo, or mono for mono files; see OPLPlayer::setMonoOutput)
+	bool write(const int16_t *data, unsigned numSamples);
+	// fill in the WAV header and close the file (or just flush a raw stream)
+	bool close();
+
+	uint32_t numSamples() const { return m_numSamples; }
+	bool isOpen() const { return m_file != nullptr; }
+
+private:
+	FILE *m_file;
+	bool m_raw;
+	uint32_t m_sampleRate;
+	unsigned m_bytesPerSample;
+	uint32_t m_numSamples;
+};
+
+// reads back 16-bit WAV files (e.g. for comparing new output to a previously rendered file)
+class WAVReader
+{
+public:
+	WAVReader();
+	~WAVReader();
+	
+	bool open(const char *path);
+	// read a block of samples, always in stereo format
+	// (for mono files, both channels are the same).
+	// returns the number of samples actually read
+	unsigned read(int16_t *data, unsigned numSamples);
+	void close();
+	
+	uint32_t sampleRate() const { return m_sampleRate; }
+	bool stereo() const { return m_bytesPerSample == 4; }
+	uint32_t numSamples() const { return m_numSamples; }
+	bool isOpen() const { return m_file != nullptr; }
+
+private:
+	FILE *m_file;
+	uint32_t m_sampleRate;
+	unsigned m_bytesPerSample;
+	uint32_t m_numSamples, m_samplesLeft;
+};
+
+#endif // __WAV_H
@@ -0,0 +1,127 @@
+// checks that OPLPlayer::generate never allocates memory once a song is loaded (see 'make test-alloc').
+// every song is played to the end (and then once more after a reset) with a few different setups,
+// and any call to operator new from inside generate makes the test fail.
+//
+// usage: alloc patch_path song_path [song_path ...]
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "player.h"
+
+static bool g_counting = false;
+static unsigned long g_allocs = 0;
+
+// ----------------------------------------------------------------------------
+static void* allocate(size_t size)
+{
+	if (g_counting)
+		g_allocs++;
+	
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+struct Setup
+{
+	const char *name;
+	OPLPlayer::ChipType chipType;
+	int numChips;
+	unsigned minChips; // elastic mode, if nonzero
+	bool stereo;
+	bool fixedPoint;
+	uint32_t sampleRate;
+};
+
+static const Setup setups[] =
+{
+	{"opl3",         OPLPlayer::ChipOPL3, 1, 0, true,  false, 44100},
+	{"opl3 x4 (e1)", OPLPlayer::ChipOPL3, 4, 1, true,  false, 48000},
+	{"opl2 x2 mono", OPLPlayer::ChipOPL2, 2, 0, false, false, 22050},
+	{"opl3 fixed",   OPLPlayer::ChipOPL3, 2, 0, true,  true,  44100},
+};
+
+// number of output samples generated at a time
+static const unsigned blockSize = 512;
+
+// ----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s patch_path song_path [song_path ...]\n", argv[0]);
+		return 1;
+	}
+	
+	auto patches = std::make_shared<PatchBank>();
+	if (!patches->load(argv[1]))
+	{
+		fprintf(stderr, "couldn't load %s\n", argv[1]);
+		return 1;
+	}
+	
+	int16_t buffer[blockSize * 2];
+	float floatBuffer[blockSize * 2];
+	unsigned numFailed = 0;
+	
+	for (int i = 2; i < argc; i++)
+	{
+		for (auto& setup : setups)
+		{
+			OPLPlayer player(setup.numChips, setup.chipType);
+			player.setPatches(patches);
+			if (!player.loadSequence(argv[i]))
+			{
+				fprintf(stderr, "couldn't load %s\n", argv[i]);
+				return 1;
+			}
+			
+			player.setLoop(false);
+			player.setSampleRate(setup.sampleRate);
+			player.setStereo(setup.stereo);
+			player.setMonoOutput(!player.stereo());
+			player.setFixedPoint(setup.fixedPoint);
+			if (setup.minChips)
+			{
+				player.setElastic(setup.minChips);
+				player.reset();
+			}
+			
+			unsigned long numBlocks = 0;
+			g_allocs = 0;
+			
+			// play the song through twice, using both versions of generate
+			for (int pass = 0; pass < 2; pass++)
+			{
+				while (!player.atEnd())
+				{
+					g_counting = true;
+					if (pass)
+						player.generate(floatBuffer, blockSize);
+					else
+						player.generate(buffer, blockSize);
+					g_counting = false;
+					numBlocks++;
+				}
+				player.reset();
+			}
+			
+			printf("%-8s  %-14s  %6lu blocks  %lu allocations  %s\n", g_allocs ? "FAILED" : "ok",
+				setup.name, numBlocks, g_allocs, argv[i]);
+			if (g_allocs)
+				numFailed++;
+		}
+	}
+	
+	return numFailed ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+// stand-in for ymfm's OPL3 emulator, used by the regression tests (see tests.txt).
+// it has just enough of ymfm's interface for ymfmidi to build against, and makes a simple sound from
+// each channel's frequency, key on/off, carrier level, attack/release rate and panning.
+// everything is integer math, so the test output only depends on what ymfmidi does and
+// stays the same on any compiler or CPU, or when the real ymfm is updated.
+
+#ifndef YMFM_OPL_H
+#define YMFM_OPL_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace ymfm
+{
+
+inline int32_t clamp(int32_t value, int32_t minval, int32_t maxval)
+{
+	if (value < minval)
+		return minval;
+	if (value > maxval)
+		return maxval;
+	return value;
+}
+
+template<int NumOutputs>
+struct ymfm_output
+{
+	ymfm_output& clear()
+	{
+		for (int i = 0; i < NumOutputs; i++)
+			data[i] = 0;
+		return *this;
+	}
+	
+	int32_t data[NumOutputs];
+};
+
+class ymfm_saved_state
+{
+public:
+	ymfm_saved_state(std::vector<uint8_t>& buffer, bool saving)
+		: m_buffer(buffer), m_offset(saving ? -1 : 0)
+	{
+		if (saving)
+			buffer.clear();
+	}
+	
+	bool saving() const { return m_offset < 0; }
+	
+	template<typename T>
+	void save_restore(T& data)
+	{
+		if (saving())
+		{
+			const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&data);
+			m_buffer.insert(m_buffer.end(), bytes, bytes + sizeof(T));
+		}
+		else
+		{
+			memcpy(&data, &m_buffer[m_offset], sizeof(T));
+			m_offset += sizeof(T);
+		}
+	}
+
+private:
+	std::vector<uint8_t>& m_buffer;
+	int32_t m_offset;
+};
+
+class ymfm_interface
+{
+public:
+	virtual ~ymfm_interface() {}
+};
+
+class ymf262
+{
+public:
+	typedef ymfm_output<4> output_data;
+	
+	ymf262(ymfm_interface& intf) { reset(); }
+	
+	void reset()
+	{
+		memset(m_regs, 0, sizeof(m_regs));
+		memset(m_phase, 0, sizeof(m_phase));
+		memset(m_env, 0, sizeof(m_env));
+		m_address = 0;
+	}
+	
+	void save_restore(ymfm_saved_state& state)
+	{
+		state.save_restore(m_regs);
+		state.save_restore(m_phase);
+		state.save_restore(m_env);
+		state.save_restore(m_address);
+	}
+	
+	uint32_t sample_rate(uint32_t clock) const { return clock / 288; }
+	
+	void write_address(uint8_t data) { m_address = data; }
+	void write_address_hi(uint8_t data) { m_address = 0x100 | data; }
+	void write_data(uint8_t data) { m_regs[m_address] = data; }
+	void write(uint32_t offset, uint8_t data)
+	{
+		if (offset & 1)
+			write_data(data);
+		else if (offset & 2)
+			write_address_hi(data);
+		else
+			write_address(data);
+	}
+	
+	void generate(output_data *output, uint32_t numsamples = 1)
+	{
+		// without OPL3 mode enabled, every channel goes to both outputs
+		const bool opl3 = m_regs[0x105] & 1;
+		
+		for (uint32_t samp = 0; samp < numsamples; samp++, output++)
+		{
+			output->clear();
+			
+			for (int ch = 0; ch < 18; ch++)
+			{
+				const int bank = (ch < 9) ? 0 : 0x100;
+				const int chReg = bank | (ch % 9);
+				const int opReg = bank | ((ch % 9) % 3 + 8 * ((ch % 9) / 3) + 3); // carrier
+				
+				const uint8_t keyBlock = m_regs[0xb0 + chReg];
+				if (keyBlock & 0x20)
+				{
+					if (m_env[ch] < envMax)
+						m_env[ch] = clamp(m_env[ch] + 1 + (m_regs[0x60 + opReg] >> 4), 0, envMax);
+				}
+				else if (m_env[ch] > 0)
+				{
+					m_env[ch] = clamp(m_env[ch] - 1 - (m_regs[0x80 + opReg] & 15), 0, envMax);
+				}
+				if (!m_env[ch])
+					continue;
+				
+				const uint32_t fnum = m_regs[0xa0 + chReg] | ((keyBlock & 3) << 8);
+				m_phase[ch] += fnum << ((keyBlock >> 2) & 7);
+				
+				// sawtooth or triangle wave, depending on the carrier's waveform
+				int32_t value = (int32_t)((m_phase[ch] >> 10) & 0x3ff) - 512;
+				if (m_regs[0xe0 + opReg] & 1)
+					value = 2 * (value < 0 ? -value : value) - 512;
+				value = value * m_env[ch] / envMax * (64 - (m_regs[0x40 + opReg] & 0x3f)) / 64;
+				
+				const uint8_t pan = opl3 ? m_regs[0xc0 + chReg] : 0x30;
+				if (pan & 0x10)
+					output->data[0] += value;
+				if (pan & 0x20)
+					output->data[1] += value;
+			}
+		}
+	}
+
+private:
+	static const int32_t envMax = 4096;
+	
+	uint8_t m_regs[0x200];
+	uint32_t m_phase[18];
+	int32_t m_env[18];
+	uint16_t m_address;
+};
+
+}
+
+#endif // YMFM_OPL_H
@@ -0,0 +1,385 @@
+#!/usr/bin/env python3
+# generates the songs and patch banks in test/corpus, which are used by 'make test' (see tests.txt).
+# everything comes from a fixed-seed generator, so the output is the same on every run and every
+# version of Python. after changing this, regenerate the corpus and then run 'make test-update'.
+#
+# usage: gencorpus.py out_dir
+
+import os
+import struct
+import sys
+
+class Random:
+	# 32-bit LCG (same constants as Numerical Recipes)
+	def __init__(self, seed):
+		self.state = seed & 0xffffffff
+
+	def next(self):
+		self.state = (self.state * 1664525 + 1013904223) & 0xffffffff
+		return self.state >> 8
+
+	def range(self, lo, hi=None):
+		if hi is None:
+			lo, hi = 0, lo
+		return lo + self.next() % (hi - lo)
+
+	def choice(self, items):
+		return items[self.range(len(items))]
+
+	def bytes(self, num):
+		return bytes(self.range(256) for _ in range(num))
+
+def vlq(n):
+	out = [n & 0x7f]
+	n >>= 7
+	while n:
+		out.append((n & 0x7f) | 0x80)
+		n >>= 7
+	return bytes(reversed(out))
+
+# ----------------------------------------------------------------------------
+# random MIDI events for one channel: (time, bytes[, note length])
+def events(seed, ch, length):
+	r = Random(seed)
+	ev = [(0, bytes([0xc0 | ch, r.range(128)])),
+	      (0, bytes([0xb0 | ch, 7, 100])),
+	      (0, bytes([0xb0 | ch, 10, r.range(128)]))]
+	t = 0
+	while t < length:
+		t += r.choice([0, 0, 6, 12, 24, 48])
+		note = r.range(35, 82) if ch == 9 else r.range(30, 90)
+		ev.append((t, bytes([0x90 | ch, note, r.range(1, 128)]), r.choice([6, 12, 24, 48])))
+
+		k = r.range(100)
+		if k < 5:
+			ev.append((t, bytes([0xe0 | ch, r.range(128), r.range(128)])))
+		elif k < 8:
+			ev.append((t, bytes([0xc0 | ch, r.range(128)])))
+		elif k < 10:
+			ev.append((t, bytes([0xb0 | ch, 10, r.range(128)])))
+		elif k < 11:
+			# pitch bend range (RPN 0)
+			ev.append((t, bytes([0xb0 | ch, 101, 0])))
+			ev.append((t, bytes([0xb0 | ch, 100, 0])))
+			ev.append((t, bytes([0xb0 | ch, 6, r.range(1, 13)])))
+		elif k < 12:
+			ev.append((t, bytes([0xb0 | ch, 1, r.range(128)])))
+	return ev
+
+# note ons and offs in time order, as (time, bytes)
+def flatten(ev):
+	flat = []
+	for e in ev:
+		flat.append((e[0], e[1]))
+		if len(e) > 2:
+			flat.append((e[0] + e[2], bytes([0x80 | (e[1][0] & 15), e[1][1], 0])))
+	flat.sort(key=lambda e: e[0])
+	return flat
+
+# tempo (0.5s per beat) and a GS reset
+songStart = b'\x00\xff\x51\x03\x07\xa1\x20' + b'\x00\xf0\x0a\x41\x10\x42\x12\x40\x00\x7f\x00\x41\xf7'
+
+def midTrack(ev, start=b''):
+	out = bytearray(start)
+	last = 0
+	for t, data in flatten(ev):
+		out += vlq(t - last) + data
+		last = t
+	out += b'\x00\xff\x2f\x00'
+	return b'MTrk' + struct.pack('>I', len(out)) + bytes(out)
+
+def mid(fmt, division, tracks):
+	return b'MThd' + struct.pack('>IHHH', 6, fmt, len(tracks), division) + b''.join(tracks)
+
+def chunk(name, data):
+	if len(data) & 1:
+		data += b'\x00'
+	return name + struct.pack('>I', len(data)) + data
+
+# ----------------------------------------------------------------------------
+def genMID(out):
+	# format 0: everything in one track
+	ev = []
+	for i, ch in enumerate([0, 9, 5]):
+		ev += events(200 + i, ch, 160)
+	out['f0.mid'] = mid(0, 120, [midTrack(ev, songStart)])
+
+	# format 1: one channel per track
+	tracks = [midTrack(events(i, ch, 128), songStart if i == 0 else b'')
+	          for i, ch in enumerate([0, 1, 2, 9, 3, 4, 5, 6])]
+	out['f1.mid'] = mid(1, 96, tracks)
+
+	# format 2: two songs
+	tracks = [midTrack(events(300 + i, ch, 64), songStart) for i, ch in enumerate([0, 9])]
+	out['f2.mid'] = mid(2, 96, tracks)
+
+	# lots of short notes on every channel at once (needs more than one chip)
+	tracks = [midTrack(events(100 + i, i % 16, 64), songStart if i == 0 else b'') for i in range(40)]
+	out['busy.mid'] = mid(1, 96, tracks)
+
+	# RIFF MIDI
+	data = mid(1, 96, [midTrack(events(700 + i, ch, 128), songStart if i == 0 else b'')
+	                   for i, ch in enumerate([0, 9, 7])])
+	out['song.rmi'] = b'RIFF' + struct.pack('<I', len(data) + 12) + b'RMID' \
+		+ b'data' + struct.pack('<I', len(data)) + data
+
+def genMUS(out):
+	r = Random(7)
+	body = bytearray()
+	for step in range(30):
+		ch = r.choice([0, 1, 2, 15])
+		note = r.range(30, 90)
+		k = r.range(100)
+		if k < 50:
+			ev = bytearray([0x10 | ch, 0x80 | note, r.range(1, 128)]) # note on with volume
+		elif k < 80:
+			ev = bytearray([0x00 | ch, note]) # note off
+		elif k < 85:
+			ev = bytearray([0x40 | ch, 0, r.range(128)]) # program change
+		elif k < 90:
+			ev = bytearray([0x20 | ch, r.range(256)]) # pitch bend
+		else:
+			ev = bytearray([0x40 | ch, 4, r.range(128)]) # pan
+		ev[0] |= 0x80
+		body += ev + vlq(r.choice([1, 2, 5, 10]))
+	body += b'\x60' # end of song
+	out['song.mus'] = b'MUS\x1a' + struct.pack('<HHHHH', len(body), 16, 4, 0, 0) + bytes(body)
+
+def genXMI(out):
+	def evnt(ev):
+		# note ons include their length instead of having separate note offs
+		out = bytearray()
+		last = 0
+		for e in sorted(ev, key=lambda e: e[0]):
+			delay = e[0] - last
+			last = e[0]
+			while delay > 0x7f:
+				out.append(0x7f)
+				delay -= 0x7f
+			if delay:
+				out.append(delay)
+			out += e[1]
+			if len(e) > 2:
+				out += vlq(e[2])
+		out += b'\xff\x2f\x00'
+		return bytes(out)
+
+	# two songs
+	songs = []
+	for song in range(2):
+		ev = []
+		for i, ch in enumerate([0, 1, 9, 4]):
+			ev += events(400 + song * 10 + i, ch, 64)
+		songs.append(chunk(b'FORM', b'XMID' + chunk(b'EVNT', evnt(ev))))
+
+	xdir = chunk(b'FORM', b'XDIR' + chunk(b'INFO', struct.pack('<H', len(songs))))
+	out['song.xmi'] = xdir + chunk(b'CAT ', b'XMID' + b''.join(songs))
+
+def genHMP(out):
+	def delay(n):
+		out = bytearray()
+		while True:
+			b = n & 0x7f
+			n >>= 7
+			if not n:
+				out.append(b | 0x80)
+				break
+			out.append(b)
+		return bytes(out)
+
+	def track(ev, num):
+		out = bytearray()
+		last = 0
+		for t, data in flatten(ev):
+			out += delay(t - last) + data
+			last = t
+		out += delay(0) + b'\xff\x2f\x00' + b'\x00\x00\x00'
+		return struct.pack('<III', num, len(out) + 12, 0) + bytes(out)
+
+	tracks = [track(events(500 + i, ch, 96), i) for i, ch in enumerate([0, 9, 3])]
+	header = bytearray(0x308)
+	header[0:8] = b'HMIMIDIP'
+	struct.pack_into('<III', header, 0x30, len(tracks), 96, 120)
+	out['song.hmp'] = bytes(header) + b''.join(tracks) + b'\x00' * 16
+
+def genHMI(out):
+	tracks = []
+	for i, ch in enumerate([0, 9, 2]):
+		data = bytearray()
+		last = 0
+		for e in sorted(events(600 + i, ch, 128), key=lambda e: e[0]):
+			data += vlq(e[0] - last) + e[1]
+			last = e[0]
+			if len(e) > 2:
+				data += vlq(e[2])
+		data += b'\x00\xff\x2f\x00'
+
+		header = bytearray(0x5b)
+		header[0:13] = b'HMI-MIDITRACK'
+		struct.pack_into('<I', header, 0x57, len(header))
+		tracks.append(bytes(header) + bytes(data))
+
+	header = bytearray(0x100)
+	header[0:18] = b'HMI-MIDISONG061595'
+	struct.pack_into('<HH', header, 0xd2, 60, 120)
+	table = len(header)
+	struct.pack_into('<II', header, 0xe4, len(tracks), table)
+
+	# each track ends where the next one starts (or at the end of the file)
+	data = bytearray(header) + b'\x00' * (4 * len(tracks))
+	offset = len(data)
+	for i, t in enumerate(tracks):
+		struct.pack_into('<I', data, table + 4 * i, offset)
+		offset += len(t)
+	out['song.hmi'] = bytes(data) + b''.join(tracks)
+
+# ----------------------------------------------------------------------------
+# register writes for a simple tune on 'numVoices' 2-op voices, as (time in ms, register, value)
+def regWrites(seed, numVoices, opl3):
+	r = Random(seed)
+	writes = []
+	if opl3:
+		writes.append((0, 0x105, 1))
+	writes.append((0, 0x01, 0x20))
+
+	for v in range(numVoices):
+		bank = 0x100 if v >= 9 else 0
+		ch = v % 9
+		op = (ch % 3) + 8 * (ch // 3)
+		for reg in [0x20, 0x40, 0x60, 0x80, 0xe0]:
+			writes.append((0, bank | (reg + op), r.range(256)))
+			writes.append((0, bank | (reg + op + 3), r.range(256) & (0x3f if reg == 0x40 else 0xff)))
+		writes.append((0, bank | (0xc0 + ch), r.range(16) | (0x30 if opl3 else 0)))
+
+	t = 0
+	for step in range(10):
+		t += r.choice([10, 50, 100, 200])
+		v = r.range(numVoices)
+		bank = 0x100 if v >= 9 else 0
+		ch = v % 9
+		fnum = r.range(0x150, 0x2b0)
+		block = r.range(2, 6)
+		writes.append((t, bank | (0xb0 + ch), (fnum >> 8) | (block << 2))) # key off
+		writes.append((t, bank | (0xa0 + ch), fnum & 0xff))
+		writes.append((t, bank | (0xb0 + ch), 0x20 | (fnum >> 8) | (block << 2)))
+
+	# let the last notes ring out
+	writes.append((t + 300, 0x01, 0x20))
+	return writes
+
+def genVGM(out):
+	def vgm(writes, opl3, dual=False):
+		data = bytearray()
+		last = 0
+		for t, reg, value in writes:
+			samples = (t - last) * 441 // 10
+			last = t
+			while samples:
+				n = min(samples, 0xffff)
+				data += b'\x61' + struct.pack('<H', n)
+				samples -= n
+			if opl3:
+				data += bytes([0x5f if reg & 0x100 else 0x5e, reg & 0xff, value])
+			else:
+				data += bytes([0xaa if reg & 0x100 else 0x5a, reg & 0xff, value])
+		data += b'\x66'
+
+		header = bytearray(0x80)
+		header[0:4] = b'Vgm '
+		struct.pack_into('<I', header, 0x04, len(header) + len(data) - 4)
+		struct.pack_into('<I', header, 0x08, 0x151)
+		struct.pack_into('<I', header, 0x18, last * 441 // 10)
+		struct.pack_into('<I', header, 0x34, len(header) - 0x34)
+		if opl3:
+			struct.pack_into('<I', header, 0x5c, 14318180)
+		else:
+			struct.pack_into('<I', header, 0x50, 3579545 | (0x40000000 if dual else 0))
+		return bytes(header) + bytes(data)
+
+	out['opl3.vgm'] = vgm(regWrites(800, 18, True), True)
+	# second chip's writes are sent with the OPL3 high register bit set
+	out['dual.vgm'] = vgm(regWrites(801, 18, False), False, True)
+
+def genDRO(out):
+	writes = regWrites(900, 9, False)
+	codemap = sorted(set(reg for t, reg, value in writes))
+
+	data = bytearray()
+	last = 0
+	for t, reg, value in writes:
+		delay = t - last
+		last = t
+		while delay >= 256:
+			n = min(delay >> 8, 256)
+			data += bytes([0xfe, n - 1]) # long delay
+			delay -= n << 8
+		if delay:
+			data += bytes([0xfd, delay - 1]) # short delay
+		data += bytes([codemap.index(reg), value])
+
+	header = b'DBRAWOPL' + struct.pack('<HHII', 2, 0, len(data) // 2, last) \
+		+ bytes([0, 0, 0, 0xfd, 0xfe, len(codemap)]) + bytes(codemap)
+	out['opl2.dro'] = header + bytes(data)
+
+# ----------------------------------------------------------------------------
+def genOP2(out):
+	r = Random(99)
+	data = bytearray(b'#OPL_II#')
+	for i in range(175):
+		patch = bytearray(r.bytes(36))
+		patch[0] = r.choice([0, 4]) # normal or double voice
+		patch[1] = 0
+		patch[2] = 128 + r.range(10) - 5 # fine tune
+		patch[3] = r.range(30, 80) # fixed note
+		for j in [19, 20, 34, 35]:
+			patch[j] = 0 # note offsets and unused bytes
+		data += patch
+	for i in range(175):
+		data += (b'patch %03d' % i).ljust(32, b'\x00')
+	out['bank.op2'] = bytes(data)
+
+def genTMB(out):
+	r = Random(98)
+	data = bytearray()
+	for i in range(256):
+		patch = bytearray(r.bytes(13))
+		patch[8] &= 3 # waveforms
+		patch[9] &= 3
+		patch[10] &= 15 # feedback/connection
+		patch[11] = 12 # transpose
+		patch[12] = 0 # percussion velocity
+		data += patch
+	out['bank.tmb'] = bytes(data)
+
+def genAIL(out):
+	# 128 melodic patches and a drum kit, with a mix of 2-op and 4-op patches
+	r = Random(97)
+	entries = [(i, 0) for i in range(128)] + [(i, 0x7f) for i in range(35, 82)]
+	index = bytearray()
+	patches = bytearray()
+	base = 6 * len(entries) + 2
+	for num, bank in entries:
+		size = 0x19 if r.range(10) < 3 else 0x0e
+		patch = bytearray(r.bytes(size))
+		patch[0] = size
+		patch[1] = 0
+		patch[2] = 12 # transpose
+		index += bytes([num, bank]) + struct.pack('<I', base + len(patches))
+		patches += patch
+	index += b'\xff\xff'
+	out['bank.ad'] = bytes(index + patches)
+
+# ----------------------------------------------------------------------------
+if __name__ == '__main__':
+	if len(sys.argv) != 2:
+		print('usage: gencorpus.py out_dir')
+		sys.exit(1)
+
+	out = {}
+	for gen in [genMID, genMUS, genXMI, genHMP, genHMI, genVGM, genDRO, genOP2, genTMB, genAIL]:
+		gen(out)
+
+	os.makedirs(sys.argv[1], exist_ok=True)
+	for name, data in out.items():
+		with open(os.path.join(sys.argv[1], name), 'wb') as f:
+			f.write(data)
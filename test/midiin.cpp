@@ -0,0 +1,194 @@
+// checks that MIDIInput turns raw MIDI bytes back into the right messages (see 'make test-midiin').
+// each test stream is sent all at once, split into two reads at every possible point, and one byte at a time,
+// and every way has to send the player exactly the same messages as sending the expected ones directly.
+//
+// usage: midiin patch_path
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "midiin.h"
+#include "player.h"
+#include "trace.h"
+
+// one expected message: a MIDI event, or a sysex (without its opening 0xF0) if 'sysEx' isn't empty
+struct Message
+{
+	uint8_t status, data0, data1;
+	std::vector<uint8_t> sysEx;
+};
+
+struct Test
+{
+	const char *name;
+	std::vector<uint8_t> input;
+	std::vector<Message> expected;
+};
+
+static std::shared_ptr<const PatchBank> g_patches;
+
+// ----------------------------------------------------------------------------
+// get the messages recorded by a trace, which are compared instead of the messages themselves
+static std::vector<uint8_t> traceData(const MIDITrace& trace)
+{
+	std::vector<uint8_t> data;
+	
+	FILE *file = tmpfile();
+	if (!file || !trace.save(file))
+	{
+		fprintf(stderr, "couldn't save MIDI trace\n");
+		exit(1);
+	}
+	
+	data.resize(ftell(file));
+	rewind(file);
+	if (fread(data.data(), 1, data.size(), file) != data.size())
+	{
+		fprintf(stderr, "couldn't read MIDI trace\n");
+		exit(1);
+	}
+	fclose(file);
+	
+	return data;
+}
+
+// ----------------------------------------------------------------------------
+// send the messages directly to a player
+static std::vector<uint8_t> expected(const Test& test)
+{
+	OPLPlayer player;
+	player.setPatches(g_patches);
+	MIDITrace trace;
+	player.setTrace(&trace);
+	
+	for (auto& message : test.expected)
+	{
+		if (message.sysEx.empty())
+			player.midiEvent(message.status, message.data0, message.data1);
+		else
+			player.midiSysEx(message.sysEx.data(), message.sysEx.size());
+	}
+	
+	player.setTrace(nullptr);
+	return traceData(trace);
+}
+
+// ----------------------------------------------------------------------------
+// send the test's input to a player through MIDIInput, in reads ending at each of 'splits'
+static std::vector<uint8_t> received(const Test& test, const std::vector<size_t>& splits, uint64_t& numEvents)
+{
+	OPLPlayer player;
+	player.setPatches(g_patches);
+	MIDITrace trace;
+	player.setTrace(&trace);
+	
+	MIDIInput input;
+	size_t pos = 0;
+	for (size_t split : splits)
+	{
+		input.input(player, test.input.data() + pos, split - pos);
+		pos = split;
+	}
+	input.input(player, test.input.data() + pos, test.input.size() - pos);
+	numEvents = input.numEvents();
+	
+	player.setTrace(nullptr);
+	return traceData(trace);
+}
+
+// ----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s patch_path\n", argv[0]);
+		return 1;
+	}
+	
+	auto patches = std::make_shared<PatchBank>();
+	if (!patches->load(argv[1]))
+	{
+		fprintf(stderr, "couldn't load %s\n", argv[1]);
+		return 1;
+	}
+	g_patches = patches;
+	
+	// a sysex longer than MIDIInput keeps, which should be dropped
+	std::vector<uint8_t> longSysEx = {0xF0, 0x7D};
+	longSysEx.resize(2000, 0x55);
+	longSysEx.push_back(0xF7);
+	longSysEx.insert(longSysEx.end(), {0x90, 0x3C, 0x40});
+	
+	const std::vector<Test> tests =
+	{
+		{"running status",
+			{0x90, 0x3C, 0x40, 0x3E, 0x40, 0x40, 0x00, 0xC1, 0x05, 0x06, 0xE2, 0x00, 0x40, 0x7F, 0x7F},
+			{{0x90, 0x3C, 0x40}, {0x90, 0x3E, 0x40}, {0x90, 0x40, 0x00}, {0xC1, 0x05}, {0xC1, 0x06},
+			 {0xE2, 0x00, 0x40}, {0xE2, 0x7F, 0x7F}}},
+		{"realtime bytes mid-message",
+			{0xF8, 0x90, 0xFA, 0x3C, 0xF8, 0x40, 0xFE, 0x3E, 0xFF, 0x40, 0xB0, 0x07, 0xF8, 0x64, 0xC0, 0xFC, 0x10},
+			{{0x90, 0x3C, 0x40}, {0x90, 0x3E, 0x40}, {0xB0, 0x07, 0x64}, {0xC0, 0x10}}},
+		{"sysex",
+			{0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7, 0x90, 0x3C, 0x40, 0xF0, 0x43, 0xF8, 0x10, 0x4C, 0xF7},
+			{{0, 0, 0, {0x7E, 0x7F, 0x09, 0x01, 0xF7}}, {0x90, 0x3C, 0x40}, {0, 0, 0, {0x43, 0x10, 0x4C, 0xF7}}}},
+		{"sysex ended by a status byte",
+			{0xF0, 0x41, 0x10, 0x42, 0x91, 0x3C, 0x40},
+			{{0, 0, 0, {0x41, 0x10, 0x42}}, {0x91, 0x3C, 0x40}}},
+		{"long sysex",
+			longSysEx,
+			{{0x90, 0x3C, 0x40}}},
+		{"system common messages",
+			{0x90, 0x3C, 0x40, 0xF1, 0x01, 0x3E, 0x40, 0xF2, 0x10, 0x20, 0x30, 0xF3, 0x02, 0x92, 0x3C, 0x40},
+			{{0x90, 0x3C, 0x40}, {0x92, 0x3C, 0x40}}},
+		{"data without a status",
+			{0x3C, 0x40, 0x90, 0x3C, 0x40, 0xF7, 0x3E, 0x40},
+			{{0x90, 0x3C, 0x40}}},
+		{"interrupted message",
+			{0x90, 0x3C, 0xB0, 0x07, 0x64, 0x90, 0x3E, 0x40},
+			{{0xB0, 0x07, 0x64}, {0x90, 0x3E, 0x40}}},
+	};
+	
+	unsigned numFailed = 0;
+	
+	for (auto& test : tests)
+	{
+		const auto data = expected(test);
+		
+		// all at once, split in two at each byte, then one byte at a time
+		std::vector<std::vector<size_t>> splitList = {{}};
+		for (size_t i = 1; i < test.input.size(); i++)
+			splitList.push_back({i});
+		splitList.push_back({});
+		for (size_t i = 1; i < test.input.size(); i++)
+			splitList.back().push_back(i);
+		
+		std::string error;
+		for (auto& splits : splitList)
+		{
+			uint64_t numEvents;
+			if (received(test, splits, numEvents) != data)
+			{
+				if (splits.empty())
+					error = "wrong messages";
+				else if (splits.size() == 1)
+					error = "wrong messages when split after byte " + std::to_string(splits[0]);
+				else
+					error = "wrong messages when sent one byte at a time";
+				break;
+			}
+			else if (numEvents != test.expected.size())
+			{
+				error = std::to_string(numEvents) + " messages counted, expected "
+					+ std::to_string(test.expected.size());
+				break;
+			}
+		}
+		
+		printf("%-8s  %s%s%s\n", error.empty() ? "ok" : "FAILED", test.name, error.empty() ? "" : ": ", error.c_str());
+		if (!error.empty())
+			numFailed++;
+	}
+	
+	return numFailed ? 1 : 0;
+}